@@ -0,0 +1,115 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+
+#define MPOL_PREFERRED 1
+
+static int parse(const char *list, cpu_set_t *set)
+{
+  const char *p = list;
+
+  CPU_ZERO(set);
+  while(*p && *p != '\n')  {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if(end == p || first < 0)
+      return -1;
+    p = end;
+    if(*p == '-')  {
+      last = strtol(p + 1, &end, 10);
+      if(end == p + 1 || last < first)
+        return -1;
+      p = end;
+    }
+    if(last >= CPU_SETSIZE)
+      return -1;
+    for(; first <= last; first++)
+      CPU_SET(first, set);
+    if(*p == ',')
+      p++;
+    else if(*p && *p != '\n')
+      return -1;
+  }
+  return CPU_COUNT(set) ? 0 : -1;
+}
+
+static int node_cpus(int node, char *list, int size)
+{
+  char path[128];
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if(!f)
+    return -1;
+  char *ok = fgets(list, size, f);
+  fclose(f);
+  return ok ? 0 : -1;
+}
+
+int Affinity_PinCpus(const char *cpus, int numaNode)
+{
+  char list[1024];
+  cpu_set_t set;
+
+  if(!cpus)  {
+    if(numaNode < 0)
+      return 0;
+    if(node_cpus(numaNode, list, sizeof(list)) < 0)
+      return -1;
+    cpus = list;
+  }
+
+  if(parse(cpus, &set) < 0)
+    return -1;
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int Affinity_PreferNode(int numaNode)
+{
+  if(numaNode < 0)
+    return 0;
+#ifdef SYS_set_mempolicy
+  if(numaNode >= (int)sizeof(unsigned long) * 8)
+    return -1;
+  unsigned long mask = 1UL << numaNode;
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) == 0 ? 0 : -1;
+#else
+  return -1;
+#endif
+}
+
+int Affinity_Count(const char *cpus)
+{
+  cpu_set_t set;
+  if(parse(cpus, &set) < 0)
+    return -1;
+  return CPU_COUNT(&set);
+}
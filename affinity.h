@@ -0,0 +1,41 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/*
+ * CPU and NUMA placement of the calling thread. CPU lists are written
+ * as in /sys, e.g. "0-3,8,10-11". NUMA nodes come from /sys as well,
+ * no libnuma is needed.
+ */
+
+/*
+ * Pin the calling thread to cpus or, when cpus is NULL, to the CPUs of
+ * numaNode. NULL and -1 leave it floating. Returns -1 when the list is
+ * malformed, the node unknown or the kernel refused.
+ */
+int Affinity_PinCpus(const char *cpus, int numaNode);
+/* prefer memory from numaNode for the calling thread's new allocations */
+int Affinity_PreferNode(int numaNode);
+/* number of CPUs in a list, -1 when it is malformed */
+int Affinity_Count(const char *cpus);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_AV_CONFIG_H
+#undef HAVE_AV_CONFIG_H
+#endif
+
+#include "libavcodec/avcodec.h"
+
+#include "gopring.h"
+
+/* descriptors preallocated per slab, enough for small P-frames */
+#define MIN_UNIT_SIZE 512
+
+typedef struct GopRingDesc {
+  int offset;
+  int size;
+  int flags;
+  unsigned int timestamp;
+  int64_t pts;
+} GopRingDesc;
+
+struct GopRing {
+  uint8_t *slab;
+  int maxBytes;
+  int preMs;
+
+  GopRingDesc *desc;
+  int maxUnits;
+  int64_t first;    /* oldest descriptor, counts up, index modulo maxUnits */
+  int count;
+  int tail;         /* next free byte in the slab */
+
+  /* units held for a reader after they may have left the ring */
+  int64_t pinStart;
+  int64_t pinEnd;
+  int pinned;       /* not yet released, counted down by the reader */
+};
+
+GopRing *GopRing_Create(int maxBytes, int preMs)
+{
+  GopRing *r = calloc(1, sizeof(GopRing));
+  if(!r)
+    return NULL;
+
+  r->maxBytes = maxBytes;
+  r->preMs = preMs;
+  r->maxUnits = maxBytes / MIN_UNIT_SIZE + 1;
+  r->slab = av_malloc(maxBytes);
+  r->desc = calloc(r->maxUnits, sizeof(GopRingDesc));
+  if(!r->slab || !r->desc) {
+    GopRing_Destroy(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+void GopRing_Destroy(GopRing *r)
+{
+  if(!r)
+    return;
+  av_free(r->slab);
+  free(r->desc);
+  free(r);
+}
+
+static inline GopRingDesc *desc_at(GopRing *r, int i)
+{
+  return &r->desc[(r->first + i) % r->maxUnits];
+}
+
+/* Index of the second IDR, the start of the GOP after the oldest one */
+static int next_gop(GopRing *r)
+{
+  int i;
+  for(i = 1; i < r->count; i++) {
+    if(desc_at(r, i)->flags & PKT_FLAG_KEY)
+      return i;
+  }
+  return -1;
+}
+
+static void evict(GopRing *r, int n)
+{
+  r->first += n;
+  r->count -= n;
+}
+
+/* Oldest descriptor still in use, pinned or in the ring */
+static int64_t oldest(GopRing *r)
+{
+  int pinned = __atomic_load_n(&r->pinned, __ATOMIC_ACQUIRE);
+  if(pinned > 0 && r->pinEnd - pinned < r->first)
+    return r->pinEnd - pinned;
+  return r->first;
+}
+
+/* Slab offset for size bytes, or -1 when the slab is full */
+static int place(GopRing *r, int64_t head64, int size)
+{
+  if(head64 == r->first + r->count) {
+    r->tail = 0;
+    return size <= r->maxBytes ? 0 : -1;
+  }
+
+  int head = r->desc[head64 % r->maxUnits].offset;
+  if(r->tail > head) {
+    if(r->maxBytes - r->tail >= size)
+      return r->tail;
+    if(head >= size)
+      return 0;   /* wrap */
+  } else if(r->tail < head) {
+    if(head - r->tail >= size)
+      return r->tail;
+  }
+  return -1;
+}
+
+void GopRing_Add(GopRing *r, const uint8_t *data, int size, int flags,
+                 unsigned int timestamp, int64_t pts)
+{
+  /* the ring always starts at an IDR */
+  if(r->count == 0 && !(flags & PKT_FLAG_KEY))
+    return;
+
+  int offset;
+  for(;;) {
+    int64_t head = oldest(r);
+    if(r->first + r->count - head < r->maxUnits && (offset = place(r, head, size)) >= 0)
+      break;
+
+    /* what is left is pinned by a reader */
+    if(r->count == 0)
+      return;
+
+    int n = next_gop(r);
+    if(n < 0) {
+      /* a single GOP over budget, start over at the next IDR */
+      evict(r, r->count);
+      if(!(flags & PKT_FLAG_KEY) || size > r->maxBytes)
+        return;
+    } else {
+      evict(r, n);
+    }
+  }
+
+  GopRingDesc *d = desc_at(r, r->count);
+  d->offset = offset;
+  d->size = size;
+  d->flags = flags;
+  d->timestamp = timestamp;
+  d->pts = pts;
+  memcpy(r->slab + offset, data, size);
+  r->tail = offset + size;
+  r->count++;
+
+  /* drop the oldest GOP while the following ones cover the pre-event time */
+  for(;;) {
+    int n = next_gop(r);
+    if(n < 0 || (timestamp - desc_at(r, n)->timestamp) / 90 < r->preMs)
+      break;
+    evict(r, n);
+  }
+}
+
+int GopRing_Count(GopRing *r)
+{
+  return r->count;
+}
+
+static void get(GopRing *r, GopRingDesc *d, GopRingUnit *u)
+{
+  u->data = r->slab + d->offset;
+  u->size = d->size;
+  u->flags = d->flags;
+  u->timestamp = d->timestamp;
+  u->pts = d->pts;
+}
+
+void GopRing_Get(GopRing *r, int i, GopRingUnit *u)
+{
+  get(r, desc_at(r, i), u);
+}
+
+int GopRing_Pin(GopRing *r)
+{
+  if(__atomic_load_n(&r->pinned, __ATOMIC_ACQUIRE) > 0)
+    return -1;
+
+  r->pinStart = r->first;
+  r->pinEnd = r->first + r->count;
+  __atomic_store_n(&r->pinned, r->count, __ATOMIC_RELEASE);
+  return r->count;
+}
+
+void GopRing_GetPinned(GopRing *r, int i, GopRingUnit *u)
+{
+  get(r, &r->desc[(r->pinStart + i) % r->maxUnits], u);
+}
+
+void GopRing_Release(GopRing *r)
+{
+  __atomic_sub_fetch(&r->pinned, 1, __ATOMIC_RELEASE);
+}
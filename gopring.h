@@ -0,0 +1,60 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef GOPRING_H
+#define GOPRING_H
+
+#include <stdint.h>
+
+/*
+ * Pre-event ring of access units in a fixed, preallocated slab.
+ * The oldest unit held is always an IDR, and whole GOPs are evicted
+ * only once the GOPs after them still cover the pre-event time.
+ */
+
+typedef struct GopRingUnit {
+  const uint8_t *data;
+  int size;
+  int flags;
+  unsigned int timestamp;
+  int64_t pts;
+} GopRingUnit;
+
+typedef struct GopRing GopRing;
+
+GopRing *GopRing_Create(int maxBytes, int preMs);
+void GopRing_Destroy(GopRing *r);
+void GopRing_Add(GopRing *r, const uint8_t *data, int size, int flags,
+                 unsigned int timestamp, int64_t pts);
+int GopRing_Count(GopRing *r);
+void GopRing_Get(GopRing *r, int i, GopRingUnit *u);  /* 0 is the oldest */
+
+/*
+ * Hand every unit held now to a reader on another thread without a copy.
+ * Their slab space is not reused until the reader released each one, in
+ * order; units added meanwhile that do not fit are dropped. Returns how
+ * many were pinned, -1 while an earlier pin is still being read.
+ */
+int GopRing_Pin(GopRing *r);
+/* reader side: 0 is the oldest pinned unit */
+void GopRing_GetPinned(GopRing *r, int i, GopRingUnit *u);
+void GopRing_Release(GopRing *r);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_AV_CONFIG_H
+#undef HAVE_AV_CONFIG_H
+#endif
+
+#include "libavcodec/avcodec.h"
+
+#include "h264ps.h"
+
+#define MAX_SPS 32
+#define MAX_PPS 256
+#define MAX_RBSP 1024   /* SPS bytes looked at, well past anything real */
+
+typedef struct ParamSet {
+  uint8_t *data;        /* NAL unit, header byte included */
+  int size;
+  int width;            /* SPS */
+  int height;
+  int spsId;            /* PPS */
+} ParamSet;
+
+struct H264Ps {
+  ParamSet sps[MAX_SPS];
+  ParamSet pps[MAX_PPS];
+  int lastSps;          /* id of the latest SPS, -1 if none */
+};
+
+typedef struct BitReader {
+  const uint8_t *data;
+  int size;
+  int pos;              /* in bits */
+} BitReader;
+
+static int get_bit(BitReader *br)
+{
+  if(br->pos >= br->size * 8)
+    return 0;
+  int bit = (br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1;
+  br->pos++;
+  return bit;
+}
+
+static unsigned int get_bits(BitReader *br, int n)
+{
+  unsigned int v = 0;
+  while(n-- > 0)
+    v = (v << 1) | get_bit(br);
+  return v;
+}
+
+/* Exp-Golomb ue(v) */
+static unsigned int get_ue(BitReader *br)
+{
+  int zeros = 0;
+  while(!get_bit(br) && zeros < 32)
+    zeros++;
+  return ((1u << zeros) - 1) + get_bits(br, zeros);
+}
+
+static int get_se(BitReader *br)
+{
+  unsigned int v = get_ue(br);
+  return (v & 1) ? (int)((v + 1) / 2) : -(int)(v / 2);
+}
+
+/* Strip emulation prevention bytes, returns the RBSP size */
+static int unescape(const uint8_t *src, int size, uint8_t *dst, int max)
+{
+  int i, n = 0, zeros = 0;
+  for(i = 0; i < size && n < max; i++) {
+    if(zeros >= 2 && src[i] == 0x03) {
+      zeros = 0;
+      continue;
+    }
+    zeros = (src[i] == 0) ? zeros + 1 : 0;
+    dst[n++] = src[i];
+  }
+  return n;
+}
+
+static void skip_scaling_list(BitReader *br, int size)
+{
+  int i, last = 8, next = 8;
+  for(i = 0; i < size && next != 0; i++) {
+    next = (last + get_se(br) + 256) % 256;
+    if(next != 0)
+      last = next;
+  }
+}
+
+/* Returns the SPS id, -1 when malformed */
+static int parse_sps(const uint8_t *nal, int size, int *width, int *height)
+{
+  uint8_t rbsp[MAX_RBSP];
+  BitReader br;
+
+  br.size = unescape(nal + 1, size - 1, rbsp, MAX_RBSP);
+  br.data = rbsp;
+  br.pos = 0;
+  if(br.size < 4)
+    return -1;
+
+  int profile = get_bits(&br, 8);
+  get_bits(&br, 16);  /* constraint flags, level */
+  unsigned int id = get_ue(&br);
+  if(id >= MAX_SPS)
+    return -1;
+
+  int chroma = 1;
+  int separate = 0;
+  if(profile == 100 || profile == 110 || profile == 122 || profile == 244 ||
+     profile == 44 || profile == 83 || profile == 86 || profile == 118 ||
+     profile == 128 || profile == 138 || profile == 139 || profile == 134) {
+    chroma = get_ue(&br);
+    if(chroma == 3)
+      separate = get_bit(&br);
+    get_ue(&br);      /* bit_depth_luma_minus8 */
+    get_ue(&br);      /* bit_depth_chroma_minus8 */
+    get_bit(&br);     /* qpprime_y_zero_transform_bypass_flag */
+    if(get_bit(&br)) {  /* seq_scaling_matrix_present_flag */
+      int i;
+      for(i = 0; i < (chroma != 3 ? 8 : 12); i++)
+        if(get_bit(&br))
+          skip_scaling_list(&br, i < 6 ? 16 : 64);
+    }
+  }
+
+  get_ue(&br);        /* log2_max_frame_num_minus4 */
+  unsigned int pocType = get_ue(&br);
+  if(pocType == 0) {
+    get_ue(&br);      /* log2_max_pic_order_cnt_lsb_minus4 */
+  } else if(pocType == 1) {
+    get_bit(&br);     /* delta_pic_order_always_zero_flag */
+    get_se(&br);      /* offset_for_non_ref_pic */
+    get_se(&br);      /* offset_for_top_to_bottom_field */
+    unsigned int i, cycle = get_ue(&br);
+    if(cycle > 255)
+      return -1;
+    for(i = 0; i < cycle; i++)
+      get_se(&br);
+  }
+
+  get_ue(&br);        /* max_num_ref_frames */
+  get_bit(&br);       /* gaps_in_frame_num_value_allowed_flag */
+  unsigned int mbWidth = get_ue(&br) + 1;
+  unsigned int mapHeight = get_ue(&br) + 1;
+  int frameMbsOnly = get_bit(&br);
+  if(!frameMbsOnly)
+    get_bit(&br);     /* mb_adaptive_frame_field_flag */
+  get_bit(&br);       /* direct_8x8_inference_flag */
+
+  unsigned int cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
+  if(get_bit(&br)) {
+    cropLeft = get_ue(&br);
+    cropRight = get_ue(&br);
+    cropTop = get_ue(&br);
+    cropBottom = get_ue(&br);
+  }
+
+  /* crop units, table 6-1 */
+  int cropX = 1, cropY = 2 - frameMbsOnly;
+  if(chroma != 0 && !separate) {
+    if(chroma == 1 || chroma == 2)
+      cropX = 2;
+    if(chroma == 1)
+      cropY *= 2;
+  }
+
+  int w = mbWidth * 16 - cropX * (cropLeft + cropRight);
+  int h = (2 - frameMbsOnly) * mapHeight * 16 - cropY * (cropTop + cropBottom);
+  if(mbWidth > 1024 || mapHeight > 1024 || w <= 0 || h <= 0)
+    return -1;
+
+  *width = w;
+  *height = h;
+  return id;
+}
+
+/* Returns the PPS id and the SPS it refers to, -1 when malformed */
+static int parse_pps(const uint8_t *nal, int size, int *spsId)
+{
+  uint8_t rbsp[16];
+  BitReader br;
+
+  br.size = unescape(nal + 1, size - 1, rbsp, sizeof(rbsp));
+  br.data = rbsp;
+  br.pos = 0;
+
+  unsigned int id = get_ue(&br);
+  unsigned int sps = get_ue(&br);
+  if(id >= MAX_PPS || sps >= MAX_SPS)
+    return -1;
+
+  *spsId = sps;
+  return id;
+}
+
+/* Store a copy unless already there, returns 1 when it changed */
+static int store(ParamSet *p, const uint8_t *nal, int size)
+{
+  if(p->data && p->size == size && memcmp(p->data, nal, size) == 0)
+    return 0;
+
+  uint8_t *data = av_realloc(p->data, size);
+  if(!data)
+    return 0;
+  memcpy(data, nal, size);
+  p->data = data;
+  p->size = size;
+  return 1;
+}
+
+H264Ps *H264Ps_Create()
+{
+  H264Ps *ps = av_mallocz(sizeof(H264Ps));
+  if(ps)
+    ps->lastSps = -1;
+  return ps;
+}
+
+void H264Ps_Destroy(H264Ps *ps)
+{
+  int i;
+
+  if(!ps)
+    return;
+
+  for(i = 0; i < MAX_SPS; i++)
+    av_free(ps->sps[i].data);
+  for(i = 0; i < MAX_PPS; i++)
+    av_free(ps->pps[i].data);
+  av_free(ps);
+}
+
+void H264Ps_Copy(H264Ps *dst, const H264Ps *src)
+{
+  int i;
+
+  for(i = 0; i < MAX_SPS; i++) {
+    if(src->sps[i].data) {
+      store(&dst->sps[i], src->sps[i].data, src->sps[i].size);
+      dst->sps[i].width = src->sps[i].width;
+      dst->sps[i].height = src->sps[i].height;
+    }
+  }
+  for(i = 0; i < MAX_PPS; i++) {
+    if(src->pps[i].data) {
+      store(&dst->pps[i], src->pps[i].data, src->pps[i].size);
+      dst->pps[i].spsId = src->pps[i].spsId;
+    }
+  }
+  if(src->lastSps >= 0)
+    dst->lastSps = src->lastSps;
+}
+
+int H264Ps_Update(H264Ps *ps, const uint8_t *data, int size)
+{
+  const uint8_t *end = data + size;
+  const uint8_t *p = data;
+  int changed = 0;
+
+  /* find the first start code */
+  while(end - p >= 3 && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+    p++;
+
+  while(end - p >= 3) {
+    const uint8_t *nal = p + 3;
+    int type = nal < end ? nal[0] & 0x1f : 0;
+
+    /* parameter sets come before the slices of an access unit */
+    if(type >= 1 && type <= 5)
+      break;
+
+    /* the next start code ends this NAL unit, trailing zeros aside */
+    p = nal;
+    while(end - p >= 3 && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+      p++;
+    if(end - p < 3)
+      p = end;
+    const uint8_t *nalEnd = p;
+    while(nalEnd > nal && nalEnd[-1] == 0)
+      nalEnd--;
+    int len = nalEnd - nal;
+
+    if(type == 7 && len > 1) {
+      int width, height;
+      int id = parse_sps(nal, len, &width, &height);
+      if(id >= 0) {
+        changed |= store(&ps->sps[id], nal, len);
+        ps->sps[id].width = width;
+        ps->sps[id].height = height;
+        ps->lastSps = id;
+      }
+    } else if(type == 8 && len > 1) {
+      int spsId;
+      int id = parse_pps(nal, len, &spsId);
+      if(id >= 0) {
+        changed |= store(&ps->pps[id], nal, len);
+        ps->pps[id].spsId = spsId;
+      }
+    }
+  }
+
+  return changed;
+}
+
+int H264Ps_Ready(const H264Ps *ps)
+{
+  int i;
+
+  if(ps->lastSps < 0)
+    return 0;
+  for(i = 0; i < MAX_PPS; i++)
+    if(ps->pps[i].data && ps->pps[i].spsId == ps->lastSps)
+      return 1;
+  return 0;
+}
+
+int H264Ps_GetSize(const H264Ps *ps, int *width, int *height)
+{
+  if(ps->lastSps < 0)
+    return -1;
+  *width = ps->sps[ps->lastSps].width;
+  *height = ps->sps[ps->lastSps].height;
+  return 0;
+}
+
+int H264Ps_GetAvcC(const H264Ps *ps, uint8_t **data, int *size)
+{
+  int i, numPps = 0, len = 7;
+
+  if(!H264Ps_Ready(ps))
+    return -1;
+
+  const ParamSet *sps = &ps->sps[ps->lastSps];
+  len += 2 + sps->size;
+  for(i = 0; i < MAX_PPS; i++) {
+    if(ps->pps[i].data && ps->pps[i].spsId == ps->lastSps) {
+      len += 2 + ps->pps[i].size;
+      numPps++;
+    }
+  }
+
+  uint8_t *p = av_mallocz(len + FF_INPUT_BUFFER_PADDING_SIZE);
+  if(!p)
+    return -1;
+  *data = p;
+  *size = len;
+
+  *p++ = 1;                 /* configurationVersion */
+  *p++ = sps->data[1];      /* AVCProfileIndication */
+  *p++ = sps->data[2];      /* profile_compatibility */
+  *p++ = sps->data[3];      /* AVCLevelIndication */
+  *p++ = 0xff;              /* lengthSizeMinusOne = 3 */
+  *p++ = 0xe1;              /* one SPS */
+  *p++ = sps->size >> 8;
+  *p++ = sps->size;
+  memcpy(p, sps->data, sps->size);
+  p += sps->size;
+
+  *p++ = numPps;
+  for(i = 0; i < MAX_PPS; i++) {
+    const ParamSet *pps = &ps->pps[i];
+    if(pps->data && pps->spsId == ps->lastSps) {
+      *p++ = pps->size >> 8;
+      *p++ = pps->size;
+      memcpy(p, pps->data, pps->size);
+      p += pps->size;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef H264PS_H
+#define H264PS_H
+
+#include <stdint.h>
+
+/*
+ * Cache of the in-band H.264 parameter sets (NAL types 7 and 8), and
+ * what the muxer needs from them: the real picture size and an avcC
+ * record (ISO/IEC 14496-15) for the stream extradata.
+ */
+
+typedef struct H264Ps H264Ps;
+
+H264Ps *H264Ps_Create();
+void H264Ps_Destroy(H264Ps *ps);
+void H264Ps_Copy(H264Ps *dst, const H264Ps *src);
+
+/*
+ * Pick up the parameter sets at the start of a start code prefixed access
+ * unit, scanning stops at the first slice. Returns 1 when a parameter set
+ * was added or changed.
+ */
+int H264Ps_Update(H264Ps *ps, const uint8_t *data, int size);
+
+/* an SPS and a PPS referring to it have been seen */
+int H264Ps_Ready(const H264Ps *ps);
+/* picture size of the latest SPS after cropping, -1 when none */
+int H264Ps_GetSize(const H264Ps *ps, int *width, int *height);
+/* av_malloc'ed and zero padded avcC record, -1 when not ready */
+int H264Ps_GetAvcC(const H264Ps *ps, uint8_t **data, int *size);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <string.h>
+
+#include "histogram.h"
+
+static int bucket(unsigned long long v)
+{
+  if(v < 8)
+    return v;
+
+  int e = 63 - __builtin_clzll(v);    /* 3 and up */
+  return 8 + (e - 3) * 4 + ((v >> (e - 2)) & 3);
+}
+
+/* highest value falling in bucket b */
+static unsigned long long bucket_max(int b)
+{
+  if(b < 8)
+    return b;
+
+  int e = (b - 8) / 4 + 3;
+  unsigned long long sub = (b - 8) % 4;
+  return ((4 + sub + 1) << (e - 2)) - 1;
+}
+
+/* single writer: plain loads, atomic stores so readers never see a torn value */
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void Histogram_Add(Histogram *h, unsigned long long value)
+{
+  int b = bucket(value);
+  STORE(h->count[b], h->count[b] + 1);
+  STORE(h->sum, h->sum + value);
+  if(value > h->max)
+    STORE(h->max, value);
+  STORE(h->total, h->total + 1);
+}
+
+void Histogram_Snapshot(const Histogram *h, Histogram *out)
+{
+  int i;
+  unsigned long long total = 0;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    out->count[i] = LOAD(h->count[i]);
+    total += out->count[i];
+  }
+  /* consistent with the buckets, even if samples landed meanwhile */
+  out->total = total;
+  out->sum = LOAD(h->sum);
+  out->max = LOAD(h->max);
+}
+
+unsigned long long Histogram_Percentile(const Histogram *h, double p)
+{
+  unsigned long long seen = 0;
+  int i;
+
+  if(h->total == 0)
+    return 0;
+
+  unsigned long long rank = (unsigned long long)(h->total * p / 100.0);
+  if(rank >= h->total)
+    rank = h->total - 1;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->count[i];
+    if(seen > rank) {
+      unsigned long long v = bucket_max(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
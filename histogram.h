@@ -0,0 +1,46 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: exact below 8, then four buckets per power of
+ * two, so any percentile is within 25%. One thread adds, any thread may
+ * read; there are no locks and no read-modify-write on the hot path.
+ */
+
+#define HISTOGRAM_BUCKETS 252
+
+typedef struct Histogram {
+  unsigned long long count[HISTOGRAM_BUCKETS];
+  unsigned long long total;
+  unsigned long long sum;
+  unsigned long long max;
+} Histogram;
+
+void Histogram_Add(Histogram *h, unsigned long long value);
+void Histogram_Snapshot(const Histogram *h, Histogram *out);
+/* value below which p percent (0..100) of the samples fall, 0 when empty */
+unsigned long long Histogram_Percentile(const Histogram *h, double p);
+
+#endif
@@ -29,11 +29,16 @@
 #include <signal.h>
 
 #include "rtph264.h"
+#include "rtprecv.h"
+
+static RtpRecv *receiver = NULL;
 
 void sig_handler(int s)
 {
   switch(s) {
     case SIGINT:  RtpH264_Stop();
+      if(receiver)
+        RtpRecv_Stop(receiver);
       break;
   }
 }
@@ -73,6 +78,16 @@ typedef enum
    ArgID_IP,
    ArgID_PORT,
    ArgID_DEVICE,
+   ArgID_RECORD_ONLY,
+   ArgID_FIDELITY,
+   ArgID_STATS_FILE,
+   ArgID_NACK,
+   ArgID_THREADS,
+   ArgID_RCVBUF,
+   ArgID_RCVBUF_FORCE,
+   ArgID_BUSY_POLL,
+   ArgID_SOCKETS,
+   ArgID_PORT_RANGE,
 //   ArgID_FILE
 } ArgID;
 
@@ -82,9 +97,17 @@ typedef struct Args
   in_addr_t ip;
   unsigned short port;
   char device[STR32];
+  int recordOnly;
+  int decodeProfile;
+  const char *statsFile;
+  int nack;
+  int threads;
+  RtpSocketConfig socket;
+  int sockets;
+  int portRange;
 } Args;
 
-#define DEFAULT_ARGS { 0, 8000, "eth0"}
+#define DEFAULT_ARGS { 0, 8000, "eth0", 0, RTPH264_DECODE_FULL, NULL, 0, 1, { 0, 0, 0, 0 }, 1, 0}
 
 static void Usage(void)
 {
@@ -94,6 +117,16 @@ static void Usage(void)
         "-i | --ip             Binding ip\n"
         "-p | --port           Listen port : default 8000\n"
         "-d | --device         Device\n"
+        "-r | --record-only    Record without decoding\n"
+        "-f | --fidelity       Decode profile full, fast or keyframes : default full\n"
+        "-s | --stats-file     Rewrite this file with the stats every second\n"
+        "-n | --nack           Ask the sender to retransmit lost packets\n"
+        "-t | --threads        Decoder threads : default 1\n"
+        "-b | --rcvbuf         Socket receive buffer in bytes : default system\n"
+        "-F | --rcvbuf-force   Allow a receive buffer past net.core.rmem_max\n"
+        "-B | --busy-poll      Busy poll the socket for this many us\n"
+        "-S | --sockets        Receive threads sharing the port, one session per sender\n"
+        "-P | --port-range     Receive threads on port, port + 2, ..., one session per sender\n"
         "At a minimum the IP and port *must* be given\n\n");
 }
 
@@ -101,13 +134,23 @@ static void Usage(void)
 
 static void ParseArgs(int argc, char *argv[], Args *argsp)
 {
-  const char shortOptions[] = "hi:p:d:";
+  const char shortOptions[] = "hi:p:d:rf:s:nt:b:FB:S:P:";
 
   const struct option longOptions[] = {
     {"help",      no_argument,       NULL, ArgID_HELP },
     {"ip",        required_argument, NULL, ArgID_IP },
     {"port",      required_argument, NULL, ArgID_PORT  },
     {"device",    required_argument, NULL, ArgID_DEVICE },
+    {"record-only", no_argument,     NULL, ArgID_RECORD_ONLY },
+    {"fidelity",  required_argument, NULL, ArgID_FIDELITY },
+    {"stats-file", required_argument, NULL, ArgID_STATS_FILE },
+    {"nack",      no_argument,       NULL, ArgID_NACK },
+    {"threads",   required_argument, NULL, ArgID_THREADS },
+    {"rcvbuf",    required_argument, NULL, ArgID_RCVBUF },
+    {"rcvbuf-force", no_argument,    NULL, ArgID_RCVBUF_FORCE },
+    {"busy-poll", required_argument, NULL, ArgID_BUSY_POLL },
+    {"sockets",   required_argument, NULL, ArgID_SOCKETS },
+    {"port-range", required_argument, NULL, ArgID_PORT_RANGE },
     {0, 0, 0, 0}
   };
 
@@ -138,6 +181,66 @@ static void ParseArgs(int argc, char *argv[], Args *argsp)
           exit(EXIT_FAILURE);
         }
         break;
+      case ArgID_RECORD_ONLY:
+      case 'r':
+        argsp->recordOnly = 1;
+        break;
+      case ArgID_FIDELITY:
+      case 'f':
+        if(strcmp(optarg, "fast") == 0)
+          argsp->decodeProfile = RTPH264_DECODE_FAST;
+        else if(strcmp(optarg, "keyframes") == 0)
+          argsp->decodeProfile = RTPH264_DECODE_KEYFRAMES;
+        else if(strcmp(optarg, "full") == 0)
+          argsp->decodeProfile = RTPH264_DECODE_FULL;
+        else  {
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case ArgID_STATS_FILE:
+      case 's':
+        argsp->statsFile = optarg;
+        break;
+      case ArgID_NACK:
+      case 'n':
+        argsp->nack = 1;
+        break;
+      case ArgID_THREADS:
+      case 't':
+        if(sscanf(optarg, "%d", &argsp->threads) != 1 || argsp->threads < 1)  {
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case ArgID_RCVBUF:
+      case 'b':
+        if(sscanf(optarg, "%d", &argsp->socket.rcvbuf) != 1 || argsp->socket.rcvbuf < 0)  {
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case ArgID_RCVBUF_FORCE:
+      case 'F':
+        argsp->socket.rcvbufForce = 1;
+        break;
+      case ArgID_BUSY_POLL:
+      case 'B':
+        if(sscanf(optarg, "%d", &argsp->socket.busyPollUs) != 1 || argsp->socket.busyPollUs < 0)  {
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case ArgID_SOCKETS:
+      case 'S':
+      case ArgID_PORT_RANGE:
+      case 'P':
+        if(sscanf(optarg, "%d", &argsp->sockets) != 1 || argsp->sockets < 1)  {
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        argsp->portRange = argID == ArgID_PORT_RANGE || argID == 'P';
+        break;
       case ArgID_HELP:
       case 'h':
       default:
@@ -153,32 +256,16 @@ static void ParseArgs(int argc, char *argv[], Args *argsp)
   }  
 }
 
-int CreateUdpSocket(in_addr_t ip, unsigned short port)
+int CreateUdpSocket(in_addr_t ip, unsigned short port, const RtpSocketConfig *cfg)
 {
-  struct sockaddr_in addr;
-  int sfd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if(sfd == -1)  {
-    printf("Could not create a UDP socket\n");
-    goto udp_socket_fail;
-  }
-
-  memset((char*) &(addr),0, sizeof((addr)));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  addr.sin_port = htons(port);
-
-  addr.sin_addr.s_addr = ip;
-  printf("Binding to interface %s\n", inet_ntoa(addr.sin_addr));
+  struct in_addr addr;
+  addr.s_addr = ip;
+  printf("Binding to interface %s\n", inet_ntoa(addr));
 
-  if(bind(sfd,(struct sockaddr*)&addr, sizeof(addr)) != 0)  {
+  int sfd = RtpSocket_Open(ip, port, cfg);
+  if(sfd < 0)
     printf("Could not bind socket\n");
-    goto udp_socket_fail;
-  }
-
   return sfd;
-  
-udp_socket_fail:
-  return -1;
 }
 
 void OnPicture(unsigned char *data, int lineSize, int width, int height)
@@ -186,24 +273,122 @@ void OnPicture(unsigned char *data, int lineSize, int width, int height)
 //  printf("[ %dx%d ] : lineSize = %d\n", width, height, lineSize);
 }
 
+/* Several receive threads, each sender recorded to its own file */
+static int RunReceiver(const Args *args)
+{
+  RtpRecvConfig cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.ip = args->ip;
+  cfg.port = args->port;
+  cfg.sockets = args->sockets;
+  cfg.portRange = args->portRange;
+  cfg.maxSources = 64;
+  cfg.socket = args->socket;
+  cfg.onPicture = args->recordOnly ? NULL : OnPicture;
+
+  RtpH264_DefaultConfig(&cfg.session);
+  cfg.session.filename = "/tmp/scv-%d.mp4";
+  cfg.session.recordOnly = args->recordOnly;
+  cfg.session.decodeProfile = args->decodeProfile;
+  cfg.session.decodeThreads = args->threads;
+
+  if(args->nack || args->statsFile)
+    fprintf(stderr, "NACK and the stats file are per session, not available with several sockets\n");
+
+  receiver = RtpRecv_Create(&cfg);
+  if(!receiver)  {
+    fprintf(stderr, "could not open the receive sockets\n");
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, sig_handler);
+  RtpRecv_Run(receiver);
+
+  int i, j;
+  for(i = 0; i < RtpRecv_GetSocketCount(receiver); i++)  {
+    RtpRecvSocketStats ss;
+    RtpRecv_GetSocketStats(receiver, i, &ss);
+    printf("port %d : %llu packets, %llu bytes, %llu kernel drops with a %d byte buffer, %d senders, %llu refused, %llu before their session\n",
+      ss.port, ss.packets, ss.bytes, ss.rxq_drops, ss.rcvbuf, ss.sources, ss.refused, ss.pending);
+
+    RtpH264Session *sessions[64];
+    int n = RtpRecv_GetSessions(receiver, i, sessions, 64);
+    for(j = 0; j < n; j++)  {
+      RtpH264_Stats stats;
+      RtpH264Session_GetStats(sessions[j], &stats);
+      printf("  %llu access units, %llu key frames, %llu lost, %llu FU NAL units dropped, %dx%d\n",
+        stats.access_units, stats.key_frames, stats.lost, stats.fu_dropped, stats.width, stats.height);
+    }
+  }
+
+  RtpRecv_Destroy(receiver);
+  receiver = NULL;
+  return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
   Args args = DEFAULT_ARGS;
 
   /* Parse the arguments given to the app */
   ParseArgs(argc, argv, &args);
-    
-  int sfd = CreateUdpSocket(args.ip, args.port);
-  if(!sfd)  {
+
+  if(args.sockets > 1 || args.portRange)
+    return RunReceiver(&args);
+
+  int sfd = CreateUdpSocket(args.ip, args.port, &args.socket);
+  if(sfd < 0)  {
     fprintf(stderr, "could not open socket\n");
     exit(EXIT_FAILURE);
   }
   
+  /* receiver reports and NACKs go out from the next port up */
+  RtpSocketConfig rtcpSocket = { 0, 0, 0, 0 };
+  int rfd = CreateUdpSocket(args.ip, args.port + 1, &rtcpSocket);
+  if(rfd < 0)
+    fprintf(stderr, "could not open RTCP socket, no receiver reports\n");
+
   signal(SIGINT, sig_handler);
   
+  RtpH264_SetDecodeProfile(args.decodeProfile);
+  RtpH264_SetStatsFile(args.statsFile, 1000);
+  RtpH264_SetRtcp(rfd, args.nack);
+  RtpH264_SetDecodeThreads(args.threads);
   RtpH264_Init();
   
-  RtpH264_Run(sfd, OnPicture);
+  /* no picture callback, NAL units go straight to the muxer */
+  RtpH264_Run(sfd, args.recordOnly ? NULL : OnPicture);
+
+  RtpH264_Stats stats;
+  RtpH264_GetStats(&stats);
+  printf("%llu packets, %llu bytes in %llu recvmmsg calls (%.1f packets/call), %llu truncated\n",
+    stats.packets, stats.bytes, stats.recv_calls,
+    stats.recv_calls ? (double)stats.packets / stats.recv_calls : 0.0, stats.truncated);
+  printf("%llu dropped by the kernel with a %d byte receive buffer\n", stats.rxq_drops, stats.rcvbuf);
+  printf("%llu reordered, %llu late, %llu duplicate, %llu lost, %llu FU NAL units dropped\n",
+    stats.reordered, stats.late, stats.duplicate, stats.lost, stats.fu_dropped);
+  printf("%llu NAL units from aggregation packets\n", stats.aggregated);
+  printf("%llu access units, %llu key frames, %llu skipped before the first IDR, %dx%d\n",
+    stats.access_units, stats.key_frames, stats.gated, stats.width, stats.height);
+  printf("buffer pool : %llu allocated, %llu grown, %llu reused, %llu NAL units lost to memory\n",
+    stats.pool_allocs, stats.pool_grows, stats.pool_reuses, stats.nal_nomem);
+  printf("decode queue : %llu queued, high water %d, %llu dropped\n",
+    stats.queued, stats.queue_high_water, stats.queue_drops);
+  printf("decode shedding : %llu non-reference and %llu reference frames not decoded\n",
+    stats.shed_nonref, stats.shed_ref);
+  printf("jitter %.2f ms, %llu invalid packets, %llu FU timestamp mismatches\n",
+    stats.jitter / 90.0, stats.invalid, stats.ts_mismatch);
+  printf("decode time p50/p90/p99 %u/%u/%u us, latency p50/p90/p99 %u/%u/%u ms, %llu errors\n",
+    stats.decode_p50_us, stats.decode_p90_us, stats.decode_p99_us,
+    stats.latency_p50_ms, stats.latency_p90_ms, stats.latency_p99_ms, stats.decode_errors);
+  printf("decode : %llu frames, %.2f ms average, %.2f ms max per frame, %llu skipped by profile\n",
+    stats.decoded, stats.decoded ? stats.decode_us / 1000.0 / stats.decoded : 0.0,
+    stats.decode_max_us / 1000.0, stats.profile_skipped);
+  printf("write queue : high water %d, %llu non-reference and %llu reference frames dropped\n",
+    stats.write_high_water, stats.write_drops_nonref, stats.write_drops_ref);
+  printf("rtcp : %llu receiver reports, %llu sender reports, %llu lost, %llu NACKs for %llu packets, %llu recovered, %llu expired\n",
+    stats.rr_sent, stats.sr_received, stats.rtcp_lost, stats.nack_sent, stats.nack_seqs,
+    stats.nack_recovered, stats.nack_expired);
   
   RtpH264_Deinit();
   
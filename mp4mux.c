@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "mp4mux.h"
+#include "libavutil/opt.h"
 
 /*
  * add an audio output stream
@@ -140,17 +141,12 @@ static AVStream *add_video_stream(AVFormatContext *oc, enum CodecID codec_id)
     c->codec_id = codec_id;
     c->codec_type = CODEC_TYPE_VIDEO;
 
-    /* put sample parameters */
-    c->bit_rate = 4000000;
-    /* resolution must be a multiple of two */
-    c->width = 640;
-    c->height = 480;
+    /* size and extradata come from the SPS, see write_header() */
     /* time base: this is the fundamental unit of time (in seconds) in terms
-       of which frame timestamps are represented. for fixed-fps content,
-       timebase should be 1/framerate and timestamp increments should be
-       identically 1. */
+       of which frame timestamps are represented. RTP video runs at 90 kHz,
+       so timestamps are used as they are. */
 //    c->time_base.den = STREAM_FRAME_RATE;
-    c->time_base.den = 3; /*  90000 / timestamp interval / 2  */
+    c->time_base.den = 90000;
     c->time_base.num = 1;
     c->gop_size = 12; /* emit one intra frame every twelve frames at most */
     c->pix_fmt = STREAM_PIX_FMT;
@@ -173,73 +169,6 @@ static AVStream *add_video_stream(AVFormatContext *oc, enum CodecID codec_id)
     return st;
 }
 
-static void open_video(AVFormatContext *oc, AVStream *st)
-{
-    AVCodec *codec;
-    AVCodecContext *c;
-
-    c = st->codec;
-
-    /* find the video encoder */
-    codec = avcodec_find_decoder(c->codec_id);
-    if (!codec) {
-        fprintf(stderr, "codec not found\n");
-        exit(1);
-    }
-
-    /* open the codec */
-    if (avcodec_open(c, codec) < 0) {
-        fprintf(stderr, "could not open codec\n");
-        exit(1);
-    }
-#if 0
-    video_outbuf = NULL;
-    if (!(oc->oformat->flags & AVFMT_RAWPICTURE)) {
-        /* allocate output buffer */
-        /* XXX: API change will be done */
-        /* buffers passed into lav* can be allocated any way you prefer,
-           as long as they're aligned enough for the architecture, and
-           they're freed appropriately (such as using av_free for buffers
-           allocated with av_malloc) */
-        video_outbuf_size = 200000;
-        video_outbuf = av_malloc(video_outbuf_size);
-    }
-
-    /* allocate the encoded raw picture */
-    picture = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!picture) {
-        fprintf(stderr, "Could not allocate picture\n");
-        exit(1);
-    }
-
-    /* if the output format is not YUV420P, then a temporary YUV420P
-       picture is needed too. It is then converted to the required
-       output format */
-    tmp_picture = NULL;
-    if (c->pix_fmt != PIX_FMT_YUV420P) {
-        tmp_picture = alloc_picture(PIX_FMT_YUV420P, c->width, c->height);
-        if (!tmp_picture) {
-            fprintf(stderr, "Could not allocate temporary picture\n");
-            exit(1);
-        }
-    }
-#endif
-}
-
-static void close_video(AVFormatContext *oc, AVStream *st)
-{
-    avcodec_close(st->codec);
-/*
-    av_free(picture->data[0]);
-    av_free(picture);
-    if (tmp_picture) {
-        av_free(tmp_picture->data[0]);
-        av_free(tmp_picture);
-    }
-    */
-//    av_free(video_outbuf);
-}
-
 extern AVOutputFormat mp4_muxer;
 extern URLProtocol file_protocol;
 
@@ -259,13 +188,78 @@ void print_error(const char *filename, int err)
     fprintf(stderr, "%s: %s\n", filename, errbuf_ptr);
 }
 
-static AVFormatContext *context = 0;
-//static AVStream *audio_stream = NULL, *video_stream = NULL;
-static AVStream *video_stream = NULL;
+#define MP4MUX_IO_BUFFER_SIZE (1024 * 1024)
+
+struct Mp4mux {
+  AVFormatContext *context;
+  AVStream *video_stream;
+  unsigned int prev_timestamp;
+  int64_t pts;                  /* 90 kHz, from 0 at the first frame */
+
+  H264Ps *ps;                   /* parameter sets seen so far */
+  int header;                   /* written, on the first IDR */
+
+  int fragment;                 /* MP4MUX_CLASSIC, MP4MUX_FRAGMENT_GOP or ms */
+  unsigned int flush_timestamp; /* RTP timestamp of the last flush */
+
+  uint8_t *sample;              /* access unit with length prefixed NAL units */
+  int sample_alloc;
+};
+
+/*
+ * Ask the mov muxer for moof/mdat fragments, so the sample index is
+ * written and released per fragment instead of held until the trailer.
+ */
+static int set_fragmented(AVFormatContext *context, int fragment)
+{
+  if(!context->priv_data)
+    return -1;
+
+  if(av_set_string3(context->priv_data, "movflags", "frag_keyframe", 1, NULL) < 0)
+    return -1;
+
+  if(fragment > 0) {
+    char duration[32];
+    snprintf(duration, sizeof(duration), "%d", fragment * 1000);  /* us */
+    if(av_set_string3(context->priv_data, "frag_duration", duration, 1, NULL) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static void free_context(Mp4mux *mux)
+{
+  AVFormatContext *context = mux->context;
+
+  /* the video codec context only describes the stream, it was never opened */
+  if (mux->video_stream)
+      av_freep(&mux->video_stream->codec->extradata);
+//  if (audio_stream)
+//      close_audio(context, audio_stream);
+
+  /* free the streams */
+  int i;
+  for(i = 0; i < context->nb_streams; i++) {
+      av_freep(&context->streams[i]->codec);
+      av_freep(&context->streams[i]);
+  }
+
+  /* free the stream */
+  av_free(context);
+  av_free(mux->sample);
+  H264Ps_Destroy(mux->ps);
+  av_free(mux);
+}
 
-void Mp4mux_Open(const char *filename)
+Mp4mux *Mp4mux_Open(const char *filename, int fragment)
 {
-  context = avformat_alloc_context();
+  Mp4mux *mux = av_mallocz(sizeof(Mp4mux));
+  AVFormatContext *context = avformat_alloc_context();
+  mux->context = context;
+  mux->fragment = fragment;
+  mux->ps = H264Ps_Create();
+
   AVOutputFormat *format = av_guess_format("mp4", NULL, NULL);
   if(!format) {
     fprintf(stderr, "Could not find suitable output format\n");
@@ -276,7 +270,7 @@ void Mp4mux_Open(const char *filename)
   context->oformat = format;
   snprintf(context->filename, sizeof(context->filename), "%s", filename);
 
-  video_stream = add_video_stream(context, format->video_codec);
+  mux->video_stream = add_video_stream(context, format->video_codec);
   //audio_stream = add_audio_stream(context, format->audio_codec);
 
   if(av_set_parameters(context, NULL) < 0) {
@@ -284,33 +278,129 @@ void Mp4mux_Open(const char *filename)
     exit(EXIT_FAILURE);
   }
 
-  dump_format(context, 0, filename, 1);
+  if(fragment != MP4MUX_CLASSIC && set_fragmented(context, fragment) < 0) {
+    fprintf(stderr, "Fragmented MP4 not supported, writing '%s' as classic MP4\n", filename);
+    mux->fragment = MP4MUX_CLASSIC;
+  }
 
-  open_video(context, video_stream);
-  //open_audio(context, audio_stream);
-  
   int err;
   if((err = url_fopen(&context->pb, filename, URL_WRONLY)) < 0) {
     print_error(filename, err);
     fprintf(stderr, "Could not open '%s'\n", filename);
-    exit(EXIT_FAILURE);
+    free_context(mux);
+    return NULL;
   }
 
+  /* coalesce muxer output into large sequential writes */
+  url_setbufsize(context->pb, MP4MUX_IO_BUFFER_SIZE);
+
+  return mux;
+}
+
+/*
+ * The header needs the real picture size and the avcC, so it is written
+ * once the parameter sets are known, on the first IDR.
+ */
+static int write_header(Mp4mux *mux)
+{
+  AVFormatContext *context = mux->context;
+  AVCodecContext *c = mux->video_stream->codec;
+
+  if(H264Ps_GetSize(mux->ps, &c->width, &c->height) < 0 ||
+     H264Ps_GetAvcC(mux->ps, &c->extradata, &c->extradata_size) < 0)
+    return -1;
+
+  dump_format(context, 0, context->filename, 1);
+
+  /* the muxer only needs the stream parameters, no codec is opened */
+  //open_audio(context, audio_stream);
+
   /* write the stream header, if any */
   av_write_header(context);
+  mux->header = 1;
+  return 0;
 }
 
-void Mp4Mux_WriteVideo(AVPacket *pkt, unsigned int timestamp)
+/*
+ * The avcC declares 4 byte NAL unit lengths, so samples carry those in
+ * place of start codes. In-band SPS/PPS are kept, as they are in the
+ * stream. Returns the sample size, -1 when out of memory.
+ */
+static int annexb_to_sample(Mp4mux *mux, const uint8_t *data, int size)
 {
-  static unsigned int prev_timestamp = 0;
-  AVCodecContext *c = video_stream->codec;
-  
-  if(timestamp && prev_timestamp) {
-    //printf("den = %d\n", (90000 / (timestamp - prev_timestamp)) / 2);
-    c->time_base.den = (90000 / (timestamp - prev_timestamp)) / 2;
+  const uint8_t *end = data + size;
+  const uint8_t *p = data;
+  int len = 0;
+
+  /* a 3 byte start code becomes a 4 byte length, every NAL unit has one byte at least */
+  int max = size + size / 4 + 4;
+  if(mux->sample_alloc < max) {
+    uint8_t *sample = av_realloc(mux->sample, max);
+    if(!sample)
+      return -1;
+    mux->sample = sample;
+    mux->sample_alloc = max;
   }
-  
-  prev_timestamp = timestamp;
+
+  /* find the first start code */
+  while(end - p >= 3 && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+    p++;
+
+  while(end - p >= 3) {
+    const uint8_t *nal = p + 3;
+
+    /* the next start code ends this NAL unit, trailing zeros aside */
+    p = nal;
+    while(end - p >= 3 && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+      p++;
+    if(end - p < 3)
+      p = end;
+    const uint8_t *nalEnd = p;
+    while(nalEnd > nal && nalEnd[-1] == 0)
+      nalEnd--;
+
+    int nalSize = nalEnd - nal;
+    if(nalSize <= 0)
+      continue;
+
+    uint8_t *out = mux->sample + len;
+    out[0] = nalSize >> 24;
+    out[1] = nalSize >> 16;
+    out[2] = nalSize >> 8;
+    out[3] = nalSize;
+    memcpy(out + 4, nal, nalSize);
+    len += 4 + nalSize;
+  }
+
+  return len;
+}
+
+void Mp4mux_SetParameterSets(Mp4mux *mux, const H264Ps *ps)
+{
+  H264Ps_Copy(mux->ps, ps);
+}
+
+const H264Ps *Mp4mux_GetParameterSets(Mp4mux *mux)
+{
+  return mux->ps;
+}
+
+void Mp4Mux_WriteVideo(Mp4mux *mux, AVPacket *pkt, unsigned int timestamp)
+{
+  H264Ps_Update(mux->ps, pkt->data, pkt->size);
+
+  if(!mux->header) {
+    /* nothing before the first IDR can be decoded */
+    if(!(pkt->flags & PKT_FLAG_KEY) || write_header(mux) < 0)
+      return;
+  } else {
+    /* unwrap the RTP timestamp, and keep timestamps strictly increasing */
+    int delta = timestamp - mux->prev_timestamp;
+    mux->pts += (delta > 0) ? delta : 1;
+  }
+  mux->prev_timestamp = timestamp;
+  pkt->pts = mux->pts;
+  pkt->dts = mux->pts;
   
 //  if (c->pix_fmt != PIX_FMT_YUV420P)
 //    printf("c->pix_fmt != PIX_FMT_YUV420P\n");
@@ -320,44 +410,48 @@ void Mp4Mux_WriteVideo(AVPacket *pkt, unsigned int timestamp)
 
 //  if(c->coded_frame->key_frame)
 //    pkt->flags |= PKT_FLAG_KEY;
-  pkt->stream_index= video_stream->index;
+  pkt->stream_index= mux->video_stream->index;
+
+  AVPacket sample = *pkt;
+  sample.destruct = NULL;   /* the muxer copies what it keeps */
+  sample.size = annexb_to_sample(mux, pkt->data, pkt->size);
+  sample.data = mux->sample;
+  if(sample.size <= 0) {
+    fprintf(stderr, "Error while writing video frame\n");
+    return;
+  }
 
   /* write the compressed frame in the media file */
-  int ret = av_interleaved_write_frame(context, pkt);
+  AVFormatContext *context = mux->context;
+  int ret = av_interleaved_write_frame(context, &sample);
 //  int ret = av_write_frame(context, pkt);
 
   if(ret != 0)
     fprintf(stderr, "Error while writing video frame\n");
+
+  /* push the finished fragment to disk, a crash then loses at most one */
+  if(mux->fragment != MP4MUX_CLASSIC) {
+    int boundary = (pkt->flags & PKT_FLAG_KEY);
+    if(mux->fragment > 0)
+      boundary = boundary || (timestamp - mux->flush_timestamp) / 90 >= mux->fragment;
+    if(boundary) {
+      put_flush_packet(context->pb);
+      mux->flush_timestamp = timestamp;
+    }
+  }
 }
 
-void Mp4mux_Close()
+void Mp4mux_Close(Mp4mux *mux)
 {
   /* write the trailer, if any.  the trailer must be written
    * before you close the CodecContexts open when you wrote the
    * header; otherwise write_trailer may try to use memory that
    * was freed on av_codec_close() */
-  av_write_trailer(context);
-
-  /* close each codec */
-  if (video_stream)
-      close_video(context, video_stream);
-//  if (audio_stream)
-//      close_audio(context, audio_stream);
-
-  /* free the streams */
-  int i;
-  for(i = 0; i < context->nb_streams; i++) {
-      av_freep(&context->streams[i]->codec);
-      av_freep(&context->streams[i]);
-  }
+  if(mux->header)
+    av_write_trailer(mux->context);
 
   /* close the output file */
-  url_fclose(context->pb);
+  url_fclose(mux->context->pb);
 
-  /* free the stream */
-  av_free(context);
+  free_context(mux);
 }
-
-
-
-//AVCodecContext *codec_context = video_stream->codec;    
\ No newline at end of file
@@ -18,6 +18,8 @@
  * MA 02111-1307 USA
  *
 */
+#ifndef MP4MUX_H
+#define MP4MUX_H
 
 #ifdef HAVE_AV_CONFIG_H
 #undef HAVE_AV_CONFIG_H
@@ -28,7 +30,26 @@
 #include "libavformat/avformat.h"
 //#include "libswscale/swscale.h"
 
+#include "h264ps.h"
+
+typedef struct Mp4mux Mp4mux;
+
+/* fragment argument of Mp4mux_Open(), a positive value is a fragment length in ms */
+#define MP4MUX_CLASSIC      -1  /* single moov written at close */
+#define MP4MUX_FRAGMENT_GOP  0  /* one moof/mdat per GOP */
+
 void Mp4mux_Init();
-void Mp4mux_Open(const char *filename);
-void Mp4Mux_WriteVideo(AVPacket *packet, unsigned int timestamp);
-void Mp4mux_Close();
+Mp4mux *Mp4mux_Open(const char *filename, int fragment);
+/*
+ * packet is a start code prefixed access unit. Size and avcC of the
+ * stream are taken from the in-band SPS/PPS, the file starts at the
+ * first IDR once they are known. Samples are stored with the 4 byte
+ * NAL unit lengths the avcC declares.
+ */
+void Mp4Mux_WriteVideo(Mp4mux *mux, AVPacket *packet, unsigned int timestamp);
+/* start with parameter sets seen elsewhere, for streams that send them once */
+void Mp4mux_SetParameterSets(Mp4mux *mux, const H264Ps *ps);
+const H264Ps *Mp4mux_GetParameterSets(Mp4mux *mux);
+void Mp4mux_Close(Mp4mux *mux);
+
+#endif
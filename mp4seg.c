@@ -0,0 +1,359 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mp4seg.h"
+
+#define NAME_SIZE 1024
+#define MAX_KEEP 1024
+
+struct Mp4seg {
+  Mp4segConfig cfg;
+  char pattern[NAME_SIZE];
+  int segmented;
+
+  /* touched by the writing thread only */
+  Mp4mux *current;
+  int index;
+  int started;
+  unsigned int startTimestamp;
+  long long bytes;
+
+  /* hand-off with the helper thread, under lock */
+  pthread_t helper;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  Mp4mux *next;           /* opened ahead of time */
+  int nextIndex;
+  int nextFailed;
+  Mp4mux *closing;        /* finished segment waiting to be closed */
+  int closingIndex;
+  int quit;
+
+  /* finished segments, oldest first, helper thread only */
+  char *kept[MAX_KEEP];
+  long long keptSize[MAX_KEEP];
+  int keptCount;
+  long long keptBytes;
+};
+
+static void segment_name(Mp4seg *seg, int index, char *name)
+{
+  if(seg->segmented)
+    snprintf(name, NAME_SIZE, seg->pattern, index);
+  else
+    snprintf(name, NAME_SIZE, "%s", seg->pattern);
+}
+
+static int compare_index(const void *a, const void *b)
+{
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Indices of the segments an earlier run left behind, ascending, in a
+ * malloc'ed array. Only patterns with the %d in the file name part are
+ * looked for, returns 0 when there are none.
+ */
+static int find_segments(const char *pattern, int **indices)
+{
+  const char *conv = strchr(pattern, '%');
+  *indices = NULL;
+  if(!conv)
+    return 0;
+
+  /* %d with optional flags and width, e.g. %05d */
+  const char *end = conv + 1;
+  while(*end == '0' || *end == '-' || isdigit((unsigned char)*end))
+    end++;
+  if(*end != 'd' || strchr(end, '/') || strchr(end, '%'))
+    return 0;
+
+  const char *base = strrchr(pattern, '/');
+  base = base ? base + 1 : pattern;
+  if(base > conv)
+    return 0;
+
+  char dir[NAME_SIZE];
+  if(base == pattern)
+    snprintf(dir, NAME_SIZE, ".");
+  else
+    snprintf(dir, NAME_SIZE, "%.*s", (int)(base - pattern), pattern);
+
+  int prefixLen = conv - base;
+  const char *suffix = end + 1;
+  int suffixLen = strlen(suffix);
+
+  DIR *d = opendir(dir);
+  if(!d)
+    return 0;
+
+  int count = 0, alloc = 0;
+  struct dirent *e;
+  while((e = readdir(d)) != NULL) {
+    int len = strlen(e->d_name);
+    int digits = len - prefixLen - suffixLen;
+    if(digits < 1 || digits > 9 ||
+       strncmp(e->d_name, base, prefixLen) != 0 ||
+       strcmp(e->d_name + len - suffixLen, suffix) != 0)
+      continue;
+
+    const char *p = e->d_name + prefixLen;
+    int i, index = 0;
+    for(i = 0; i < digits && isdigit((unsigned char)p[i]); i++)
+      index = index * 10 + (p[i] - '0');
+    if(i != digits)
+      continue;
+
+    /* only names this pattern writes, so the file can be found again */
+    char check[NAME_SIZE];
+    snprintf(check, NAME_SIZE, base, index);
+    if(strcmp(check, e->d_name) != 0)
+      continue;
+
+    if(count == alloc) {
+      int *grown = realloc(*indices, (alloc ? alloc * 2 : 64) * sizeof(int));
+      if(!grown)
+        break;
+      *indices = grown;
+      alloc = alloc ? alloc * 2 : 64;
+    }
+    (*indices)[count++] = index;
+  }
+  closedir(d);
+
+  qsort(*indices, count, sizeof(int), compare_index);
+  return count;
+}
+
+/* Delete the oldest finished segments until within the retention budget */
+static void retain(Mp4seg *seg, const char *name)
+{
+  struct stat st;
+  long long size = (stat(name, &st) == 0) ? st.st_size : 0;
+
+  if(seg->keptCount == MAX_KEEP) {
+    free(seg->kept[0]);
+    seg->keptBytes -= seg->keptSize[0];
+    seg->keptCount--;
+    memmove(&seg->kept[0], &seg->kept[1], seg->keptCount * sizeof(char *));
+    memmove(&seg->keptSize[0], &seg->keptSize[1], seg->keptCount * sizeof(long long));
+  }
+  seg->kept[seg->keptCount] = strdup(name);
+  seg->keptSize[seg->keptCount] = size;
+  seg->keptCount++;
+  seg->keptBytes += size;
+
+  while(seg->keptCount > 0 &&
+        ((seg->cfg.keepSegments > 0 && seg->keptCount > seg->cfg.keepSegments) ||
+         (seg->cfg.keepBytes > 0 && seg->keptBytes > seg->cfg.keepBytes))) {
+    if(unlink(seg->kept[0]) != 0)
+      perror(seg->kept[0]);
+    free(seg->kept[0]);
+    seg->keptBytes -= seg->keptSize[0];
+    seg->keptCount--;
+    memmove(&seg->kept[0], &seg->kept[1], seg->keptCount * sizeof(char *));
+    memmove(&seg->keptSize[0], &seg->keptSize[1], seg->keptCount * sizeof(long long));
+  }
+}
+
+static void *helper_thread(void *arg)
+{
+  Mp4seg *seg = arg;
+  char name[NAME_SIZE];
+
+  pthread_mutex_lock(&seg->lock);
+  while(!seg->quit) {
+    if(seg->closing) {
+      Mp4mux *mux = seg->closing;
+      int index = seg->closingIndex;
+      seg->closing = NULL;
+      pthread_mutex_unlock(&seg->lock);
+
+      Mp4mux_Close(mux);
+      segment_name(seg, index, name);
+      retain(seg, name);
+
+      pthread_mutex_lock(&seg->lock);
+      continue;
+    }
+
+    if(!seg->next && !seg->nextFailed) {
+      int index = seg->nextIndex;
+      pthread_mutex_unlock(&seg->lock);
+
+      segment_name(seg, index, name);
+      Mp4mux *mux = Mp4mux_Open(name, seg->cfg.fragment);
+
+      pthread_mutex_lock(&seg->lock);
+      seg->next = mux;
+      seg->nextFailed = (mux == NULL);
+      continue;
+    }
+
+    pthread_cond_wait(&seg->cond, &seg->lock);
+  }
+  pthread_mutex_unlock(&seg->lock);
+
+  return NULL;
+}
+
+Mp4seg *Mp4seg_Open(const Mp4segConfig *cfg)
+{
+  Mp4seg *seg = calloc(1, sizeof(Mp4seg));
+  if(!seg)
+    return NULL;
+
+  seg->cfg = *cfg;
+  snprintf(seg->pattern, NAME_SIZE, "%s", cfg->filename);
+  seg->cfg.filename = seg->pattern;
+  seg->segmented = (cfg->segmentMs > 0 || cfg->segmentBytes > 0);
+
+  char name[NAME_SIZE];
+  int i;
+
+  /* carry on after a previous run instead of writing over its segments */
+  if(seg->segmented) {
+    int *indices;
+    int count = find_segments(seg->pattern, &indices);
+    for(i = 0; i < count; i++) {
+      segment_name(seg, indices[i], name);
+      retain(seg, name);
+    }
+    if(count > 0)
+      seg->index = indices[count - 1] + 1;
+    free(indices);
+  }
+
+  segment_name(seg, seg->index, name);
+  seg->current = Mp4mux_Open(name, cfg->fragment);
+  if(!seg->current) {
+    for(i = 0; i < seg->keptCount; i++)
+      free(seg->kept[i]);
+    free(seg);
+    return NULL;
+  }
+
+  if(seg->segmented) {
+    pthread_mutex_init(&seg->lock, NULL);
+    pthread_cond_init(&seg->cond, NULL);
+    seg->nextIndex = seg->index + 1;
+    if(pthread_create(&seg->helper, NULL, helper_thread, seg) != 0) {
+      fprintf(stderr, "could not start segment thread, recording a single file\n");
+      seg->segmented = 0;
+    }
+  }
+
+  return seg;
+}
+
+/* Swap in the pre-opened segment, never waits for the helper thread */
+static void rotate(Mp4seg *seg)
+{
+  if(pthread_mutex_trylock(&seg->lock) != 0)
+    return;
+
+  if(seg->nextFailed) {
+    /* try again for the next rotation */
+    seg->nextFailed = 0;
+    pthread_cond_signal(&seg->cond);
+  } else if(seg->next && !seg->closing) {
+    seg->closing = seg->current;
+    seg->closingIndex = seg->index;
+    seg->current = seg->next;
+    /* streams that send SPS/PPS only once still start the segment */
+    Mp4mux_SetParameterSets(seg->current, Mp4mux_GetParameterSets(seg->closing));
+    seg->index = seg->nextIndex;
+    seg->next = NULL;
+    seg->nextIndex++;
+    seg->started = 0;
+    seg->bytes = 0;
+    pthread_cond_signal(&seg->cond);
+  }
+
+  pthread_mutex_unlock(&seg->lock);
+}
+
+void Mp4seg_WriteVideo(Mp4seg *seg, AVPacket *pkt, unsigned int timestamp)
+{
+  if(seg->segmented && seg->started && (pkt->flags & PKT_FLAG_KEY)) {
+    if((seg->cfg.segmentMs > 0 && (timestamp - seg->startTimestamp) / 90 >= seg->cfg.segmentMs) ||
+       (seg->cfg.segmentBytes > 0 && seg->bytes >= seg->cfg.segmentBytes))
+      rotate(seg);
+  }
+
+  if(!seg->started) {
+    seg->started = 1;
+    seg->startTimestamp = timestamp;
+  }
+  seg->bytes += pkt->size;
+
+  Mp4Mux_WriteVideo(seg->current, pkt, timestamp);
+}
+
+void Mp4seg_Close(Mp4seg *seg)
+{
+  char name[NAME_SIZE];
+  int i;
+
+  if(seg->segmented) {
+    pthread_mutex_lock(&seg->lock);
+    seg->quit = 1;
+    pthread_cond_signal(&seg->cond);
+    pthread_mutex_unlock(&seg->lock);
+    pthread_join(seg->helper, NULL);
+
+    if(seg->closing) {
+      Mp4mux_Close(seg->closing);
+      segment_name(seg, seg->closingIndex, name);
+      retain(seg, name);
+    }
+
+    /* the pre-opened segment was never written to */
+    if(seg->next) {
+      Mp4mux_Close(seg->next);
+      segment_name(seg, seg->nextIndex, name);
+      unlink(name);
+    }
+
+    pthread_cond_destroy(&seg->cond);
+    pthread_mutex_destroy(&seg->lock);
+  }
+
+  Mp4mux_Close(seg->current);
+  if(seg->segmented) {
+    segment_name(seg, seg->index, name);
+    retain(seg, name);
+  }
+
+  for(i = 0; i < seg->keptCount; i++)
+    free(seg->kept[i]);
+  free(seg);
+}
@@ -0,0 +1,51 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef MP4SEG_H
+#define MP4SEG_H
+
+#include "mp4mux.h"
+
+/*
+ * Segmented recording on top of Mp4mux. Files are cut on IDR access
+ * units once a segment reaches its duration or size, and old segments
+ * are deleted to stay within the retention budget. The next segment is
+ * opened ahead of time and the finished one closed by a helper thread,
+ * so rotating only swaps a pointer on the writing thread. Numbering
+ * carries on after the segments a previous run left, which count
+ * against the retention budget like new ones.
+ */
+
+typedef struct Mp4segConfig {
+  const char *filename;   /* printf pattern with one %d when segmenting */
+  int fragment;           /* see Mp4mux_Open() */
+  int segmentMs;          /* rotate after this long, 0 for no limit */
+  long long segmentBytes; /* rotate after this many bytes, 0 for no limit */
+  int keepSegments;       /* finished segments kept on disk, 0 keeps all */
+  long long keepBytes;    /* bytes of finished segments kept, 0 for no limit */
+} Mp4segConfig;
+
+typedef struct Mp4seg Mp4seg;
+
+Mp4seg *Mp4seg_Open(const Mp4segConfig *cfg);
+void Mp4seg_WriteVideo(Mp4seg *seg, AVPacket *pkt, unsigned int timestamp);
+void Mp4seg_Close(Mp4seg *seg);
+
+#endif
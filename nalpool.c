@@ -0,0 +1,180 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_AV_CONFIG_H
+#undef HAVE_AV_CONFIG_H
+#endif
+
+#include "libavcodec/avcodec.h"
+
+#include "nalpool.h"
+
+struct NalPool {
+  pthread_mutex_t lock;
+  NalBuf *free;
+  int freeCount;
+  int maxFree;        /* buffers beyond this are given back to the system */
+  int initialSize;
+
+  NalPoolStats stats;
+};
+
+NalPool *NalPool_Create(int initialSize, int maxFree)
+{
+  NalPool *pool = calloc(1, sizeof(NalPool));
+  if(!pool)
+    return NULL;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->initialSize = initialSize;
+  pool->maxFree = maxFree;
+  return pool;
+}
+
+static void buf_free(NalBuf *buf)
+{
+  av_free(buf->data);
+  free(buf);
+}
+
+void NalPool_Destroy(NalPool *pool)
+{
+  if(!pool)
+    return;
+
+  while(pool->free) {
+    NalBuf *buf = pool->free;
+    pool->free = buf->next;
+    buf_free(buf);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+NalBuf *NalPool_Get(NalPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  NalBuf *buf = pool->free;
+  if(buf) {
+    pool->free = buf->next;
+    pool->freeCount--;
+    pool->stats.reuses++;
+  } else {
+    pool->stats.allocs++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if(!buf) {
+    buf = calloc(1, sizeof(NalBuf));
+    if(!buf)
+      return NULL;
+    buf->pool = pool;
+    buf->data = av_malloc(pool->initialSize + FF_INPUT_BUFFER_PADDING_SIZE);
+    if(!buf->data) {
+      free(buf);
+      return NULL;
+    }
+    buf->alloc = pool->initialSize;
+  }
+
+  buf->size = 0;
+  buf->flags = 0;
+  buf->ref = 0;
+  buf->nalTypes = 0;
+  buf->skipDecode = 0;
+  buf->receiveMs = 0;
+  buf->timestamp = 0;
+  buf->pts = AV_NOPTS_VALUE;
+  buf->refs = 1;
+  buf->next = NULL;
+  return buf;
+}
+
+void NalPool_GetStats(NalPool *pool, NalPoolStats *stats)
+{
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int NalBuf_Reserve(NalBuf *buf, int size)
+{
+  if(size <= buf->alloc)
+    return 0;
+
+  int alloc = buf->alloc * 2;
+  if(alloc < size)
+    alloc = size;
+
+  uint8_t *data = av_realloc(buf->data, alloc + FF_INPUT_BUFFER_PADDING_SIZE);
+  if(!data)
+    return -1;
+
+  buf->data = data;
+  buf->alloc = alloc;
+
+  pthread_mutex_lock(&buf->pool->lock);
+  buf->pool->stats.grows++;
+  pthread_mutex_unlock(&buf->pool->lock);
+  return 0;
+}
+
+int NalBuf_Append(NalBuf *buf, const uint8_t *data, int len)
+{
+  if(NalBuf_Reserve(buf, buf->size + len) < 0)
+    return -1;
+  memcpy(buf->data + buf->size, data, len);
+  buf->size += len;
+  return 0;
+}
+
+void NalBuf_Pad(NalBuf *buf)
+{
+  /* ensures that no overreading happens for damaged streams */
+  memset(buf->data + buf->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+}
+
+void NalBuf_Ref(NalBuf *buf)
+{
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void NalBuf_Unref(NalBuf *buf)
+{
+  if(!buf || __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  NalPool *pool = buf->pool;
+  pthread_mutex_lock(&pool->lock);
+  if(pool->freeCount < pool->maxFree) {
+    buf->next = pool->free;
+    pool->free = buf;
+    pool->freeCount++;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if(buf)
+    buf_free(buf);
+}
@@ -0,0 +1,72 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef NALPOOL_H
+#define NALPOOL_H
+
+#include <stdint.h>
+
+/*
+ * Pool of growable, reference counted buffers for NAL units and access
+ * units. Each buffer keeps FF_INPUT_BUFFER_PADDING_SIZE spare bytes
+ * behind its data. Released buffers go back to the pool with their
+ * capacity, so once the pool is warm no memory is allocated at all.
+ * Buffers may be released from any thread.
+ */
+
+typedef struct NalPool NalPool;
+
+typedef struct NalBuf {
+  uint8_t *data;
+  int size;
+  int alloc;              /* capacity, not counting the padding */
+
+  /* access unit metadata */
+  int flags;              /* PKT_FLAG_KEY */
+  int ref;                /* some NAL unit has nal_ref_idc != 0 */
+  unsigned int nalTypes;  /* bit n set when a type n NAL unit is present */
+  int skipDecode;         /* shed under load, recorded but not decoded */
+  unsigned int receiveMs; /* arrival of the last packet, CLOCK_MONOTONIC */
+  unsigned int timestamp; /* RTP timestamp */
+  int64_t pts;
+
+  int refs;
+  NalPool *pool;
+  struct NalBuf *next;    /* free list */
+} NalBuf;
+
+typedef struct NalPoolStats {
+  unsigned long long allocs;    /* buffers malloc'ed */
+  unsigned long long grows;     /* buffers realloc'ed to fit */
+  unsigned long long reuses;    /* buffers handed out again from the pool */
+} NalPoolStats;
+
+NalPool *NalPool_Create(int initialSize, int maxFree);
+void NalPool_Destroy(NalPool *pool);
+NalBuf *NalPool_Get(NalPool *pool);
+void NalPool_GetStats(NalPool *pool, NalPoolStats *stats);
+
+int NalBuf_Reserve(NalBuf *buf, int size);   /* -1 when out of memory */
+int NalBuf_Append(NalBuf *buf, const uint8_t *data, int len);
+void NalBuf_Pad(NalBuf *buf);                /* zero the padding behind data */
+void NalBuf_Ref(NalBuf *buf);
+void NalBuf_Unref(NalBuf *buf);
+
+#endif
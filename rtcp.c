@@ -0,0 +1,446 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "rtcp.h"
+
+#define RTCP_SR    200
+#define RTCP_RR    201
+#define RTCP_SDES  202
+#define RTCP_BYE   203
+#define RTCP_RTPFB 205  /* RFC 4585 transport layer feedback */
+
+#define RTPFB_NACK 1    /* generic NACK */
+
+#define MAX_DROPOUT  3000  /* RFC 3550 A.1 */
+#define MAX_MISORDER 100
+
+#define MISSING_MAX 256    /* holes tracked for NACK at once */
+#define NACK_TRIES 2
+#define FCI_MAX 64         /* PID/BLP pairs per NACK packet */
+
+#define PACKET_SIZE 1500
+
+typedef struct RtcpMissing {
+  unsigned short seq;
+  unsigned char tries;
+  unsigned int first;     /* ms */
+  unsigned int sent;      /* ms, last NACK asking for it */
+} RtcpMissing;
+
+struct Rtcp {
+  int fd;
+  int interval;           /* ms */
+  int deadline;           /* ms, 0 sends no NACKs */
+  uint32_t ssrc;          /* ours */
+  unsigned int seed;
+  unsigned int next;      /* next scheduled report, ms */
+
+  struct sockaddr_in peer;
+  int peerKnown;
+  int peerFromRtcp;       /* the source's RTCP address, not guessed from RTP */
+
+  /* RFC 3550 A.1 source state */
+  int started;
+  uint32_t source;
+  unsigned short maxSeq;
+  unsigned int cycles;
+  unsigned int baseSeq;
+  unsigned int badSeq;
+  unsigned int received;
+  unsigned int expectedPrior;
+  unsigned int receivedPrior;
+
+  /* last sender report, for LSR/DLSR */
+  uint32_t lsr;
+  unsigned int srArrival; /* ms */
+
+  RtcpMissing missing[MISSING_MAX];
+  int missingCount;
+
+  char cname[256];
+  int cnameLen;
+
+  RtcpStats stats;
+};
+
+/* single writer, relaxed atomic stores so GetStats from another thread never sees a torn value */
+#define STAT_SET(field, value) __atomic_store_n(&r->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, r->stats.field + (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_LOAD(field) (stats->field = __atomic_load_n(&r->stats.field, __ATOMIC_RELAXED))
+
+static inline int seq_diff(unsigned short a, unsigned short b)
+{
+  return (short)(unsigned short)(a - b);
+}
+
+static inline void put16(uint8_t *p, unsigned int v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned int schedule(Rtcp *r, unsigned int nowMs)
+{
+  /* RFC 3550 6.3.1, spread over [0.5, 1.5] of the interval */
+  return nowMs + r->interval / 2 + rand_r(&r->seed) % (r->interval + 1);
+}
+
+Rtcp *Rtcp_Create(int fd, int intervalMs, int nackDeadlineMs)
+{
+  Rtcp *r = calloc(1, sizeof(Rtcp));
+  if(!r)
+    return NULL;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  r->fd = fd;
+  r->interval = intervalMs > 0 ? intervalMs : 5000;
+  r->deadline = nackDeadlineMs;
+  r->seed = ts.tv_nsec ^ getpid();
+  r->ssrc = ((uint32_t)rand_r(&r->seed) << 16) ^ rand_r(&r->seed);
+
+  char host[200];
+  if(gethostname(host, sizeof(host)) != 0)
+    strcpy(host, "localhost");
+  host[sizeof(host) - 1] = '\0';
+  r->cnameLen = snprintf(r->cname, sizeof(r->cname), "rtph264@%s", host);
+  if(r->cnameLen > 255)
+    r->cnameLen = 255;
+
+  return r;
+}
+
+void Rtcp_Destroy(Rtcp *r)
+{
+  free(r);
+}
+
+static void source_init(Rtcp *r, uint32_t ssrc, unsigned short seq)
+{
+  r->started = 1;
+  r->source = ssrc;
+  r->baseSeq = seq;
+  r->maxSeq = seq;
+  r->badSeq = 0x10001;
+  r->cycles = 0;
+  r->received = 0;
+  r->expectedPrior = 0;
+  r->receivedPrior = 0;
+  r->lsr = 0;
+  r->missingCount = 0;
+}
+
+static void missing_add(Rtcp *r, unsigned short seq, int count, unsigned int nowMs)
+{
+  while(count-- > 0 && r->missingCount < MISSING_MAX)  {
+    RtcpMissing *m = &r->missing[r->missingCount++];
+    m->seq = seq++;
+    m->tries = 0;
+    m->first = nowMs;
+    m->sent = 0;
+  }
+}
+
+static void missing_remove(Rtcp *r, unsigned short seq)
+{
+  int i;
+  for(i = 0; i < r->missingCount; i++)  {
+    if(r->missing[i].seq == seq)  {
+      if(r->missing[i].tries)
+        STAT_INC(nack_recovered);
+      r->missing[i] = r->missing[--r->missingCount];
+      return;
+    }
+  }
+}
+
+void Rtcp_OnRtp(Rtcp *r, const uint8_t *pkt, int len, const struct sockaddr_in *from, unsigned int nowMs)
+{
+  if(len < 12 || (pkt[0] >> 6) != 2)
+    return;
+
+  unsigned short seq = (pkt[2] << 8) | pkt[3];
+  uint32_t ssrc = get32(pkt + 8);
+
+  if(!r->started || ssrc != r->source)
+    source_init(r, ssrc, seq);
+
+  /* reports go to the RTP source port + 1 until the source's own RTCP shows up */
+  if(from && !r->peerFromRtcp)  {
+    r->peer = *from;
+    r->peer.sin_port = htons(ntohs(from->sin_port) + 1);
+    r->peerKnown = 1;
+  }
+
+  unsigned short udelta = seq - r->maxSeq;
+  if(udelta < MAX_DROPOUT)  {
+    if(udelta > 1 && r->deadline > 0)
+      missing_add(r, r->maxSeq + 1, udelta - 1, nowMs);
+    if(seq < r->maxSeq)
+      r->cycles += 0x10000;
+    r->maxSeq = seq;
+  } else if(udelta <= 0x10000 - MAX_MISORDER)  {
+    /* a jump, believed once the next packet follows on from it */
+    if(seq != r->badSeq)  {
+      r->badSeq = (seq + 1) & 0xffff;
+      return;
+    }
+    source_init(r, ssrc, seq);
+  } else if(r->missingCount)  {
+    /* reordered, retransmitted or duplicate */
+    missing_remove(r, seq);
+  }
+  r->received++;
+}
+
+void Rtcp_Receive(Rtcp *r, unsigned int nowMs)
+{
+  uint8_t buf[PACKET_SIZE];
+
+  for(;;)  {
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int len = recvfrom(r->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
+    if(len < 0)
+      return;
+
+    /* walk the compound packet */
+    int off = 0;
+    while(off + 8 <= len)  {
+      const uint8_t *p = buf + off;
+      int size = (((p[2] << 8) | p[3]) + 1) * 4;
+      if((p[0] >> 6) != 2 || off + size > len)
+        break;
+
+      if(p[1] == RTCP_SR && size >= 28 && (!r->started || get32(p + 4) == r->source))  {
+        /* middle 32 bits of the NTP timestamp */
+        r->lsr = (get32(p + 8) << 16) | (get32(p + 12) >> 16);
+        r->srArrival = nowMs;
+        STAT_INC(sr_received);
+        r->peer = from;
+        r->peerKnown = 1;
+        r->peerFromRtcp = 1;
+      }
+      off += size;
+    }
+  }
+}
+
+static void send_packet(Rtcp *r, const uint8_t *buf, int len)
+{
+  /* best effort, the next report carries the same counters */
+  sendto(r->fd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&r->peer, sizeof(r->peer));
+}
+
+/* RR with one report block followed by SDES CNAME, every compound packet starts so */
+static int build_report(Rtcp *r, uint8_t *buf, unsigned int jitter, unsigned int nowMs)
+{
+  uint8_t *p = buf;
+
+  /* RFC 3550 A.3 */
+  unsigned int extendedMax = r->cycles + r->maxSeq;
+  unsigned int expected = extendedMax - r->baseSeq + 1;
+  int lost = expected - r->received;
+  if(lost > 0x7fffff)
+    lost = 0x7fffff;
+  else if(lost < -0x800000)
+    lost = -0x800000;
+
+  unsigned int expectedInterval = expected - r->expectedPrior;
+  unsigned int receivedInterval = r->received - r->receivedPrior;
+  int lostInterval = expectedInterval - receivedInterval;
+  unsigned int fraction = 0;
+  if(expectedInterval && lostInterval > 0)
+    fraction = ((unsigned int)lostInterval << 8) / expectedInterval;
+  r->expectedPrior = expected;
+  r->receivedPrior = r->received;
+
+  uint32_t dlsr = 0;
+  if(r->lsr)
+    dlsr = (unsigned long long)(nowMs - r->srArrival) * 65536 / 1000;
+
+  p[0] = 0x81;  /* V=2, RC=1 */
+  p[1] = RTCP_RR;
+  put16(p + 2, 7);
+  put32(p + 4, r->ssrc);
+  put32(p + 8, r->source);
+  put32(p + 12, (fraction << 24) | (lost & 0xffffff));
+  put32(p + 16, extendedMax);
+  put32(p + 20, jitter);
+  put32(p + 24, r->lsr);
+  put32(p + 28, dlsr);
+  p += 32;
+
+  /* SDES: SSRC, CNAME item, END, padded to a word */
+  int sdes = (4 + 2 + r->cnameLen + 1 + 3) & ~3;
+  memset(p, 0, 4 + sdes);
+  p[0] = 0x81;  /* V=2, SC=1 */
+  p[1] = RTCP_SDES;
+  put16(p + 2, sdes / 4);
+  put32(p + 4, r->ssrc);
+  p[8] = 1;     /* CNAME */
+  p[9] = r->cnameLen;
+  memcpy(p + 10, r->cname, r->cnameLen);
+  p += 4 + sdes;
+
+  STAT_SET(lost, lost > 0 ? lost : 0);
+  STAT_SET(fraction_lost, fraction);
+  STAT_INC(rr_sent);
+
+  return p - buf;
+}
+
+/* Generic NACK, one PID and a bitmask of the 16 that follow it per FCI */
+static int build_nack(Rtcp *r, uint8_t *buf, unsigned int nowMs)
+{
+  uint8_t *fci = buf + 12;
+  int count = 0;
+  int i;
+
+  for(i = 0; i < r->missingCount && count < FCI_MAX; i++)  {
+    RtcpMissing *m = &r->missing[i];
+    if(m->tries >= NACK_TRIES)
+      continue;
+    /* ask again only if the first answer should have been here by now */
+    if(m->tries && (int)(nowMs - m->sent) < r->deadline / 2)
+      continue;
+
+    int j;
+    for(j = 0; j < count; j++)  {
+      unsigned short pid = (fci[j * 4] << 8) | fci[j * 4 + 1];
+      int d = seq_diff(m->seq, pid);
+      if(d > 0 && d <= 16)  {
+        unsigned int blp = (fci[j * 4 + 2] << 8) | fci[j * 4 + 3];
+        put16(fci + j * 4 + 2, blp | (1 << (d - 1)));
+        break;
+      }
+    }
+    if(j == count)  {
+      put16(fci + count * 4, m->seq);
+      put16(fci + count * 4 + 2, 0);
+      count++;
+    }
+
+    m->tries++;
+    m->sent = nowMs;
+    STAT_INC(nack_seqs);
+  }
+
+  if(!count)
+    return 0;
+
+  buf[0] = 0x80 | RTPFB_NACK;
+  buf[1] = RTCP_RTPFB;
+  put16(buf + 2, 2 + count);
+  put32(buf + 4, r->ssrc);
+  put32(buf + 8, r->source);
+  STAT_INC(nack_sent);
+
+  return 12 + count * 4;
+}
+
+static void expire(Rtcp *r, unsigned int nowMs)
+{
+  int i = 0;
+  while(i < r->missingCount)  {
+    if((int)(nowMs - r->missing[i].first) >= r->deadline)  {
+      /* the reorder buffer has moved on, an answer would be dropped as late */
+      if(r->missing[i].tries)
+        STAT_INC(nack_expired);
+      r->missing[i] = r->missing[--r->missingCount];
+    } else
+      i++;
+  }
+}
+
+void Rtcp_Poll(Rtcp *r, unsigned int jitter, unsigned int nowMs)
+{
+  uint8_t buf[PACKET_SIZE];
+  uint8_t fb[12 + FCI_MAX * 4];
+  int nack = 0;
+
+  if(!r->started || !r->peerKnown)
+    return;
+
+  if(r->missingCount)  {
+    expire(r, nowMs);
+    nack = build_nack(r, fb, nowMs);
+  }
+
+  if(!nack && r->next && (int)(nowMs - r->next) < 0)
+    return;
+
+  /* RFC 4585 feedback rides in a compound packet behind a report */
+  int len = build_report(r, buf, jitter, nowMs);
+  memcpy(buf + len, fb, nack);
+  send_packet(r, buf, len + nack);
+  r->next = schedule(r, nowMs);
+}
+
+void Rtcp_Bye(Rtcp *r, unsigned int jitter, unsigned int nowMs)
+{
+  uint8_t buf[PACKET_SIZE];
+
+  if(!r->started || !r->peerKnown)
+    return;
+
+  int len = build_report(r, buf, jitter, nowMs);
+  uint8_t *p = buf + len;
+  p[0] = 0x81;  /* V=2, SC=1 */
+  p[1] = RTCP_BYE;
+  put16(p + 2, 1);
+  put32(p + 4, r->ssrc);
+  send_packet(r, buf, len + 8);
+}
+
+void Rtcp_GetStats(Rtcp *r, RtcpStats *stats)
+{
+  STAT_LOAD(rr_sent);
+  STAT_LOAD(sr_received);
+  STAT_LOAD(nack_sent);
+  STAT_LOAD(nack_seqs);
+  STAT_LOAD(nack_recovered);
+  STAT_LOAD(nack_expired);
+  STAT_LOAD(lost);
+  STAT_LOAD(fraction_lost);
+}
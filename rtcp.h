@@ -0,0 +1,64 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTCP_H
+#define RTCP_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * Receiver side of the RTCP companion socket (RTP port + 1).
+ *
+ * Sends RFC 3550 receiver reports for the one source being received and,
+ * when enabled, RFC 4585 generic NACKs for sequence numbers missing in
+ * arrival order. A missing packet is asked for at most twice and never
+ * once its deadline, the time the reorder buffer waits for a hole, has
+ * passed. Everything runs on the receive thread.
+ */
+
+typedef struct RtcpStats {
+  unsigned long long rr_sent;      /* compound receiver report packets */
+  unsigned long long sr_received;  /* sender reports from the source */
+  unsigned long long nack_sent;    /* generic NACK packets */
+  unsigned long long nack_seqs;    /* sequence numbers asked for, retries included */
+  unsigned long long nack_recovered; /* asked for and then received */
+  unsigned long long nack_expired; /* asked for, deadline passed without them */
+  unsigned long long lost;         /* RFC 3550 cumulative number of packets lost */
+  unsigned int fraction_lost;      /* of the last report, 1/256 units */
+} RtcpStats;
+
+typedef struct Rtcp Rtcp;
+
+/* nackDeadlineMs 0 sends no NACKs */
+Rtcp *Rtcp_Create(int fd, int intervalMs, int nackDeadlineMs);
+void Rtcp_Destroy(Rtcp *r);
+/* every RTP packet in arrival order, from is where it came from */
+void Rtcp_OnRtp(Rtcp *r, const uint8_t *pkt, int len, const struct sockaddr_in *from, unsigned int nowMs);
+/* read what arrived on the RTCP socket, sender reports are kept for LSR/DLSR */
+void Rtcp_Receive(Rtcp *r, unsigned int nowMs);
+/* send NACKs for new holes and a receiver report when one is due */
+void Rtcp_Poll(Rtcp *r, unsigned int jitter, unsigned int nowMs);
+/* say goodbye to the source */
+void Rtcp_Bye(Rtcp *r, unsigned int jitter, unsigned int nowMs);
+/* from any thread, each field is loaded atomically on its own */
+void Rtcp_GetStats(Rtcp *r, RtcpStats *stats);
+
+#endif
@@ -0,0 +1,511 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+
+/*
+ * Replays a pcap or rtpdump capture through a session and reports
+ * throughput, e.g.
+ *
+ *   rtpbench -o out.mp4 -c reference.mp4 -T 1,2,4 stream.pcap
+ *
+ * runs once per decoder thread count and exits non-zero when any
+ * recording differs from the reference. With -H only the RTP header
+ * parsing of the captured packets is timed.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "rtph264.h"
+#include "rtpdataheader.h"
+#include "rtpheader.h"
+
+#define MAX_RUNS 16
+#define HEADER_BENCH_PACKETS 1024      /* cache resident, like a packet just received */
+#define HEADER_BENCH_PARSES 50000000
+
+typedef struct Result {
+  int threads;
+  double wall;            /* s */
+  double cpu;             /* s, whole process */
+  RtpH264_Stats stats;
+  RtpSourceStats source;
+} Result;
+
+static RtpH264Session *session = NULL;
+static volatile int interrupted = 0;
+
+static void sig_handler(int s)
+{
+  if(s == SIGINT)  {
+    interrupted = 1;
+    if(session)
+      RtpH264Session_Stop(session);
+  }
+}
+
+static void OnPicture(unsigned char *data, int lineSize, int width, int height)
+{
+}
+
+static void Usage(void)
+{
+  fprintf(stderr, "Usage: rtpbench [options] capture\n\n"
+      "Options:\n"
+      "-h | --help           Print usage information (this message)\n"
+      "-p | --port           UDP destination port of the stream in a pcap : default any\n"
+      "-r | --realtime       Replay with the captured timing instead of as fast as possible\n"
+      "-f | --fidelity       Decode profile full, fast, keyframes or none : default full\n"
+      "-T | --threads        Decoder thread counts to run, e.g. 1,2,4 : default 1\n"
+      "-y | --thread-type    Decoder threading frame, slice or both : default both\n"
+      "-R | --receive-cpus   Pin the receive thread, e.g. 0\n"
+      "-D | --decode-cpus    Pin the decoder threads, e.g. 2-5\n"
+      "-W | --write-cpus     Pin the writer thread\n"
+      "-N | --numa           Keep threads and memory on this NUMA node\n"
+      "-H | --header-bench   Time RTP header parsing only, old bitfield path against RtpHeader\n"
+      "-o | --output         Record to this MP4\n"
+      "-c | --compare        Check the recording against this MP4\n\n");
+}
+
+static double clock_s(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* FNV-1a of a file, -1 when it cannot be read */
+static int hash_file(const char *filename, unsigned long long *hash, long long *size)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f)
+    return -1;
+
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  long long n = 0;
+  int c;
+  while((c = getc(f)) != EOF)  {
+    h = (h ^ c) * 0x100000001b3ULL;
+    n++;
+  }
+  fclose(f);
+
+  *hash = h;
+  *size = n;
+  return 0;
+}
+
+/* byte offset of the first difference, -1 when the files are the same */
+static long long compare_files(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fopen(b, "rb");
+  long long off = 0;
+
+  if(!fa || !fb)  {
+    if(fa)
+      fclose(fa);
+    if(fb)
+      fclose(fb);
+    return 0;
+  }
+
+  for(;;)  {
+    int ca = getc(fa);
+    int cb = getc(fb);
+    if(ca != cb)
+      break;
+    if(ca == EOF)  {
+      off = -1;
+      break;
+    }
+    off++;
+  }
+
+  fclose(fa);
+  fclose(fb);
+  return off;
+}
+
+static int run(const char *capture, int port, int realtime, int decode,
+               const RtpH264Config *cfg, Result *r)
+{
+  RtpSource *src = RtpSource_Open(capture, port);
+  if(!src)
+    return -1;
+
+  session = RtpH264Session_Create(cfg);
+  if(!session)  {
+    fprintf(stderr, "could not create session\n");
+    RtpSource_Close(src);
+    return -1;
+  }
+
+  r->threads = cfg->decodeThreads > 1 ? cfg->decodeThreads : 1;
+  r->wall = clock_s(CLOCK_MONOTONIC);
+  r->cpu = clock_s(CLOCK_PROCESS_CPUTIME_ID);
+  RtpH264Session_RunSource(session, src, realtime, decode ? OnPicture : NULL);
+
+  RtpH264Session_GetStats(session, &r->stats);
+  /* closes the recording, the writer has finished with it */
+  RtpH264Session_Destroy(session);
+  session = NULL;
+
+  r->wall = clock_s(CLOCK_MONOTONIC) - r->wall;
+  r->cpu = clock_s(CLOCK_PROCESS_CPUTIME_ID) - r->cpu;
+  if(r->wall <= 0)
+    r->wall = 1e-9;
+
+  RtpSource_GetStats(src, &r->source);
+  RtpSource_Close(src);
+  return 0;
+}
+
+static void report(const Result *r)
+{
+  const RtpH264_Stats *stats = &r->stats;
+
+  printf("%llu packets (%llu records, %llu skipped), %llu bytes in %.3f s\n",
+    stats->packets, r->source.records, r->source.skipped, stats->bytes, r->wall);
+  printf("%.0f packets/s, %.1f Mbit/s\n", stats->packets / r->wall, stats->bytes * 8 / r->wall / 1e6);
+  printf("%llu access units, %llu key frames, %.1f frames/s, %llu decoded, %.1f decoded/s\n",
+    stats->access_units, stats->key_frames, stats->access_units / r->wall,
+    stats->decoded, stats->decoded / r->wall);
+  printf("cpu %.3f s, %.1f us per frame, decode %.1f us per frame, p50/p90/p99 %u/%u/%u us\n",
+    r->cpu, stats->access_units ? r->cpu * 1e6 / stats->access_units : 0.0,
+    stats->decoded ? (double)stats->decode_us / stats->decoded : 0.0,
+    stats->decode_p50_us, stats->decode_p90_us, stats->decode_p99_us);
+  printf("%llu lost, %llu reordered, %llu FU NAL units dropped, %llu decode errors\n",
+    stats->lost, stats->reordered, stats->fu_dropped, stats->decode_errors);
+  if(stats->shed_nonref || stats->shed_ref || stats->queue_drops || stats->write_drops_nonref || stats->write_drops_ref)
+    printf("warning : frames shed or dropped under load, numbers are not comparable\n");
+}
+
+/* 0 when the recording is there and, if asked, matches the reference */
+static int check_output(const char *output, const char *reference)
+{
+  unsigned long long hash;
+  long long size;
+
+  if(hash_file(output, &hash, &size) < 0)  {
+    fprintf(stderr, "could not read %s\n", output);
+    return -1;
+  }
+  printf("%s : %lld bytes, fnv1a %016llx\n", output, size, hash);
+
+  if(reference)  {
+    long long off = compare_files(output, reference);
+    if(off >= 0)  {
+      printf("%s differs from %s at byte %lld\n", output, reference, off);
+      return -1;
+    }
+    printf("%s matches %s\n", output, reference);
+  }
+  return 0;
+}
+
+/* captured packets back to back in memory */
+typedef struct Packets {
+  uint8_t *data;
+  int *offset;
+  int *len;
+  int count;
+} Packets;
+
+static int load_packets(const char *capture, int port, Packets *p)
+{
+  RtpSource *src = RtpSource_Open(capture, port);
+  if(!src)
+    return -1;
+
+  p->data = malloc((size_t)HEADER_BENCH_PACKETS * 2048);
+  p->offset = malloc(HEADER_BENCH_PACKETS * sizeof(int));
+  p->len = malloc(HEADER_BENCH_PACKETS * sizeof(int));
+  p->count = 0;
+  if(!p->data || !p->offset || !p->len)  {
+    RtpSource_Close(src);
+    return -1;
+  }
+
+  int used = 0;
+  while(p->count < HEADER_BENCH_PACKETS)  {
+    unsigned long long timeUs;
+    int len = RtpSource_Read(src, p->data + used, 2048, &timeUs);
+    if(len <= 0)
+      break;
+    if(len > 2048)
+      continue;
+    p->offset[p->count] = used;
+    p->len[p->count] = len;
+    p->count++;
+    used += len;
+  }
+  RtpSource_Close(src);
+  return 0;
+}
+
+/* what RtpDepack_Packet did before RtpHeader: bitfields, payload right after 12 bytes */
+static unsigned long long legacy_pass(const Packets *p)
+{
+  unsigned long long sum = 0;
+  int i;
+
+  for(i = 0; i < p->count; i++)  {
+    const uint8_t *pkt = p->data + p->offset[i];
+    int len = p->len[i];
+    rtp_hdr_t rtp;
+
+    if(len <= sizeof(rtp_hdr_t))
+      continue;
+    memcpy(&rtp, pkt, sizeof(rtp_hdr_t));
+    const uint8_t *payload = pkt + sizeof(rtp_hdr_t);
+    int size = len - sizeof(rtp_hdr_t);
+    sum += ntohl(rtp.ts) + ntohs(rtp.seq) + rtp.m + payload[0] + size;
+  }
+  return sum;
+}
+
+static unsigned long long header_pass(const Packets *p)
+{
+  unsigned long long sum = 0;
+  int i;
+
+  for(i = 0; i < p->count; i++)  {
+    RtpHeader rtp;
+    if(RtpHeader_Parse(p->data + p->offset[i], p->len[i], &rtp) < 0 || rtp.payloadLen <= 0)
+      continue;
+    sum += rtp.timestamp + rtp.seq + rtp.marker + rtp.payload[0] + rtp.payloadLen;
+  }
+  return sum;
+}
+
+/* best of three, ns per packet */
+static double time_pass(unsigned long long (*pass)(const Packets *), const Packets *p, unsigned long long *sum)
+{
+  int rounds = HEADER_BENCH_PARSES / p->count + 1;
+  double best = 0;
+  int t, i;
+
+  for(t = 0; t < 3; t++)  {
+    double start = clock_s(CLOCK_MONOTONIC);
+    for(i = 0; i < rounds; i++)
+      *sum += pass(p);
+    double ns = (clock_s(CLOCK_MONOTONIC) - start) * 1e9 / ((double)rounds * p->count);
+    if(t == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+static int header_bench(const char *capture, int port)
+{
+  Packets p;
+  if(load_packets(capture, port, &p) < 0 || p.count == 0)  {
+    fprintf(stderr, "no packets in %s\n", capture);
+    return -1;
+  }
+
+  int csrc = 0, ext = 0, padded = 0, invalid = 0, misparsed = 0;
+  int i;
+  for(i = 0; i < p.count; i++)  {
+    RtpHeader rtp;
+    if(RtpHeader_Parse(p.data + p.offset[i], p.len[i], &rtp) < 0)  {
+      invalid++;
+      continue;
+    }
+    csrc += rtp.csrcCount > 0;
+    ext += rtp.extProfile >= 0;
+    padded += rtp.padding > 0;
+    misparsed += rtp.payload != p.data + p.offset[i] + 12 || rtp.payloadLen != p.len[i] - 12;
+  }
+
+  printf("%d packets, %d with CSRCs, %d with a header extension, %d padded, %d invalid\n",
+    p.count, csrc, ext, padded, invalid);
+  printf("%d packets the old path cut in the wrong place\n", misparsed);
+
+  /* the sums keep the passes from being optimized away */
+  unsigned long long sum = 0;
+  double legacy = time_pass(legacy_pass, &p, &sum);
+  double header = time_pass(header_pass, &p, &sum);
+  printf("bitfield %.2f ns/packet, RtpHeader %.2f ns/packet (%.2fx) [%llx]\n",
+    legacy, header, header / legacy, sum & 0xff);
+
+  free(p.data);
+  free(p.offset);
+  free(p.len);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char shortOptions[] = "hp:rf:T:y:R:D:W:N:Ho:c:";
+  const struct option longOptions[] = {
+    {"help",         no_argument,       NULL, 'h' },
+    {"port",         required_argument, NULL, 'p' },
+    {"realtime",     no_argument,       NULL, 'r' },
+    {"fidelity",     required_argument, NULL, 'f' },
+    {"threads",      required_argument, NULL, 'T' },
+    {"thread-type",  required_argument, NULL, 'y' },
+    {"receive-cpus", required_argument, NULL, 'R' },
+    {"decode-cpus",  required_argument, NULL, 'D' },
+    {"write-cpus",   required_argument, NULL, 'W' },
+    {"numa",         required_argument, NULL, 'N' },
+    {"header-bench", no_argument,       NULL, 'H' },
+    {"output",       required_argument, NULL, 'o' },
+    {"compare",      required_argument, NULL, 'c' },
+    {0, 0, 0, 0}
+  };
+
+  int port = 0;
+  int realtime = 0;
+  int decode = 1;
+  int threads[MAX_RUNS] = { 1 };
+  int runs = 1;
+  int headerBench = 0;
+  const char *output = NULL;
+  const char *reference = NULL;
+
+  RtpH264Config cfg;
+  RtpH264_DefaultConfig(&cfg);
+
+  int opt;
+  while((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1)  {
+    switch(opt)  {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'r':
+        realtime = 1;
+        break;
+      case 'f':
+        if(strcmp(optarg, "full") == 0)
+          cfg.decodeProfile = RTPH264_DECODE_FULL;
+        else if(strcmp(optarg, "fast") == 0)
+          cfg.decodeProfile = RTPH264_DECODE_FAST;
+        else if(strcmp(optarg, "keyframes") == 0)
+          cfg.decodeProfile = RTPH264_DECODE_KEYFRAMES;
+        else if(strcmp(optarg, "none") == 0)
+          decode = 0;
+        else  {
+          Usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'T':  {
+        char *p = optarg;
+        for(runs = 0; *p && runs < MAX_RUNS; runs++)  {
+          threads[runs] = strtol(p, &p, 10);
+          if(threads[runs] < 1 || (*p && *p != ','))  {
+            Usage();
+            return EXIT_FAILURE;
+          }
+          if(*p == ',')
+            p++;
+        }
+        break;
+      }
+      case 'y':
+        if(strcmp(optarg, "frame") == 0)
+          cfg.decodeThreadType = RTPH264_THREAD_FRAME;
+        else if(strcmp(optarg, "slice") == 0)
+          cfg.decodeThreadType = RTPH264_THREAD_SLICE;
+        else if(strcmp(optarg, "both") == 0)
+          cfg.decodeThreadType = RTPH264_THREAD_FRAME | RTPH264_THREAD_SLICE;
+        else  {
+          Usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'R':
+        cfg.receiveCpus = optarg;
+        break;
+      case 'D':
+        cfg.decodeCpus = optarg;
+        break;
+      case 'W':
+        cfg.writeCpus = optarg;
+        break;
+      case 'N':
+        cfg.numaNode = atoi(optarg);
+        break;
+      case 'H':
+        headerBench = 1;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'c':
+        reference = optarg;
+        break;
+      default:
+        Usage();
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if(optind != argc - 1 || runs < 1 || (reference && !output))  {
+    Usage();
+    return EXIT_FAILURE;
+  }
+
+  if(headerBench)
+    return header_bench(argv[optind], port) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  cfg.filename = output;
+  cfg.recordOnly = !decode;
+  signal(SIGINT, sig_handler);
+
+  Result results[MAX_RUNS];
+  int done = 0;
+  int failed = 0;
+  int i;
+
+  for(i = 0; i < runs && !interrupted; i++)  {
+    cfg.decodeThreads = threads[i];
+    printf("== %d decoder thread%s%s%s%s%s%s\n", threads[i], threads[i] > 1 ? "s" : "",
+      cfg.receiveCpus ? ", receive on " : "", cfg.receiveCpus ? cfg.receiveCpus : "",
+      cfg.decodeCpus ? ", decode on " : "", cfg.decodeCpus ? cfg.decodeCpus : "",
+      cfg.numaNode >= 0 ? ", one NUMA node" : "");
+
+    if(run(argv[optind], port, realtime, decode, &cfg, &results[done]) < 0)
+      return EXIT_FAILURE;
+    report(&results[done]);
+    if(output && check_output(output, reference) < 0)
+      failed = 1;
+    done++;
+  }
+
+  if(done > 1)  {
+    printf("\nthreads  packets/s  frames/s  decoded/s  cpu us/frame  decode p50/p99 us\n");
+    for(i = 0; i < done; i++)  {
+      const Result *r = &results[i];
+      printf("%7d  %9.0f  %8.1f  %9.1f  %12.1f  %8u/%u\n", r->threads,
+        r->stats.packets / r->wall, r->stats.access_units / r->wall, r->stats.decoded / r->wall,
+        r->stats.access_units ? r->cpu * 1e6 / r->stats.access_units : 0.0,
+        r->stats.decode_p50_us, r->stats.decode_p99_us);
+    }
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
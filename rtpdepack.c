@@ -0,0 +1,446 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_AV_CONFIG_H
+#undef HAVE_AV_CONFIG_H
+#endif
+
+#include "libavcodec/avcodec.h"
+
+#include "rtpheader.h"
+#include "rtpdepack.h"
+
+struct RtpDepack {
+  NalPool *pool;
+  NalBuf *au;           /* access unit being assembled, NULL between units */
+
+  /* FU in progress: fu holds it from byte nalStart, NULL if none */
+  NalBuf *fu;
+  int nalStart;
+  NalBuf *fuDonBuf;     /* interleaved FU-B reassembly, never part of au */
+  int fuDon;            /* DON of the FU-B being reassembled, -1 if none */
+  unsigned short sequence;
+  unsigned int timestamp;
+
+  RtpDon *don;          /* decoding order buffer, interleaved mode only */
+  unsigned int now;     /* arrival time of the current packet, ms */
+
+  RtpDepack_Emit emit;
+  void *opaque;
+  RtpDepackStats stats;
+};
+
+/* single writer, relaxed atomic stores so GetStats from another thread never sees a torn value */
+#define STAT_SET(field, value) __atomic_store_n(&d->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, d->stats.field + (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_LOAD(field) (stats->field = __atomic_load_n(&d->stats.field, __ATOMIC_RELAXED))
+
+static const uint8_t start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/* Hand the pending access unit over */
+static void au_flush(RtpDepack *d)
+{
+  NalBuf *au = d->au;
+  if(!au || au->size == 0)
+    return;
+
+  d->au = NULL;
+  NalBuf_Pad(au);
+  au->receiveMs = d->now;
+
+  STAT_INC(access_units);
+  if(au->flags & PKT_FLAG_KEY)
+    STAT_INC(key_frames);
+
+  d->emit(d->opaque, au);
+}
+
+/* Drop a fragmented NAL unit that will never complete */
+static void fu_abort(RtpDepack *d)
+{
+  if(!d->fu)
+    return;
+  d->fu->size = d->nalStart;
+  d->fu = NULL;
+  STAT_INC(fu_dropped);
+}
+
+/*
+ * Get the access unit buffer ready for a NAL unit with this timestamp.
+ * A NAL unit with another timestamp completes the pending unit.
+ */
+static NalBuf *au_begin(RtpDepack *d, unsigned int timestamp)
+{
+  if(d->fu && d->fu == d->au)
+    fu_abort(d);
+
+  if(d->au && d->au->size > 0 && timestamp != d->au->timestamp)
+    au_flush(d);
+
+  if(!d->au)  {
+    d->au = NalPool_Get(d->pool);
+    if(!d->au)
+      return NULL;
+  }
+  d->au->timestamp = timestamp;
+  return d->au;
+}
+
+/* Account for a complete NAL unit, header is its first byte */
+static void au_nal(RtpDepack *d, NalBuf *au, uint8_t header)
+{
+  STAT_INC(nal_types[header & 0x1f]);
+  if((header & 0x1f) == 5)  /* IDR */
+    au->flags |= PKT_FLAG_KEY;
+  if(header & 0x60)
+    au->ref = 1;
+  au->nalTypes |= 1 << (header & 0x1f);
+}
+
+/* Add one whole NAL unit to the access unit, prefixing a start code */
+static void au_add(RtpDepack *d, const uint8_t *nal, int len, unsigned int timestamp)
+{
+  NalBuf *au = au_begin(d, timestamp);
+  if(!au || NalBuf_Reserve(au, au->size + 4 + len) < 0)  {
+    STAT_INC(nomem);
+    return;
+  }
+  NalBuf_Append(au, start_code, 4);
+  NalBuf_Append(au, nal, len);
+  au_nal(d, au, nal[0]);
+}
+
+/*
+ * Split an aggregation packet into start code prefixed NAL units.
+ * Each NAL unit is copied once, straight from the datagram into the
+ * access unit, so the decoder sees one Annex B packet.
+ * In interleaved mode the units go to the decoding order buffer instead.
+ */
+static void depack_aggregate(RtpDepack *d, const uint8_t *p, int size, int type,
+                             unsigned int timestamp, int marker)
+{
+  /*  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   *  |STAP-A NAL HDR |         NALU 1 Size           | NALU 1 HDR    |
+   *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   *  |                         NALU 1 Data                           |
+   *  :                                                               :
+   *  +               +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   *  |               | NALU 2 Size                   | NALU 2 HDR    |
+   *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   *
+   * STAP-B carries a 16 bit DON right after the NAL header, the DON of
+   * each following unit is one more than the one before.
+   *
+   * MTAP16/MTAP24 carry a 16 bit DONB after the NAL header, and each unit
+   * has an 8 bit DOND and a 16/24 bit TS offset between size and NAL unit,
+   * its DON is DONB + DOND.
+   */
+  const uint8_t *end = p + size;
+  unsigned short don = 0;
+  int unitHeader = 0;   /* DOND + TS offset bytes */
+
+  if(type == 24) {
+    p += 1;
+  } else {
+    if(size < 3)
+      return;
+    don = (p[1] << 8) | p[2];
+    p += 3;
+    if(type == 26)
+      unitHeader = 3;
+    else if(type == 27)
+      unitHeader = 4;
+  }
+
+  while(end - p > 2 + unitHeader) {
+    int nalu_size = (p[0] << 8) | p[1];
+    unsigned short nalu_don = don;
+    unsigned int nalu_ts = timestamp;
+
+    if(unitHeader)  {
+      nalu_don = don + p[2];
+      if(type == 26)
+        nalu_ts += (p[3] << 8) | p[4];
+      else
+        nalu_ts += (p[3] << 16) | (p[4] << 8) | p[5];
+    }
+    p += 2 + unitHeader;
+
+    if(nalu_size == 0 || nalu_size > end - p)  {
+      STAT_INC(invalid);
+      break;
+    }
+
+    if(d->don && type != 24)
+      RtpDon_Push(d->don, nalu_don, nalu_ts, p, nalu_size, d->now);
+    else
+      au_add(d, p, nalu_size, timestamp);
+
+    STAT_INC(aggregated);
+    p += nalu_size;
+    /* only STAP-B numbers its units consecutively, MTAP has DOND per unit */
+    if(type == 25)
+      don++;
+  }
+
+  if(marker && !d->don)
+    au_flush(d);
+}
+
+/*
+ * Fragmentation units are reassembled in place, at the end of the access
+ * unit they belong to. An interleaved FU-B has to wait in the decoding
+ * order buffer, so it is put together in a buffer of its own.
+ */
+static void depack_fu(RtpDepack *d, const RtpHeader *rtp, const uint8_t *header, int size, int type)
+{
+  /* +---------------+
+  * |0|1|2|3|4|5|6|7|
+  * +-+-+-+-+-+-+-+-+
+  * |S|E|R|  Type   |
+  * +---------------+
+  *
+  * R is reserved and always 0
+  */
+
+  /* strip off FU indicator and FU header (and DON for FU-B) bytes */
+  int skip = (type == 28) ? 2 : 4;
+  if(size <= skip)  {
+    STAT_INC(invalid);
+    return;
+  }
+
+  unsigned char fu_indicator = header[0];
+  unsigned char fu_header = header[1];
+
+  /* NAL unit starts here */
+  if((fu_header & 0x80) == 0x80)  {
+    NalBuf *buf;
+
+    /* only the first fragment of an interleaved NAL unit is FU-B */
+    d->fuDon = (type == 29 && d->don) ? ((header[2] << 8) | header[3]) : -1;
+
+    if(d->fuDon >= 0)  {
+      fu_abort(d);
+      if(!d->fuDonBuf)
+        d->fuDonBuf = NalPool_Get(d->pool);
+      buf = d->fuDonBuf;
+      if(buf)
+        buf->size = 0;
+    } else  {
+      buf = au_begin(d, rtp->timestamp);
+    }
+    if(!buf)  {
+      STAT_INC(nomem);
+      return;
+    }
+
+    d->timestamp = rtp->timestamp;
+    d->sequence = rtp->seq;
+
+    d->fu = buf;
+    d->nalStart = buf->size;
+    uint8_t nal = (fu_indicator & 0xe0) | (fu_header & 0x1f);
+    if(NalBuf_Append(buf, start_code, 4) < 0 || NalBuf_Append(buf, &nal, 1) < 0)  {
+      buf->size = d->nalStart;
+      d->fu = NULL;
+      STAT_INC(nomem);
+      return;
+    }
+  } else  {
+    if(!d->fu)
+      return;  /* start fragment never seen */
+
+    if(rtp->timestamp != d->timestamp)
+      STAT_INC(ts_mismatch);
+
+    if(rtp->seq != ++d->sequence)  {
+      /* a fragment is missing, the NAL unit can't be decoded */
+      fu_abort(d);
+      return;
+    }
+  }
+
+  if(NalBuf_Append(d->fu, header + skip, size - skip) < 0)  {
+    d->fu->size = d->nalStart;
+    d->fu = NULL;
+    STAT_INC(nomem);
+    return;
+  }
+
+  /* NAL unit ends  */
+  if((fu_header & 0x40) == 0x40)  {
+    NalBuf *buf = d->fu;
+    d->fu = NULL;
+
+    if(buf == d->fuDonBuf)  {
+      RtpDon_Push(d->don, d->fuDon, d->timestamp, buf->data + 4, buf->size - 4, d->now);
+      buf->size = 0;
+      return;
+    }
+
+    au_nal(d, buf, buf->data[d->nalStart + 4]);
+    if(rtp->marker)
+      au_flush(d);
+  }
+}
+
+void RtpDepack_Packet(RtpDepack *d, const uint8_t *pkt, int len, unsigned int nowMs)
+{
+  RtpHeader rtp;
+
+  /* CSRCs, header extension and padding are not part of the payload */
+  if(RtpHeader_Parse(pkt, len, &rtp) < 0 || rtp.payloadLen <= 0)  {
+    STAT_INC(invalid);
+    return; /*Invalid packet ???*/
+  }
+  if(rtp.extProfile >= 0)
+    STAT_INC(extensions);
+  d->now = nowMs;
+
+  /*  Handle H.264 RTP Header */
+  /* +---------------+
+  *  |0|1|2|3|4|5|6|7|
+  *  +-+-+-+-+-+-+-+-+
+  *  |F|NRI|  Type   |
+  *  +---------------+
+  *
+  * F must be 0.
+  */
+  unsigned char nal_unit_type;
+  const unsigned char *header = rtp.payload;  /*  NAL Header  */
+  int size = rtp.payloadLen;
+  nal_unit_type = header[0] & 0x1f;       /*  Type  */
+
+  switch (nal_unit_type) {
+    case 0:
+    case 30:
+    case 31:
+      /* undefined */
+      break;
+    case 25:
+      /* STAP-B    Single-time aggregation packet     5.7.1 */
+      /* 2 byte extra header for DON */
+    case 24:
+      /* STAP-A    Single-time aggregation packet     5.7.1 */
+    case 26:
+      /* MTAP16    Multi-time aggregation packet      5.7.2 */
+    case 27:
+      /* MTAP24    Multi-time aggregation packet      5.7.2 */
+      depack_aggregate(d, header, size, nal_unit_type, rtp.timestamp, rtp.marker);
+      break;
+    case 28:
+      /* FU-A      Fragmentation unit                 5.8 */
+    case 29:
+      /* FU-B      Fragmentation unit                 5.8 */
+      depack_fu(d, &rtp, header, size, nal_unit_type);
+      break;
+    default:
+      /* 1-23   NAL unit  Single NAL unit packet per H.264   5.6 */
+      /* the entire payload is the NAL unit */
+      au_add(d, header, size, rtp.timestamp);
+      if(rtp.marker)
+        au_flush(d);
+      break;
+  }
+}
+
+/* NAL unit released by the decoding order buffer */
+static void on_nal(void *opaque, uint8_t *nal, int len, unsigned int timestamp)
+{
+  RtpDepack *d = opaque;
+  au_add(d, nal + 4, len - 4, timestamp);
+}
+
+RtpDepack *RtpDepack_Create(NalPool *pool, RtpDepack_Emit emit, void *opaque)
+{
+  RtpDepack *d = calloc(1, sizeof(RtpDepack));
+  if(!d)
+    return NULL;
+
+  d->pool = pool;
+  d->fuDon = -1;
+  d->emit = emit;
+  d->opaque = opaque;
+  return d;
+}
+
+int RtpDepack_SetDon(RtpDepack *d, int interleavingDepth, int maxDonDiff, int maxBytes, int latencyMs)
+{
+  RtpDon_Destroy(d->don);
+  d->don = RtpDon_Create(d->pool, interleavingDepth, maxDonDiff, maxBytes, latencyMs, on_nal, d);
+  return d->don ? 0 : -1;
+}
+
+void RtpDepack_Destroy(RtpDepack *d)
+{
+  if(!d)
+    return;
+
+  RtpDon_Destroy(d->don);
+  NalBuf_Unref(d->au);
+  NalBuf_Unref(d->fuDonBuf);
+  free(d);
+}
+
+void RtpDepack_Poll(RtpDepack *d, unsigned int nowMs)
+{
+  d->now = nowMs;
+  if(d->don)
+    RtpDon_Poll(d->don, nowMs);
+}
+
+/* End of stream: release everything held and emit the last access unit */
+void RtpDepack_Flush(RtpDepack *d)
+{
+  if(d->don)
+    RtpDon_Flush(d->don);
+  if(d->fu == d->au)
+    fu_abort(d);
+  au_flush(d);
+}
+
+void RtpDepack_GetStats(RtpDepack *d, RtpDepackStats *stats)
+{
+  int i;
+
+  STAT_LOAD(fu_dropped);
+  STAT_LOAD(aggregated);
+  STAT_LOAD(access_units);
+  STAT_LOAD(key_frames);
+  STAT_LOAD(nomem);
+  STAT_LOAD(invalid);
+  STAT_LOAD(extensions);
+  STAT_LOAD(ts_mismatch);
+  for(i = 0; i < 32; i++)
+    STAT_LOAD(nal_types[i]);
+}
+
+void RtpDepack_GetDonStats(RtpDepack *d, RtpDonStats *stats)
+{
+  if(d->don)
+    RtpDon_GetStats(d->don, stats);
+  else
+    memset(stats, 0, sizeof(RtpDonStats));
+}
@@ -0,0 +1,65 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPDEPACK_H
+#define RTPDEPACK_H
+
+#include <stdint.h>
+
+#include "nalpool.h"
+#include "rtpdon.h"
+
+/*
+ * RTP H.264 depacketizer (RFC 6184). NAL units are reassembled straight
+ * into a pooled access unit buffer, which grows to fit, and handed over
+ * once complete: when the marker bit is set or a NAL unit with another
+ * RTP timestamp shows up.
+ */
+
+/* au is start code prefixed and zero padded; the callee owns the reference */
+typedef void (*RtpDepack_Emit)(void *opaque, NalBuf *au);
+
+typedef struct RtpDepackStats {
+  unsigned long long fu_dropped;    /* FU NAL units discarded for a missing fragment */
+  unsigned long long aggregated;    /* NAL units split out of STAP/MTAP packets */
+  unsigned long long access_units;
+  unsigned long long key_frames;
+  unsigned long long nomem;         /* NAL units lost, access unit could not grow */
+  unsigned long long invalid;       /* malformed packets */
+  unsigned long long extensions;    /* packets carrying an RTP header extension */
+  unsigned long long ts_mismatch;   /* FU fragments with another timestamp than their start */
+  unsigned long long nal_types[32]; /* complete NAL units by type */
+} RtpDepackStats;
+
+typedef struct RtpDepack RtpDepack;
+
+RtpDepack *RtpDepack_Create(NalPool *pool, RtpDepack_Emit emit, void *opaque);
+void RtpDepack_Destroy(RtpDepack *d);
+/* interleaved mode: NAL units go through a decoding order buffer */
+int RtpDepack_SetDon(RtpDepack *d, int interleavingDepth, int maxDonDiff, int maxBytes, int latencyMs);
+void RtpDepack_Packet(RtpDepack *d, const uint8_t *pkt, int len, unsigned int nowMs);
+void RtpDepack_Poll(RtpDepack *d, unsigned int nowMs);
+void RtpDepack_Flush(RtpDepack *d);
+/* from any thread, each field is loaded atomically on its own */
+void RtpDepack_GetStats(RtpDepack *d, RtpDepackStats *stats);
+/* zeroed when not interleaved */
+void RtpDepack_GetDonStats(RtpDepack *d, RtpDonStats *stats);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rtpdon.h"
+
+typedef struct RtpDonEntry {
+  unsigned short don;
+  unsigned int timestamp;
+  unsigned int arrival;   /* ms */
+  int len;
+  NalBuf *buf;            /* start code prefixed, from the pool */
+} RtpDonEntry;
+
+struct RtpDon {
+  int depth;              /* sprop-interleaving-depth */
+  int maxDonDiff;         /* sprop-max-don-diff */
+  int maxBytes;
+  int latency;            /* ms */
+  NalPool *pool;
+
+  RtpDonEntry *entries;   /* sorted by DON, earliest first */
+  int capacity;
+  int count;
+  int vcl;                /* VCL NAL units held */
+
+  int started;
+  unsigned short lastDon; /* DON of the last released NAL unit */
+
+  RtpDon_Release release;
+  void *opaque;
+
+  RtpDonStats stats;
+};
+
+/* single writer, relaxed atomic stores so GetStats from another thread never sees a torn value */
+#define STAT_SET(field, value) __atomic_store_n(&b->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, b->stats.field + (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_MAX(field, value) do { \
+    if((value) > b->stats.field) \
+      STAT_SET(field, value); \
+  } while(0)
+#define STAT_LOAD(field) (stats->field = __atomic_load_n(&b->stats.field, __ATOMIC_RELAXED))
+
+static const uint8_t startCode[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/* don_diff(m, n) of RFC 6184 section 5.5 */
+static inline int don_diff(unsigned short m, unsigned short n)
+{
+  return (short)(unsigned short)(n - m);
+}
+
+static inline int is_vcl(const uint8_t *nal)
+{
+  int type = nal[4] & 0x1f;
+  return type >= 1 && type <= 5;
+}
+
+RtpDon *RtpDon_Create(NalPool *pool, int interleavingDepth, int maxDonDiff, int maxBytes,
+                      int latencyMs, RtpDon_Release release, void *opaque)
+{
+  RtpDon *b = calloc(1, sizeof(RtpDon));
+  if(!b)
+    return NULL;
+
+  b->depth = interleavingDepth;
+  b->maxDonDiff = maxDonDiff > 0 ? maxDonDiff : 32767;
+  b->maxBytes = maxBytes;
+  b->latency = latencyMs;
+  b->pool = pool;
+  b->release = release;
+  b->opaque = opaque;
+
+  /* room for the interleaving depth plus the non-VCL units around it */
+  b->capacity = 2 * interleavingDepth + 16;
+  b->entries = calloc(b->capacity, sizeof(RtpDonEntry));
+  if(!b->entries) {
+    free(b);
+    return NULL;
+  }
+
+  return b;
+}
+
+void RtpDon_Destroy(RtpDon *b)
+{
+  if(!b)
+    return;
+
+  int i;
+  for(i = 0; i < b->count; i++)
+    NalBuf_Unref(b->entries[i].buf);
+  free(b->entries);
+  free(b);
+}
+
+/* Hand the earliest NAL unit to the decoder */
+static void release_first(RtpDon *b)
+{
+  RtpDonEntry e = b->entries[0];
+
+  b->count--;
+  memmove(&b->entries[0], &b->entries[1], b->count * sizeof(RtpDonEntry));
+  if(is_vcl(e.buf->data))
+    b->vcl--;
+  STAT_SET(bytes, b->stats.bytes - e.len);
+  STAT_SET(occupancy, b->count);
+  STAT_INC(released);
+
+  b->started = 1;
+  b->lastDon = e.don;
+
+  b->release(b->opaque, e.buf->data, e.len, e.timestamp);
+  NalBuf_Unref(e.buf);
+}
+
+void RtpDon_Push(RtpDon *b, unsigned short don, unsigned int timestamp,
+                 const uint8_t *nal, int len, unsigned int nowMs)
+{
+  if(len <= 0)
+    return;
+
+  if(b->started && don_diff(b->lastDon, don) <= 0) {
+    STAT_INC(late);
+    return;
+  }
+
+  /* stay within budget before taking the new unit */
+  while(b->count > 0 &&
+        (b->count == b->capacity || b->stats.bytes + len > b->maxBytes)) {
+    STAT_INC(forced);
+    release_first(b);
+  }
+
+  RtpDonEntry e;
+  e.don = don;
+  e.timestamp = timestamp;
+  e.arrival = nowMs;
+  e.len = len + 4;
+  e.buf = NalPool_Get(b->pool);
+  if(!e.buf)
+    return;
+  if(NalBuf_Append(e.buf, startCode, 4) < 0 || NalBuf_Append(e.buf, nal, len) < 0)  {
+    NalBuf_Unref(e.buf);
+    return;
+  }
+  NalBuf_Pad(e.buf);
+
+  /* insert keeping DON order, most arrivals land at the tail */
+  int i = b->count;
+  while(i > 0 && don_diff(b->entries[i - 1].don, don) < 0)
+    i--;
+  memmove(&b->entries[i + 1], &b->entries[i], (b->count - i) * sizeof(RtpDonEntry));
+  b->entries[i] = e;
+  b->count++;
+  if(is_vcl(e.buf->data))
+    b->vcl++;
+
+  STAT_ADD(bytes, e.len);
+  STAT_SET(occupancy, b->count);
+  STAT_MAX(peak, b->count);
+
+  /* more VCL units than the interleaving depth: the earliest is due */
+  while(b->vcl > b->depth)
+    release_first(b);
+
+  /* the DON span exceeds sprop-max-don-diff: the earliest can't wait */
+  while(b->count > 1 &&
+        don_diff(b->entries[0].don, b->entries[b->count - 1].don) > b->maxDonDiff)
+    release_first(b);
+
+  RtpDon_Poll(b, nowMs);
+}
+
+void RtpDon_Poll(RtpDon *b, unsigned int nowMs)
+{
+  int i;
+  for(;;) {
+    int expired = 0;
+    for(i = 0; i < b->count; i++) {
+      if((int)(nowMs - b->entries[i].arrival) >= b->latency) {
+        expired = 1;
+        break;
+      }
+    }
+    if(!expired)
+      break;
+
+    /* everything before an expired unit goes out with it */
+    while(i-- >= 0) {
+      STAT_INC(forced);
+      release_first(b);
+    }
+  }
+}
+
+void RtpDon_Flush(RtpDon *b)
+{
+  while(b->count > 0)
+    release_first(b);
+}
+
+void RtpDon_GetStats(RtpDon *b, RtpDonStats *stats)
+{
+  STAT_LOAD(occupancy);
+  STAT_LOAD(peak);
+  STAT_LOAD(bytes);
+  STAT_LOAD(released);
+  STAT_LOAD(forced);
+  STAT_LOAD(late);
+}
@@ -0,0 +1,60 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPDON_H
+#define RTPDON_H
+
+#include <stdint.h>
+
+#include "nalpool.h"
+
+/*
+ * Decoding order buffer for the interleaved packetization mode (RFC 6184
+ * packetization-mode=2). NAL units are held and released in DON order,
+ * following the receiver rules driven by sprop-interleaving-depth and
+ * sprop-max-don-diff, within a fixed entry/byte/latency budget.
+ */
+
+/* nal points at a start code prefixed, zero padded NAL unit */
+typedef void (*RtpDon_Release)(void *opaque, uint8_t *nal, int len, unsigned int timestamp);
+
+typedef struct RtpDonStats {
+  int occupancy;                  /* NAL units held right now */
+  int peak;                       /* highest occupancy seen */
+  int bytes;                      /* bytes held right now */
+  unsigned long long released;
+  unsigned long long forced;      /* released early to stay within budget */
+  unsigned long long late;        /* dropped, DON already passed */
+} RtpDonStats;
+
+typedef struct RtpDon RtpDon;
+
+/* held NAL units are copied into buffers from pool */
+RtpDon *RtpDon_Create(NalPool *pool, int interleavingDepth, int maxDonDiff, int maxBytes,
+                      int latencyMs, RtpDon_Release release, void *opaque);
+void RtpDon_Destroy(RtpDon *b);
+void RtpDon_Push(RtpDon *b, unsigned short don, unsigned int timestamp,
+                 const uint8_t *nal, int len, unsigned int nowMs);
+void RtpDon_Poll(RtpDon *b, unsigned int nowMs);
+void RtpDon_Flush(RtpDon *b);
+/* from any thread, each field is loaded atomically on its own */
+void RtpDon_GetStats(RtpDon *b, RtpDonStats *stats);
+
+#endif
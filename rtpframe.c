@@ -0,0 +1,355 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "rtpframe.h"
+#include "yuvconv.h"
+
+#define FRAME_EDGE 16   /* EDGE_WIDTH, the border the decoder draws around references */
+#define FRAME_ALIGN 32
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/*
+ * The frame header sits at the start of the pooled buffer, planes follow.
+ * priv keeps the buffer so the refcount is the pool's own.
+ */
+static RtpH264Frame *frame_new(NalPool *pool, int size)
+{
+  NalBuf *buf = NalPool_Get(pool);
+  if(!buf)
+    return NULL;
+
+  if(NalBuf_Reserve(buf, sizeof(RtpH264Frame) + FRAME_ALIGN + size) < 0)  {
+    NalBuf_Unref(buf);
+    return NULL;
+  }
+
+  RtpH264Frame *frame = (RtpH264Frame *)buf->data;
+  memset(frame, 0, sizeof(RtpH264Frame));
+  frame->priv = buf;
+  return frame;
+}
+
+/* First byte available for planes, aligned */
+static uint8_t *frame_base(RtpH264Frame *frame)
+{
+  uintptr_t p = (uintptr_t)(frame + 1);
+  return (uint8_t *)ALIGN(p, FRAME_ALIGN);
+}
+
+void RtpH264Frame_Ref(RtpH264Frame *frame)
+{
+  NalBuf_Ref(frame->priv);
+}
+
+void RtpH264Frame_Unref(RtpH264Frame *frame)
+{
+  if(frame)
+    NalBuf_Unref(frame->priv);
+}
+
+static int get_buffer(AVCodecContext *c, AVFrame *pic)
+{
+  RtpFrameAlloc *alloc = c->opaque;
+
+  /* planar 4:2:0 only, anything else is copied out by RtpFrame_Get() */
+  if(c->pix_fmt != PIX_FMT_YUV420P && c->pix_fmt != PIX_FMT_YUVJ420P)  {
+    pic->opaque = NULL;
+    return avcodec_default_get_buffer(c, pic);
+  }
+
+  int w = c->width, h = c->height;
+  avcodec_align_dimensions(c, &w, &h);
+  int edge = (c->flags & CODEC_FLAG_EMU_EDGE) ? 0 : FRAME_EDGE;
+
+  int i, size = 0;
+  int linesize[3], offset[3];
+  for(i = 0; i < 3; i++)  {
+    int shift = i ? 1 : 0;
+    int e = edge >> shift;
+    linesize[i] = ALIGN((w >> shift) + 2 * e, FRAME_ALIGN);
+    offset[i] = size + ALIGN(linesize[i] * e + e, FRAME_ALIGN);
+    size += ALIGN(linesize[i] * ((h >> shift) + 2 * e + 1), FRAME_ALIGN);
+  }
+
+  RtpH264Frame *frame = frame_new(alloc->pool, size);
+  if(!frame)
+    return -1;
+
+  uint8_t *base = frame_base(frame);
+  for(i = 0; i < 3; i++)  {
+    pic->base[i] = base;
+    pic->data[i] = base + offset[i];
+    pic->linesize[i] = linesize[i];
+    frame->data[i] = pic->data[i];
+    frame->linesize[i] = linesize[i];
+  }
+  pic->base[3] = NULL;
+  pic->data[3] = NULL;
+  pic->linesize[3] = 0;
+
+  frame->width = c->width;
+  frame->height = c->height;
+  frame->format = c->pix_fmt;
+
+  pic->type = FF_BUFFER_TYPE_USER;
+  pic->age = INT_MAX;   /* never assume the old content is still there */
+  pic->opaque = frame;
+  pic->reordered_opaque = c->reordered_opaque;
+  return 0;
+}
+
+static void release_buffer(AVCodecContext *c, AVFrame *pic)
+{
+  if(pic->type != FF_BUFFER_TYPE_USER)  {
+    avcodec_default_release_buffer(c, pic);
+    return;
+  }
+
+  RtpH264Frame_Unref(pic->opaque);
+  memset(pic->data, 0, sizeof(pic->data));
+  pic->opaque = NULL;
+}
+
+void RtpFrame_Attach(AVCodecContext *c, RtpFrameAlloc *alloc)
+{
+  memset(alloc->info, 0, sizeof(alloc->info));
+  c->opaque = alloc;
+  c->get_buffer = get_buffer;
+  c->release_buffer = release_buffer;
+}
+
+void RtpFrame_Stamp(AVCodecContext *c, int64_t pts, unsigned int timestamp, unsigned int receiveMs)
+{
+  RtpFrameAlloc *alloc = c->opaque;
+  RtpFrameInfo *info = &alloc->info[pts % RTPFRAME_INFO];
+
+  info->pts = pts;
+  info->timestamp = timestamp;
+  info->receiveMs = receiveMs;
+  c->reordered_opaque = pts;
+}
+
+const RtpFrameInfo *RtpFrame_Info(AVCodecContext *c, const AVFrame *picture)
+{
+  RtpFrameAlloc *alloc = c->opaque;
+  int64_t pts = picture->reordered_opaque;
+
+  if(pts <= 0)
+    return NULL;
+  /* a slot taken over by a later unit means this one is too old to tell */
+  RtpFrameInfo *info = &alloc->info[pts % RTPFRAME_INFO];
+  return info->pts == pts ? info : NULL;
+}
+
+/* Pictures the decoder allocated itself are copied into a pooled frame */
+static RtpH264Frame *frame_copy(AVCodecContext *c, const AVFrame *picture)
+{
+  RtpFrameAlloc *alloc = c->opaque;
+  int hshift = 0, vshift = 0;
+  int i, size = 0, planes = 1;
+
+  if(c->pix_fmt != PIX_FMT_GRAY8)  {
+    avcodec_get_chroma_sub_sample(c->pix_fmt, &hshift, &vshift);
+    planes = 3;
+  }
+
+  int width[3], height[3], linesize[3];
+  for(i = 0; i < planes; i++)  {
+    width[i] = i ? -((-c->width) >> hshift) : c->width;
+    height[i] = i ? -((-c->height) >> vshift) : c->height;
+    linesize[i] = ALIGN(width[i], FRAME_ALIGN);
+    size += linesize[i] * height[i];
+  }
+
+  RtpH264Frame *frame = frame_new(alloc->pool, size);
+  if(!frame)
+    return NULL;
+
+  uint8_t *p = frame_base(frame);
+  for(i = 0; i < planes; i++)  {
+    int y;
+    frame->data[i] = p;
+    frame->linesize[i] = linesize[i];
+    for(y = 0; y < height[i]; y++)
+      memcpy(p + y * linesize[i], picture->data[i] + y * picture->linesize[i], width[i]);
+    p += linesize[i] * height[i];
+  }
+
+  frame->width = c->width;
+  frame->height = c->height;
+  frame->format = c->pix_fmt;
+  return frame;
+}
+
+static void copy_props(RtpH264Frame *dst, const RtpH264Frame *src)
+{
+  dst->timestamp = src->timestamp;
+  dst->receiveMs = src->receiveMs;
+  dst->pts = src->pts;
+  dst->pictType = src->pictType;
+  dst->keyFrame = src->keyFrame;
+}
+
+/* Pooled 4:2:0 frame, even dimensions */
+static RtpH264Frame *frame_yuv420(NalPool *pool, int width, int height)
+{
+  int linesize[3], size = 0, i;
+  for(i = 0; i < 3; i++)  {
+    linesize[i] = ALIGN(i ? width / 2 : width, FRAME_ALIGN);
+    size += linesize[i] * (i ? height / 2 : height);
+  }
+
+  RtpH264Frame *frame = frame_new(pool, size);
+  if(!frame)
+    return NULL;
+
+  uint8_t *p = frame_base(frame);
+  for(i = 0; i < 3; i++)  {
+    frame->data[i] = p;
+    frame->linesize[i] = linesize[i];
+    p += linesize[i] * (i ? height / 2 : height);
+  }
+  frame->width = width;
+  frame->height = height;
+  frame->format = PIX_FMT_YUV420P;
+  return frame;
+}
+
+static RtpH264Frame *downscale(NalPool *pool, RtpH264Frame *src, int scale)
+{
+  /* whole chroma samples only, odd edges are dropped */
+  int width = src->width / scale & ~1;
+  int height = src->height / scale & ~1;
+  if(width == 0 || height == 0)
+    return NULL;
+
+  RtpH264Frame *frame = frame_yuv420(pool, width, height);
+  if(!frame)
+    return NULL;
+
+  int i;
+  for(i = 0; i < 3; i++)
+    YuvConv_Downscale(src->data[i], src->linesize[i], frame->data[i], frame->linesize[i],
+                      i ? width / 2 : width, i ? height / 2 : height, scale);
+  copy_props(frame, src);
+  return frame;
+}
+
+static RtpH264Frame *convert(NalPool *pool, RtpH264Frame *src, int format)
+{
+  int width = src->width, height = src->height;
+  int linesize[2], heights[2], planes = 1, size = 0, i;
+
+  switch(format)  {
+    case PIX_FMT_NV12:
+      linesize[0] = ALIGN(width, FRAME_ALIGN);
+      linesize[1] = ALIGN((width + 1) & ~1, FRAME_ALIGN);
+      heights[0] = height;
+      heights[1] = (height + 1) / 2;
+      planes = 2;
+      break;
+    case PIX_FMT_RGB24:
+      linesize[0] = ALIGN(width * 3, FRAME_ALIGN);
+      heights[0] = height;
+      break;
+    case PIX_FMT_BGRA:
+      linesize[0] = ALIGN(width * 4, FRAME_ALIGN);
+      heights[0] = height;
+      break;
+    default:
+      return NULL;
+  }
+  for(i = 0; i < planes; i++)
+    size += linesize[i] * heights[i];
+
+  RtpH264Frame *frame = frame_new(pool, size);
+  if(!frame)
+    return NULL;
+
+  uint8_t *p = frame_base(frame);
+  for(i = 0; i < planes; i++)  {
+    frame->data[i] = p;
+    frame->linesize[i] = linesize[i];
+    p += linesize[i] * heights[i];
+  }
+  frame->width = width;
+  frame->height = height;
+  frame->format = format;
+  copy_props(frame, src);
+
+  if(format == PIX_FMT_NV12)
+    YuvConv_ToNV12(src->data, src->linesize, frame->data, frame->linesize, width, height);
+  else if(format == PIX_FMT_RGB24)
+    YuvConv_ToRGB24(src->data, src->linesize, frame->data[0], frame->linesize[0], width, height);
+  else
+    YuvConv_ToBGRA(src->data, src->linesize, frame->data[0], frame->linesize[0], width, height);
+  return frame;
+}
+
+RtpH264Frame *RtpFrame_Convert(NalPool *pool, RtpH264Frame *frame, int format, int scale)
+{
+  RtpH264Frame_Ref(frame);
+
+  if(frame->format != PIX_FMT_YUV420P && frame->format != PIX_FMT_YUVJ420P)
+    return frame;
+
+  if(scale == 2 || scale == 4)  {
+    RtpH264Frame *scaled = downscale(pool, frame, scale);
+    RtpH264Frame_Unref(frame);
+    frame = scaled;
+    if(!frame)
+      return NULL;
+  }
+
+  if(format == PIX_FMT_NV12 || format == PIX_FMT_RGB24 || format == PIX_FMT_BGRA)  {
+    RtpH264Frame *converted = convert(pool, frame, format);
+    RtpH264Frame_Unref(frame);
+    frame = converted;
+  }
+
+  return frame;
+}
+
+RtpH264Frame *RtpFrame_Get(AVCodecContext *c, const AVFrame *picture)
+{
+  RtpH264Frame *frame = picture->opaque;
+
+  if(frame)
+    RtpH264Frame_Ref(frame);
+  else
+    frame = frame_copy(c, picture);
+
+  if(frame)  {
+    const RtpFrameInfo *info = RtpFrame_Info(c, picture);
+    if(info)  {
+      frame->timestamp = info->timestamp;
+      frame->receiveMs = info->receiveMs;
+      frame->pts = info->pts;
+    }
+    frame->pictType = picture->pict_type;
+    frame->keyFrame = picture->key_frame;
+  }
+  return frame;
+}
@@ -0,0 +1,69 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPFRAME_H
+#define RTPFRAME_H
+
+#include "rtph264.h"
+#include "nalpool.h"
+
+/*
+ * Decoder picture buffers that outlive the decoder's use of them. The
+ * decoder allocates its pictures from a NalPool through get_buffer(), so
+ * a decoded picture can be handed out as a refcounted RtpH264Frame and
+ * returns to the pool once both the decoder and every holder let go.
+ */
+
+/*
+ * What an access unit stamps on the pictures decoded from it. Its pts
+ * travels through the decoder as reordered_opaque, so it follows the
+ * picture across output delay and frame threads; the rest is looked up
+ * again on the decoding thread once the picture comes out.
+ */
+typedef struct RtpFrameInfo {
+  int64_t pts;
+  unsigned int timestamp;
+  unsigned int receiveMs;
+} RtpFrameInfo;
+
+#define RTPFRAME_INFO 64  /* units in flight: frame threads plus reorder delay */
+
+typedef struct RtpFrameAlloc {
+  NalPool *pool;
+  RtpFrameInfo info[RTPFRAME_INFO];  /* by pts, decoding thread only */
+} RtpFrameAlloc;
+
+/* call before avcodec_open(), alloc must live as long as the context */
+void RtpFrame_Attach(AVCodecContext *c, RtpFrameAlloc *alloc);
+/* before decoding an access unit, from the thread that decodes */
+void RtpFrame_Stamp(AVCodecContext *c, int64_t pts, unsigned int timestamp, unsigned int receiveMs);
+/* the access unit a decoded picture came from, NULL once forgotten */
+const RtpFrameInfo *RtpFrame_Info(AVCodecContext *c, const AVFrame *picture);
+/* a new reference to the frame behind a decoded picture */
+RtpH264Frame *RtpFrame_Get(AVCodecContext *c, const AVFrame *picture);
+/*
+ * Downscale a 4:2:0 frame by scale (1, 2 or 4) and convert it to format
+ * (PIX_FMT_YUV420P, PIX_FMT_NV12, PIX_FMT_RGB24 or PIX_FMT_BGRA), into a
+ * new pooled frame. Returns a new reference to frame when there is
+ * nothing to do, NULL when out of memory.
+ */
+RtpH264Frame *RtpFrame_Convert(NalPool *pool, RtpH264Frame *frame, int format, int scale);
+
+#endif
@@ -0,0 +1,534 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+
+/*
+ * Loopback load generator: sends N paced RTP H.264 streams made from an
+ * Annex B file, e.g.
+ *
+ *   rtpgen -n 16 -p 8000 -l 1 -x stream.h264
+ *
+ * Stream i goes to port + 2 * i from source port + 2 * i, and answers
+ * generic NACKs arriving on the source port + 1 from a history of the
+ * packets it sent, so RTCP and NACK handling can be measured locally.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "rtppack.h"
+
+#define HISTORY 1024          /* packets kept for retransmission, power of two */
+#define NTP_OFFSET 2208988800ULL  /* 1900 to 1970 */
+
+typedef struct AccessUnit {
+  const uint8_t *data;
+  int size;
+} AccessUnit;
+
+typedef struct Options {
+  const char *input;
+  in_addr_t addr;
+  int port;
+  int sourcePort;
+  int streams;
+  int fps;
+  int mtu;
+  int seconds;            /* 0 runs until interrupted */
+  double loss;            /* percent of packets dropped */
+  double reorder;         /* percent of packets swapped with the next */
+  int jitterMs;           /* access units delayed by up to this */
+  int retransmit;
+} Options;
+
+typedef struct Stream {
+  int index;
+  const Options *opt;
+  int fd;
+  int rtcpFd;
+  struct sockaddr_in dest;
+  struct sockaddr_in rtcpDest;
+  unsigned int seed;
+  uint32_t ssrc;
+  RtpPack *pack;
+
+  /* packet swapped with the next one */
+  uint8_t held[RTPPACK_MAX_MTU];
+  int heldLen;
+
+  /* sent packets by sequence number, only when retransmitting */
+  uint8_t (*history)[RTPPACK_MAX_MTU];
+  int historyLen[HISTORY];
+  unsigned short historySeq[HISTORY];
+
+  unsigned int timestamp;
+  unsigned long long frames;
+  unsigned long long sent;
+  unsigned long long dropped;
+  unsigned long long reordered;
+  unsigned long long nacks;
+  unsigned long long retransmitted;
+  unsigned long long octets;
+
+  pthread_t thread;
+} Stream;
+
+static AccessUnit *units;
+static int unitCount;
+static volatile int bStop = 0;
+
+static void sig_handler(int s)
+{
+  if(s == SIGINT)
+    bStop = 1;
+}
+
+static unsigned long long now_us(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double chance(Stream *st)
+{
+  return rand_r(&st->seed) * 100.0 / ((double)RAND_MAX + 1);
+}
+
+/* Split an Annex B stream into access units, a new one starts at an AUD,
+ * SPS, PPS or SEI after a slice, or at a slice with first_mb_in_slice 0 */
+static int split_units(const uint8_t *data, int size)
+{
+  int pos = 0, start = 0, vcl = 0;
+  int capacity = 1024;
+
+  units = malloc(capacity * sizeof(AccessUnit));
+  if(!units)
+    return -1;
+
+  for(;;)  {
+    int before = pos;
+    const uint8_t *nal;
+    int len = RtpPack_NextNal(data, size, &pos, &nal);
+    if(len <= 0)
+      break;
+
+    int type = nal[0] & 0x1f;
+    int slice = type >= 1 && type <= 5;
+    int boundary = vcl && ((type >= 6 && type <= 9) || (slice && len > 1 && (nal[1] & 0x80)));
+
+    if(boundary)  {
+      /* the unit ends where this NAL unit's start code begins */
+      int end = nal - data - 3;
+      while(end > before && data[end - 1] == 0)
+        end--;
+      if(unitCount == capacity)  {
+        capacity *= 2;
+        AccessUnit *u = realloc(units, capacity * sizeof(AccessUnit));
+        if(!u)
+          return -1;
+        units = u;
+      }
+      units[unitCount].data = data + start;
+      units[unitCount].size = end - start;
+      unitCount++;
+      start = end;
+      vcl = 0;
+    }
+    if(slice)
+      vcl = 1;
+  }
+
+  if(vcl)  {
+    if(unitCount == capacity)  {
+      AccessUnit *u = realloc(units, (capacity + 1) * sizeof(AccessUnit));
+      if(!u)
+        return -1;
+      units = u;
+    }
+    units[unitCount].data = data + start;
+    units[unitCount].size = size - start;
+    unitCount++;
+  }
+  return unitCount;
+}
+
+static void transmit(Stream *st, const uint8_t *pkt, int len)
+{
+  if(sendto(st->fd, pkt, len, 0, (struct sockaddr *)&st->dest, sizeof(st->dest)) == len)  {
+    st->sent++;
+    st->octets += len - 12;
+  }
+}
+
+/* RtpPack output: keep for retransmission, then impair */
+static void on_packet(void *opaque, const uint8_t *pkt, int len)
+{
+  Stream *st = opaque;
+  unsigned short seq = (pkt[2] << 8) | pkt[3];
+  int slot = seq & (HISTORY - 1);
+
+  if(st->history)  {
+    memcpy(st->history[slot], pkt, len);
+    st->historyLen[slot] = len;
+    st->historySeq[slot] = seq;
+  }
+
+  if(st->opt->loss > 0 && chance(st) < st->opt->loss)  {
+    st->dropped++;
+    return;
+  }
+
+  if(st->heldLen)  {
+    transmit(st, pkt, len);
+    transmit(st, st->held, st->heldLen);
+    st->heldLen = 0;
+    return;
+  }
+
+  if(st->opt->reorder > 0 && chance(st) < st->opt->reorder)  {
+    memcpy(st->held, pkt, len);
+    st->heldLen = len;
+    st->reordered++;
+    return;
+  }
+
+  transmit(st, pkt, len);
+}
+
+static void send_sr(Stream *st)
+{
+  uint8_t sr[28];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  uint32_t sec = ts.tv_sec + NTP_OFFSET;
+  uint32_t frac = (uint32_t)(((unsigned long long)ts.tv_nsec << 32) / 1000000000);
+  uint32_t words[6] = { st->ssrc, sec, frac, st->timestamp, st->sent, st->octets };
+  int i;
+
+  sr[0] = 0x80;
+  sr[1] = 200;
+  sr[2] = 0;
+  sr[3] = 6;
+  for(i = 0; i < 6; i++)  {
+    uint32_t w = htonl(words[i]);
+    memcpy(sr + 4 + i * 4, &w, 4);
+  }
+  sendto(st->rtcpFd, sr, sizeof(sr), 0, (struct sockaddr *)&st->rtcpDest, sizeof(st->rtcpDest));
+}
+
+static void resend(Stream *st, unsigned short seq)
+{
+  int slot = seq & (HISTORY - 1);
+  if(st->history && st->historyLen[slot] && st->historySeq[slot] == seq)  {
+    transmit(st, st->history[slot], st->historyLen[slot]);
+    st->retransmitted++;
+  }
+}
+
+/* answer generic NACKs in whatever arrived on the RTCP socket */
+static void handle_rtcp(Stream *st)
+{
+  uint8_t buf[1500];
+  int len;
+
+  while((len = recv(st->rtcpFd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)  {
+    int off = 0;
+    while(off + 4 <= len)  {
+      const uint8_t *p = buf + off;
+      int size = (((p[2] << 8) | p[3]) + 1) * 4;
+      if((p[0] >> 6) != 2 || off + size > len)
+        break;
+
+      if(p[1] == 205 && (p[0] & 0x1f) == 1 && st->history)  {
+        int i;
+        st->nacks++;
+        for(i = 12; i + 4 <= size; i += 4)  {
+          unsigned short pid = (p[i] << 8) | p[i + 1];
+          unsigned int blp = (p[i + 2] << 8) | p[i + 3];
+          int b;
+          resend(st, pid);
+          for(b = 0; b < 16; b++)
+            if(blp & (1 << b))
+              resend(st, pid + b + 1);
+        }
+      }
+      off += size;
+    }
+  }
+}
+
+/* sleep until the deadline, serving RTCP meanwhile */
+static void wait_until(Stream *st, unsigned long long deadline)
+{
+  for(;;)  {
+    unsigned long long now = now_us(CLOCK_MONOTONIC);
+    if(now >= deadline || bStop)
+      return;
+
+    struct pollfd pfd = { st->rtcpFd, POLLIN, 0 };
+    int ms = (deadline - now + 999) / 1000;
+    if(poll(&pfd, 1, ms) > 0)
+      handle_rtcp(st);
+  }
+}
+
+static void *stream_thread(void *arg)
+{
+  Stream *st = arg;
+  const Options *opt = st->opt;
+  unsigned long long interval = 1000000 / opt->fps;
+  /* spread the streams over one frame interval */
+  unsigned long long start = now_us(CLOCK_MONOTONIC) + interval * st->index / opt->streams;
+  unsigned long long end = opt->seconds ? start + opt->seconds * 1000000ULL : 0;
+  unsigned long long lastSr = 0;
+  unsigned long long n;
+
+  for(n = 0; !bStop; n++)  {
+    unsigned long long deadline = start + n * interval;
+    if(end && deadline >= end)
+      break;
+    if(opt->jitterMs > 0)
+      deadline += rand_r(&st->seed) % (opt->jitterMs * 1000 + 1);
+    wait_until(st, deadline);
+
+    const AccessUnit *u = &units[n % unitCount];
+    st->timestamp = n * 90000 / opt->fps;
+    RtpPack_AccessUnit(st->pack, u->data, u->size, st->timestamp);
+    st->frames++;
+
+    if(deadline - lastSr >= 1000000)  {
+      send_sr(st);
+      lastSr = deadline;
+    }
+  }
+
+  /* let late NACKs for the tail be answered */
+  wait_until(st, now_us(CLOCK_MONOTONIC) + 200000);
+  return NULL;
+}
+
+static int open_socket(in_addr_t addr, int port)
+{
+  struct sockaddr_in a;
+  int fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if(fd < 0)
+    return -1;
+
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = addr;
+  a.sin_port = htons(port);
+  if(bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0)  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void Usage(void)
+{
+  fprintf(stderr, "Usage: rtpgen [options] stream.h264\n\n"
+      "Options:\n"
+      "-h | --help           Print usage information (this message)\n"
+      "-a | --address        Destination : default 127.0.0.1\n"
+      "-p | --port           Destination port of the first stream : default 8000\n"
+      "-s | --source-port    Source port of the first stream : default 9000\n"
+      "-n | --streams        Number of streams, each two ports up : default 1\n"
+      "-r | --rate           Frames per second : default 25\n"
+      "-m | --mtu            Largest RTP packet : default 1400\n"
+      "-t | --time           Seconds to run, 0 until interrupted : default 0\n"
+      "-l | --loss           Percent of packets dropped\n"
+      "-o | --reorder        Percent of packets swapped with the next\n"
+      "-j | --jitter         Delay frames by up to this many ms\n"
+      "-x | --retransmit     Answer generic NACKs\n\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char shortOptions[] = "ha:p:s:n:r:m:t:l:o:j:x";
+  const struct option longOptions[] = {
+    {"help",        no_argument,       NULL, 'h' },
+    {"address",     required_argument, NULL, 'a' },
+    {"port",        required_argument, NULL, 'p' },
+    {"source-port", required_argument, NULL, 's' },
+    {"streams",     required_argument, NULL, 'n' },
+    {"rate",        required_argument, NULL, 'r' },
+    {"mtu",         required_argument, NULL, 'm' },
+    {"time",        required_argument, NULL, 't' },
+    {"loss",        required_argument, NULL, 'l' },
+    {"reorder",     required_argument, NULL, 'o' },
+    {"jitter",      required_argument, NULL, 'j' },
+    {"retransmit",  no_argument,       NULL, 'x' },
+    {0, 0, 0, 0}
+  };
+
+  Options opt = { NULL, inet_addr("127.0.0.1"), 8000, 9000, 1, 25, 1400, 0, 0, 0, 0, 0 };
+  int c, i;
+
+  while((c = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1)  {
+    switch(c)  {
+      case 'a': opt.addr = inet_addr(optarg); break;
+      case 'p': opt.port = atoi(optarg); break;
+      case 's': opt.sourcePort = atoi(optarg); break;
+      case 'n': opt.streams = atoi(optarg); break;
+      case 'r': opt.fps = atoi(optarg); break;
+      case 'm': opt.mtu = atoi(optarg); break;
+      case 't': opt.seconds = atoi(optarg); break;
+      case 'l': opt.loss = atof(optarg); break;
+      case 'o': opt.reorder = atof(optarg); break;
+      case 'j': opt.jitterMs = atoi(optarg); break;
+      case 'x': opt.retransmit = 1; break;
+      default:
+        Usage();
+        return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if(optind != argc - 1 || opt.streams < 1 || opt.fps < 1)  {
+    Usage();
+    return EXIT_FAILURE;
+  }
+  opt.input = argv[optind];
+
+  FILE *f = fopen(opt.input, "rb");
+  if(!f)  {
+    perror(opt.input);
+    return EXIT_FAILURE;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  uint8_t *data = malloc(size > 0 ? size : 1);
+  if(!data || fread(data, 1, size, f) != (size_t)size)  {
+    fprintf(stderr, "could not read %s\n", opt.input);
+    return EXIT_FAILURE;
+  }
+  fclose(f);
+
+  if(split_units(data, size) <= 0)  {
+    fprintf(stderr, "no access units in %s\n", opt.input);
+    return EXIT_FAILURE;
+  }
+
+  Stream *streams = calloc(opt.streams, sizeof(Stream));
+  if(!streams)  {
+    fprintf(stderr, "could not allocate %d streams\n", opt.streams);
+    return EXIT_FAILURE;
+  }
+
+  for(i = 0; i < opt.streams; i++)
+    streams[i].fd = streams[i].rtcpFd = -1;
+
+  signal(SIGINT, sig_handler);
+
+  int running = 0;
+  for(i = 0; i < opt.streams; i++)  {
+    Stream *st = &streams[i];
+    st->index = i;
+    st->opt = &opt;
+    st->seed = time(NULL) ^ (i * 7919);
+    st->ssrc = ((uint32_t)rand_r(&st->seed) << 16) ^ rand_r(&st->seed);
+
+    st->dest.sin_family = AF_INET;
+    st->dest.sin_addr.s_addr = opt.addr;
+    st->dest.sin_port = htons(opt.port + 2 * i);
+    st->rtcpDest = st->dest;
+    st->rtcpDest.sin_port = htons(opt.port + 2 * i + 1);
+
+    /* the receiver sends its reports to the RTP source port + 1 */
+    st->fd = open_socket(INADDR_ANY, opt.sourcePort + 2 * i);
+    st->rtcpFd = open_socket(INADDR_ANY, opt.sourcePort + 2 * i + 1);
+    st->pack = RtpPack_Create(opt.mtu, 96, st->ssrc, rand_r(&st->seed), on_packet, st);
+    if(opt.retransmit)
+      st->history = malloc(HISTORY * sizeof(*st->history));
+    if(st->fd < 0 || st->rtcpFd < 0 || !st->pack || (opt.retransmit && !st->history))  {
+      fprintf(stderr, "could not set up stream %d, ports %d-%d\n", i,
+        opt.sourcePort + 2 * i, opt.sourcePort + 2 * i + 1);
+      break;
+    }
+    if(pthread_create(&st->thread, NULL, stream_thread, st) != 0)  {
+      fprintf(stderr, "could not start stream %d\n", i);
+      break;
+    }
+    running++;
+  }
+  if(running < opt.streams)
+    bStop = 1;
+
+  printf("%d streams of %d access units from %s at %d fps\n", running, unitCount, opt.input, opt.fps);
+
+  unsigned long long begin = now_us(CLOCK_MONOTONIC);
+  Stream total;
+  memset(&total, 0, sizeof(total));
+  RtpPackStats packed = { 0 };
+
+  for(i = 0; i < running; i++)  {
+    Stream *st = &streams[i];
+    pthread_join(st->thread, NULL);
+
+    RtpPackStats ps;
+    RtpPack_GetStats(st->pack, &ps);
+    packed.single += ps.single;
+    packed.stap += ps.stap;
+    packed.fu += ps.fu;
+    total.frames += st->frames;
+    total.sent += st->sent;
+    total.octets += st->octets;
+    total.dropped += st->dropped;
+    total.reordered += st->reordered;
+    total.nacks += st->nacks;
+    total.retransmitted += st->retransmitted;
+  }
+  double elapsed = (now_us(CLOCK_MONOTONIC) - begin) / 1e6;
+  if(elapsed <= 0)
+    elapsed = 1e-6;
+
+  printf("%llu frames, %llu packets sent (%.0f/s, %.1f Mbit/s)\n",
+    total.frames, total.sent, total.sent / elapsed, total.octets * 8 / elapsed / 1e6);
+  printf("%llu single NAL, %llu STAP-A, %llu FU-A packets\n", packed.single, packed.stap, packed.fu);
+  printf("%llu dropped, %llu reordered, %llu NACKs, %llu retransmitted\n",
+    total.dropped, total.reordered, total.nacks, total.retransmitted);
+
+  for(i = 0; i < opt.streams; i++)  {
+    if(streams[i].fd >= 0)
+      close(streams[i].fd);
+    if(streams[i].rtcpFd >= 0)
+      close(streams[i].rtcpFd);
+    RtpPack_Destroy(streams[i].pack);
+    free(streams[i].history);
+  }
+  free(streams);
+  free(units);
+  free(data);
+  return EXIT_SUCCESS;
+}
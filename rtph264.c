@@ -18,17 +18,37 @@
  * MA 02111-1307 USA
  *
 */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "rtpdataheader.h"
 #include "rtph264.h"
+#include "rtpreorder.h"
+#include "nalpool.h"
+#include "rtpdepack.h"
+#include "spscqueue.h"
 #include "mp4mux.h"
+#include "mp4seg.h"
+#include "gopring.h"
+#include "h264ps.h"
+#include "rtpframe.h"
+#include "rtcp.h"
+#include "rtpsource.h"
+#include "affinity.h"
+#include "rtpsocket.h"
 
 extern AVCodec aac_encoder;
 extern AVCodec aac_decoder;
@@ -36,13 +56,38 @@ extern AVCodec h264_decoder;
 extern AVCodec mpeg4_encoder;
 extern AVCodec mpeg4_decoder;
 
-static AVCodecContext *context = NULL;
-extern AVCodec aac_encoder;
+static pthread_once_t registerOnce = PTHREAD_ONCE_INIT;
 
-void RtpH264_Init()
+/*
+ * avcodec_open()/avcodec_close() are not thread safe on their own, and
+ * sessions and segment threads open codecs concurrently
+ */
+static int lock_manager(void **mutex, enum AVLockOp op)
+{
+  switch(op) {
+    case AV_LOCK_CREATE:
+      *mutex = malloc(sizeof(pthread_mutex_t));
+      if(!*mutex)
+        return 1;
+      return pthread_mutex_init(*mutex, NULL) != 0;
+    case AV_LOCK_OBTAIN:
+      return pthread_mutex_lock(*mutex) != 0;
+    case AV_LOCK_RELEASE:
+      return pthread_mutex_unlock(*mutex) != 0;
+    case AV_LOCK_DESTROY:
+      pthread_mutex_destroy(*mutex);
+      free(*mutex);
+      return 0;
+  }
+  return 1;
+}
+
+static void register_codecs()
 {
   /* must be called before using avcodec lib */
   avcodec_init();
+
+  av_lockmgr_register(lock_manager);
   
   /* register all the codecs */
 //  avcodec_register_all();
@@ -53,288 +98,1475 @@ void RtpH264_Init()
   avcodec_register(&mpeg4_encoder);  
   avcodec_register(&mpeg4_decoder);
 
-  AVCodec *codec = avcodec_find_decoder(CODEC_ID_H264);
-  
-  context = avcodec_alloc_context();
-  
-  /* open it */
-  if(avcodec_open(context, codec) < 0) {
-    fprintf(stderr, "could not open codec\n");
-    exit(EXIT_FAILURE);
-  }
-  
   Mp4mux_Init();
-  Mp4mux_Open("/tmp/scv.mp4");
 }
 
-void RtpH264_Deinit()
+static unsigned int now_ms()
 {
-  Mp4mux_Close();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  avcodec_close(context);
-  av_free(context);
+/* CPU time of the calling thread, what a decode really costs */
+static unsigned long long cpu_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
 
-static int bStop = 0;
+/* Datagrams pulled per recvmmsg() call and the size of each ring slot */
+#define RTP_BATCH 64
+#define RTP_SLOT_SIZE 2048
 
-void RtpH264_Stop()
+#define DON_MAX_BYTES (8 * 1024 * 1024)
+#define DON_LATENCY 500 /* ms */
+
+/* Access unit buffers start here and grow to fit, beyond NAL_MAX_FREE idle ones are freed */
+#define NAL_INITIAL_SIZE (64 * 1024)
+#define NAL_MAX_FREE 512
+
+#define FRAME_MAX_FREE 16  /* decoded pictures kept for reuse */
+
+#define PARAMETER_SETS ((1 << 7) | (1 << 8))  /* SPS, PPS */
+
+struct RtpH264Session {
+  RtpH264Config config;
+
+  AVCodecContext *context;
+  AVFrame *picture;
+  Mp4seg *rec;
+
+  NalPool *pool;
+  RtpDepack *depack;
+  RtpReorder *reorder;
+  Rtcp *rtcp;               /* receive thread, NULL without an RTCP socket */
+  int rtcpFd;
+  unsigned int now;         /* arrival time of the current batch, ms */
+
+  /* receive thread: nothing is passed on before the first decodable IDR */
+  H264Ps *ps;
+  int decodable;
+
+  /* packet ring, filled by one recvmmsg() per batch */
+  uint8_t *ring;
+  struct mmsghdr msgs[RTP_BATCH];
+  struct iovec iovs[RTP_BATCH];
+  struct sockaddr_in names[RTP_BATCH];
+  char ctrl[RTP_BATCH][RTPSOCKET_CMSG_SPACE];  /* SO_TIMESTAMPNS, SO_RXQ_OVFL */
+
+  /* receive thread metrics */
+  int transit;              /* RFC 3550 A.8 */
+  unsigned int jitter;      /* scaled by 16 */
+  int jitterInit;
+  unsigned int rateStart;   /* bitrate window */
+  unsigned long long rateBytes;
+
+  int frame_count;
+  RtpH264_OnPicture onPicture;
+  RtpH264_OnFrame onFrame;
+  void *onFrameOpaque;
+  NalPool *framePool;       /* decoder pictures */
+  RtpFrameAlloc frameAlloc;
+
+  /* receive -> decoder thread hand-off, NULL decodes inline */
+  SpscQueue *queue;
+  sem_t queued;
+  pthread_t decoder;
+
+  /* decoder -> writer thread hand-off, NULL writes inline */
+  SpscQueue *writeQueue;
+  sem_t written;
+  pthread_t writer;
+  int writeBytes;           /* bytes queued, shared with the writer */
+  int writeSkipToIdr;       /* a reference frame was dropped */
+
+  /* pre-event ring, fed and dumped from the thread that records */
+  GopRing *preEvent;
+  pthread_mutex_t eventLock;
+  char eventFile[1024];
+  H264Ps *preEventPs;       /* parameter sets seen by the recording thread */
+  H264Ps *eventPs;          /* copy handed to the event muxer */
+  int eventPostMs;
+  int eventRequested;       /* set by RtpH264Session_Trigger() */
+  int eventActive;
+  int eventBusy;            /* event thread writing one out, it clears this */
+  char eventName[1024];     /* file of that event, eventFile may change meanwhile */
+  int eventPinned;          /* ring units pinned for it */
+  int eventThreadRunning;
+  unsigned int eventEnd;    /* RTP timestamp the live part stops at */
+  SpscQueue *eventQueue;
+  sem_t eventQueued;
+  pthread_t eventThread;
+
+  volatile int bStop;
+  RtpH264_Stats stats;      /* each field written by one thread only */
+  Histogram decodeHist;     /* decoder thread */
+  Histogram latencyHist;
+  pthread_t statsThread;
+  int statsRunning;
+  int decoderRunning;
+  int writerRunning;
+};
+
+/*
+ * Stats are read from other threads while they are updated. Every field
+ * has a single writer, so it reads its own fields plainly and stores
+ * atomically; readers load atomically and never see a torn value.
+ */
+#define STAT_SET(field, value) __atomic_store_n(&s->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, s->stats.field + (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_MAX(field, value) do { \
+    if((value) > s->stats.field) \
+      STAT_SET(field, value); \
+  } while(0)
+#define STAT_LOAD(field) (stats->field = __atomic_load_n(&s->stats.field, __ATOMIC_RELAXED))
+
+void RtpH264_DefaultConfig(RtpH264Config *cfg)
 {
-  bStop = 1;
+  memset(cfg, 0, sizeof(RtpH264Config));
+  cfg->filename = NULL;
+  cfg->reorderDepth = 32;
+  cfg->reorderLatency = 20;
+  cfg->interleaved = 0;
+  cfg->rtcpIntervalMs = 1000;
+  cfg->decodeThreadType = RTPH264_THREAD_FRAME | RTPH264_THREAD_SLICE;
+  cfg->numaNode = -1;
+  cfg->decodeThread = 1;
+  cfg->queueDepth = 64;
+  cfg->shedDepth = 32;
+  cfg->shedIdrDepth = 48;
+  cfg->fragment = MP4MUX_FRAGMENT_GOP;
+  cfg->writeThread = 1;
+  cfg->writeQueueDepth = 256;
+  cfg->writeQueueBytes = 32 * 1024 * 1024;
+  cfg->preEventMs = 0;
+  cfg->preEventBytes = 16 * 1024 * 1024;
 }
 
-void RtpH264_Run(int sfd, RtpH264_OnPicture onPicture)
+static void write_unit(RtpH264Session *s, NalBuf *u)
+{
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = u->data;
+  pkt.size = u->size;
+  pkt.flags = u->flags;
+  pkt.pts = u->pts;
+  Mp4seg_WriteVideo(s->rec, &pkt, u->timestamp);
+}
+
+/*
+ * Queue an access unit for the writer thread, taking ownership of it.
+ * Storage stalls must never reach the socket, so when the queue fills:
+ * past 3/4 non-reference frames are dropped, and once it is full a
+ * dropped reference frame drops everything up to the next IDR.
+ */
+static void record_unit(RtpH264Session *s, NalBuf *u)
+{
+  if(!s->rec)  {
+    NalBuf_Unref(u);
+    return;
+  }
+
+  if(!s->writeQueue)  {
+    write_unit(s, u);
+    NalBuf_Unref(u);
+    return;
+  }
+
+  if(s->writeSkipToIdr)  {
+    if(!(u->flags & PKT_FLAG_KEY))  {
+      STAT_INC(write_drops_ref);
+      NalBuf_Unref(u);
+      return;
+    }
+    s->writeSkipToIdr = 0;
+  }
+
+  int capacity = SpscQueue_Capacity(s->writeQueue);
+  int depth = SpscQueue_Count(s->writeQueue);
+  int bytes = __atomic_load_n(&s->writeBytes, __ATOMIC_RELAXED);
+  int maxBytes = s->config.writeQueueBytes;
+
+  if(!u->ref && (depth >= capacity * 3 / 4 || bytes >= maxBytes / 4 * 3))  {
+    STAT_INC(write_drops_nonref);
+    NalBuf_Unref(u);
+    return;
+  }
+
+  if(bytes + u->size > maxBytes || !SpscQueue_Push(s->writeQueue, u))  {
+    if(u->ref)  {
+      STAT_INC(write_drops_ref);
+      s->writeSkipToIdr = 1;
+    } else  {
+      STAT_INC(write_drops_nonref);
+    }
+    NalBuf_Unref(u);
+    return;
+  }
+
+  __atomic_add_fetch(&s->writeBytes, u->size, __ATOMIC_RELAXED);
+  STAT_MAX(write_high_water, depth + 1);
+  sem_post(&s->written);
+}
+
+/* Place the calling thread, a failure is reported and otherwise ignored */
+static void pin_thread(RtpH264Session *s, const char *cpus, const char *name)
 {
-#define INBUF_SIZE (1024 * 128)
-  uint8_t inbuf[INBUF_SIZE + FF_INPUT_BUFFER_PADDING_SIZE];
-  /* set end of buffer to 0 (this ensures that no overreading happens for damaged mpeg streams) */
-  memset(inbuf + INBUF_SIZE, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+  if(Affinity_PinCpus(cpus, s->config.numaNode) < 0)
+    fprintf(stderr, "could not pin the %s thread\n", name);
+  if(Affinity_PreferNode(s->config.numaNode) < 0)
+    fprintf(stderr, "could not prefer NUMA node %d for the %s thread\n", s->config.numaNode, name);
+}
+
+static void *write_thread(void *arg)
+{
+  RtpH264Session *s = arg;
+
+  pin_thread(s, s->config.writeCpus, "writer");
+
+  for(;;) {
+    while(sem_wait(&s->written) != 0 && errno == EINTR)
+      ;
+
+    /* a post with nothing queued is the stop request */
+    NalBuf *u = SpscQueue_Pop(s->writeQueue);
+    if(!u)
+      break;
+
+    write_unit(s, u);
+    __atomic_sub_fetch(&s->writeBytes, u->size, __ATOMIC_RELAXED);
+    NalBuf_Unref(u);
+  }
+
+  return NULL;
+}
+
+static void event_write(Mp4mux *mux, const uint8_t *data, int size, int flags,
+                        unsigned int timestamp, int64_t pts)
+{
+  AVPacket pkt;
+
+  if(!mux)
+    return;
+  av_init_packet(&pkt);
+  pkt.data = (uint8_t *)data;
+  pkt.size = size;
+  pkt.flags = flags;
+  pkt.pts = pts;
+  Mp4Mux_WriteVideo(mux, &pkt, timestamp);
+}
+
+/* The pinned ring straight from the slab, then the live units until the end post */
+static void event_dump(RtpH264Session *s)
+{
+  Mp4mux *mux = Mp4mux_Open(s->eventName, s->config.fragment);
+  if(mux)
+    Mp4mux_SetParameterSets(mux, s->eventPs);
+
+  int i;
+  for(i = 0; i < s->eventPinned; i++)  {
+    GopRingUnit g;
+    GopRing_GetPinned(s->preEvent, i, &g);
+    event_write(mux, g.data, g.size, g.flags, g.timestamp, g.pts);
+    GopRing_Release(s->preEvent);
+  }
+
+  for(;;) {
+    while(sem_wait(&s->eventQueued) != 0 && errno == EINTR)
+      ;
+
+    /* a post with nothing queued ends the event */
+    NalBuf *u = SpscQueue_Pop(s->eventQueue);
+    if(!u)
+      break;
+
+    event_write(mux, u->data, u->size, u->flags, u->timestamp, u->pts);
+    NalBuf_Unref(u);
+  }
+
+  if(mux)
+    Mp4mux_Close(mux);
+}
+
+/*
+ * Writes events out for the whole session, so neither starting one nor
+ * waiting for the last to reach the disk is left to the recording thread.
+ */
+static void *event_thread(void *arg)
+{
+  RtpH264Session *s = arg;
+  pin_thread(s, s->config.writeCpus, "event");
+
+  for(;;) {
+    while(sem_wait(&s->eventQueued) != 0 && errno == EINTR)
+      ;
+
+    /* a post while no event is busy is the stop request */
+    if(!__atomic_load_n(&s->eventBusy, __ATOMIC_ACQUIRE))
+      break;
+
+    event_dump(s);
+    __atomic_store_n(&s->eventBusy, 0, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+/* Queue a unit for the event thread, taking ownership of the reference */
+static void event_push(RtpH264Session *s, NalBuf *u)
+{
+  if(u && SpscQueue_Push(s->eventQueue, u))  {
+    sem_post(&s->eventQueued);
+  } else  {
+    NalBuf_Unref(u);
+    STAT_INC(event_drops);
+  }
+}
+
+/*
+ * Keep the pre-event ring and, after a trigger, hand the ring followed
+ * by the live stream to the event thread until the post-event time ends.
+ */
+static void pre_event(RtpH264Session *s, NalBuf *u)
+{
+  if(!s->preEvent)
+    return;
+
+  if(u->nalTypes & PARAMETER_SETS)
+    H264Ps_Update(s->preEventPs, u->data, u->size);
+
+  /* a trigger waits, without blocking, for the previous event to be written */
+  if(!s->eventActive && __atomic_load_n(&s->eventRequested, __ATOMIC_ACQUIRE) &&
+     !__atomic_load_n(&s->eventBusy, __ATOMIC_ACQUIRE))  {
+    pthread_mutex_lock(&s->eventLock);
+    s->eventEnd = u->timestamp + s->eventPostMs * 90;
+    memcpy(s->eventName, s->eventFile, sizeof(s->eventName));
+    pthread_mutex_unlock(&s->eventLock);
+    H264Ps_Copy(s->eventPs, s->preEventPs);
+
+    /* the ring goes to the event thread as it is, no copies */
+    s->eventPinned = GopRing_Pin(s->preEvent);
+    s->eventActive = 1;
+    STAT_INC(events);
+    __atomic_store_n(&s->eventBusy, 1, __ATOMIC_RELEASE);
+    sem_post(&s->eventQueued);
+  }
+
+  if(s->eventActive)  {
+    if((int)(u->timestamp - s->eventEnd) > 0)  {
+      s->eventActive = 0;
+      sem_post(&s->eventQueued);
+      __atomic_store_n(&s->eventRequested, 0, __ATOMIC_RELEASE);
+    } else  {
+      /* live units are shared with the recorder, not copied */
+      NalBuf_Ref(u);
+      event_push(s, u);
+    }
+  }
+
+  GopRing_Add(s->preEvent, u->data, u->size, u->flags, u->timestamp, u->pts);
+}
+
+int RtpH264Session_Trigger(RtpH264Session *s, const char *filename, int postMs)
+{
+  if(!s->preEvent)
+    return -1;
+
+  pthread_mutex_lock(&s->eventLock);
+  if(__atomic_load_n(&s->eventRequested, __ATOMIC_ACQUIRE))  {
+    /* one event at a time */
+    pthread_mutex_unlock(&s->eventLock);
+    return -1;
+  }
+  snprintf(s->eventFile, sizeof(s->eventFile), "%s", filename);
+  s->eventPostMs = postMs;
+  __atomic_store_n(&s->eventRequested, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&s->eventLock);
+
+  return 0;
+}
+
+/* Decode (unless passing through) and pass the unit on to the recorder */
+static void decode_unit(RtpH264Session *s, NalBuf *u)
+{
+  int got_picture;
+
+  u->pts = ++s->frame_count;
+
+  /* passthrough: nobody is looking at the pictures, or shed under load */
+  if(!s->context || (!s->onPicture && !s->onFrame) || u->skipDecode)
+    goto done;
+
+  if(s->config.decodeProfile == RTPH264_DECODE_KEYFRAMES && !(u->flags & PKT_FLAG_KEY))  {
+    STAT_INC(profile_skipped);
+    goto done;
+  }
+
+  unsigned long long start = cpu_us();
+
+  /* found again by pts on whichever picture this unit comes out as */
+  RtpFrame_Stamp(s->context, u->pts, u->timestamp, u->receiveMs);
 
-  AVFrame *picture = avcodec_alloc_frame();
   AVPacket avpkt;
   av_init_packet(&avpkt);
-  int frame_count = 0;
+  avpkt.data = u->data;
+  avpkt.size = u->size;
+  avpkt.flags = u->flags;
+  avpkt.pts = u->pts;
+
+  while(avpkt.size > 0) {
+    int len = avcodec_decode_video2(s->context, s->picture, &got_picture, &avpkt);
+
+    if(len < 0) {
+      STAT_INC(decode_errors);
+      break;
+    }
+
+    if(got_picture) {
+      /* the picture may belong to an earlier unit when output is delayed */
+      const RtpFrameInfo *info = RtpFrame_Info(s->context, s->picture);
+      Histogram_Add(&s->latencyHist, now_ms() - (info ? info->receiveMs : u->receiveMs));
+
+      /* the picture is allocated by the decoder. no need to
+             free it */
+      if(s->onPicture)
+        s->onPicture(s->picture->data[0], s->picture->linesize[0], s->context->width, s->context->height);
+
+      if(s->onFrame)  {
+        RtpH264Frame *frame = RtpFrame_Get(s->context, s->picture);
+        if(frame && (s->config.outputFormat != PIX_FMT_YUV420P || s->config.outputScale > 1))  {
+          RtpH264Frame *out = RtpFrame_Convert(s->framePool, frame, s->config.outputFormat, s->config.outputScale);
+          RtpH264Frame_Unref(frame);
+          frame = out;
+        }
+        if(frame)  {
+          s->onFrame(s->onFrameOpaque, frame);
+          RtpH264Frame_Unref(frame);
+        }
+      }
+    }
+
+    if(len == 0)
+      break;
+    avpkt.size -= len;
+    avpkt.data += len;
+  }
+
+  unsigned long long cost = cpu_us() - start;
+  Histogram_Add(&s->decodeHist, cost);
+  STAT_INC(decoded);
+  STAT_ADD(decode_us, cost);
+  STAT_MAX(decode_max_us, cost);
+
+done:
+  pre_event(s, u);
+  record_unit(s, u);
+}
+
+/*
+ * Keep the decoder from falling behind when the decode queue backs up:
+ * past shedDepth non-reference frames are not decoded, past shedIdrDepth
+ * only IDRs are. Full decoding comes back once the queue has drained to
+ * half of shedDepth, from the next IDR if reference frames were skipped.
+ * Shed frames still travel through the queue to the recorder.
+ */
+static void shed(RtpH264Session *s, NalBuf *u)
+{
+  int depth = SpscQueue_Count(s->queue);
+  int nonRef = s->config.shedDepth;
+  int idrOnly = s->config.shedIdrDepth;
+  int low = (nonRef > 0 ? nonRef : idrOnly) / 2;
+  int level = s->stats.shed_level;
+
+  if(idrOnly > 0 && depth >= idrOnly)
+    level = RTPH264_SHED_REF;
+  else if(level == RTPH264_SHED_NONE && nonRef > 0 && depth >= nonRef)
+    level = RTPH264_SHED_NONREF;
+  else if(depth <= low && level == RTPH264_SHED_NONREF)
+    level = RTPH264_SHED_NONE;
+  else if(depth <= low && level == RTPH264_SHED_REF)
+    level = RTPH264_SHED_RESYNC;
+
+  if(level == RTPH264_SHED_RESYNC && (u->flags & PKT_FLAG_KEY))
+    level = RTPH264_SHED_NONE;
+  STAT_SET(shed_level, level);
+
+  switch(level)  {
+    case RTPH264_SHED_NONREF:
+      if(!u->ref)  {
+        u->skipDecode = 1;
+        STAT_INC(shed_nonref);
+      }
+      break;
+    case RTPH264_SHED_REF:
+    case RTPH264_SHED_RESYNC:
+      if(!(u->flags & PKT_FLAG_KEY))  {
+        u->skipDecode = 1;
+        if(u->ref)
+          STAT_INC(shed_ref);
+        else
+          STAT_INC(shed_nonref);
+      }
+      break;
+  }
+}
+
+/*
+ * Hand a complete access unit to the decoder, through the queue if
+ * threaded. The buffer itself travels on to the muxer, it is never copied.
+ */
+static void deliver(void *opaque, NalBuf *u)
+{
+  RtpH264Session *s = opaque;
+
+  if((u->nalTypes & PARAMETER_SETS) && H264Ps_Update(s->ps, u->data, u->size))  {
+    int width, height;
+    H264Ps_GetSize(s->ps, &width, &height);
+    STAT_SET(width, width);
+    STAT_SET(height, height);
+  }
+
+  /* slices before the first IDR only cost decoder errors */
+  if(!s->decodable)  {
+    if(!(u->flags & PKT_FLAG_KEY) || !H264Ps_Ready(s->ps))  {
+      STAT_INC(gated);
+      NalBuf_Unref(u);
+      return;
+    }
+    s->decodable = 1;
+  }
+
+  if(!s->queue)  {
+    decode_unit(s, u);
+    return;
+  }
+
+  shed(s, u);
+
+  if(SpscQueue_Push(s->queue, u))  {
+    STAT_INC(queued);
+    STAT_MAX(queue_high_water, SpscQueue_Count(s->queue));
+    sem_post(&s->queued);
+  } else  {
+    /* decoder can't keep up, don't let it stall the socket */
+    NalBuf_Unref(u);
+    STAT_INC(queue_drops);
+  }
+}
+
+static void *decode_thread(void *arg)
+{
+  RtpH264Session *s = arg;
+
+  pin_thread(s, s->config.decodeCpus, "decoder");
+
+  for(;;) {
+    while(sem_wait(&s->queued) != 0 && errno == EINTR)
+      ;
+
+    /* a post with nothing queued is the stop request */
+    NalBuf *u = SpscQueue_Pop(s->queue);
+    if(!u)
+      break;
+
+    decode_unit(s, u);
+  }
+
+  return NULL;
+}
+
+static void on_packet(void *opaque, const uint8_t *pkt, int len)
+{
+  RtpH264Session *s = opaque;
+  RtpDepack_Packet(s->depack, pkt, len, s->now);
+}
+
+RtpH264Session *RtpH264Session_Create(const RtpH264Config *cfg)
+{
+  pthread_once(&registerOnce, register_codecs);
+
+  RtpH264Session *s = av_mallocz(sizeof(RtpH264Session));
+  if(!s)
+    return NULL;
+
+  s->config = *cfg;
+
+  /* access units grow in place, so the pool settles at the largest frames */
+  s->pool = NalPool_Create(NAL_INITIAL_SIZE, NAL_MAX_FREE);
+  s->ring = av_malloc(RTP_BATCH * RTP_SLOT_SIZE);
+  if(!s->pool || !s->ring)
+    goto fail;
+
+  s->depack = RtpDepack_Create(s->pool, deliver, s);
+  s->ps = H264Ps_Create();
+  if(!s->depack || !s->ps)
+    goto fail;
+
+  int i;
+  for(i = 0; i < RTP_BATCH; i++) {
+    s->iovs[i].iov_base = s->ring + i * RTP_SLOT_SIZE;
+    s->iovs[i].iov_len = RTP_SLOT_SIZE;
+    s->msgs[i].msg_hdr.msg_iov = &s->iovs[i];
+    s->msgs[i].msg_hdr.msg_iovlen = 1;
+    s->msgs[i].msg_hdr.msg_name = &s->names[i];
+  }
+
+  /* depth 0 hands packets straight to the depacketizer */
+  if(cfg->reorderDepth > 0)  {
+    s->reorder = RtpReorder_Create(cfg->reorderDepth, cfg->reorderLatency, RTP_SLOT_SIZE, on_packet, s);
+    if(!s->reorder)  {
+      fprintf(stderr, "could not allocate reorder buffer\n");
+      goto fail;
+    }
+  }
+
+  if(cfg->interleaved)  {
+    if(RtpDepack_SetDon(s->depack, cfg->interleavingDepth, cfg->maxDonDiff, DON_MAX_BYTES, DON_LATENCY) < 0)  {
+      fprintf(stderr, "could not allocate decoding order buffer\n");
+      goto fail;
+    }
+  }
+
+  if(cfg->decodeThread)  {
+    s->queue = SpscQueue_Create(cfg->queueDepth);
+    if(!s->queue)  {
+      fprintf(stderr, "could not allocate decode queue\n");
+      goto fail;
+    }
+    sem_init(&s->queued, 0, 0);
+  }
+
+  if(cfg->preEventMs > 0)  {
+    /* slab and descriptors are preallocated here, nothing grows later */
+    s->preEvent = GopRing_Create(cfg->preEventBytes, cfg->preEventMs);
+    s->eventQueue = SpscQueue_Create(cfg->preEventBytes / 1024);
+    s->preEventPs = H264Ps_Create();
+    s->eventPs = H264Ps_Create();
+    if(!s->preEvent || !s->eventQueue || !s->preEventPs || !s->eventPs)  {
+      fprintf(stderr, "could not allocate pre-event buffer\n");
+      goto fail;
+    }
+    pthread_mutex_init(&s->eventLock, NULL);
+    sem_init(&s->eventQueued, 0, 0);
+  }
+
+  if(cfg->filename && cfg->writeThread)  {
+    s->writeQueue = SpscQueue_Create(cfg->writeQueueDepth);
+    if(!s->writeQueue)  {
+      fprintf(stderr, "could not allocate write queue\n");
+      goto fail;
+    }
+    sem_init(&s->written, 0, 0);
+  }
+
+  /* record only sessions never touch the decoder */
+  if(!cfg->recordOnly)  {
+    s->picture = avcodec_alloc_frame();
+    s->context = avcodec_alloc_context();
+    s->framePool = NalPool_Create(0, FRAME_MAX_FREE);
+    if(!s->picture || !s->context || !s->framePool)
+      goto fail;
+
+    /* pictures come from the pool so frames can be held past the callback */
+    s->frameAlloc.pool = s->framePool;
+    RtpFrame_Attach(s->context, &s->frameAlloc);
+
+    switch(cfg->decodeProfile)  {
+      case RTPH264_DECODE_FAST:
+        /* reference frames stay exact, so errors don't spread */
+        s->context->skip_loop_filter = AVDISCARD_NONREF;
+        s->context->skip_idct = AVDISCARD_NONREF;
+        s->context->flags2 |= CODEC_FLAG2_FAST;
+        break;
+      case RTPH264_DECODE_KEYFRAMES:
+        s->context->skip_frame = AVDISCARD_NONKEY;
+        break;
+    }
+  }
+  s->stats.decode_profile = cfg->decodeProfile;
+
+  if(Affinity_Count(cfg->receiveCpus ? cfg->receiveCpus : "0") < 0 ||
+     Affinity_Count(cfg->decodeCpus ? cfg->decodeCpus : "0") < 0 ||
+     Affinity_Count(cfg->writeCpus ? cfg->writeCpus : "0") < 0)  {
+    fprintf(stderr, "malformed CPU list\n");
+    goto fail;
+  }
+
+  AVCodec *codec = avcodec_find_decoder(CODEC_ID_H264);
+
+  if(s->context)  {
+    /* libavcodec's workers inherit the placement of the thread that starts them */
+    const char *cpus = cfg->decodeThread ? cfg->decodeCpus : cfg->receiveCpus;
+    cpu_set_t saved;
+    int restore = (cpus || cfg->numaNode >= 0) && sched_getaffinity(0, sizeof(saved), &saved) == 0 &&
+                  Affinity_PinCpus(cpus, cfg->numaNode) == 0;
+
+    int ret = 0;
+    if(cfg->decodeThreads > 1)  {
+#ifdef FF_THREAD_FRAME
+      s->context->thread_count = cfg->decodeThreads;
+      s->context->thread_type = ((cfg->decodeThreadType & RTPH264_THREAD_FRAME) ? FF_THREAD_FRAME : 0) |
+                                ((cfg->decodeThreadType & RTPH264_THREAD_SLICE) ? FF_THREAD_SLICE : 0);
+#else
+      ret = avcodec_thread_init(s->context, cfg->decodeThreads);
+#endif
+    }
+
+    /* open it */
+    if(ret >= 0)
+      ret = avcodec_open(s->context, codec);
+
+    if(restore)
+      sched_setaffinity(0, sizeof(saved), &saved);
+
+    if(ret < 0) {
+      fprintf(stderr, "could not open codec\n");
+      av_freep(&s->context);
+      goto fail;
+    }
+  }
+
+  if(cfg->filename)  {
+    Mp4segConfig seg;
+    seg.filename = cfg->filename;
+    seg.fragment = cfg->fragment;
+    seg.segmentMs = cfg->segmentMs;
+    seg.segmentBytes = cfg->segmentBytes;
+    seg.keepSegments = cfg->keepSegments;
+    seg.keepBytes = cfg->keepBytes;
+    s->rec = Mp4seg_Open(&seg);
+    if(!s->rec)
+      goto fail;
+  }
+
+  return s;
+
+fail:
+  RtpH264Session_Destroy(s);
+  return NULL;
+}
+
+void RtpH264Session_Destroy(RtpH264Session *s)
+{
+  if(!s)
+    return;
+
+  if(s->rec)
+    Mp4seg_Close(s->rec);
+  if(s->context)
+    avcodec_close(s->context);
+
+  RtpReorder_Destroy(s->reorder);
+  Rtcp_Destroy(s->rtcp);
+  RtpDepack_Destroy(s->depack);
+  if(s->queue)  {
+    NalBuf *u;
+    while((u = SpscQueue_Pop(s->queue)))
+      NalBuf_Unref(u);
+    SpscQueue_Destroy(s->queue);
+    sem_destroy(&s->queued);
+  }
+  if(s->writeQueue)  {
+    NalBuf *u;
+    while((u = SpscQueue_Pop(s->writeQueue)))
+      NalBuf_Unref(u);
+    SpscQueue_Destroy(s->writeQueue);
+    sem_destroy(&s->written);
+  }
+  if(s->eventQueue)  {
+    SpscQueue_Destroy(s->eventQueue);
+    if(s->preEvent)  {
+      pthread_mutex_destroy(&s->eventLock);
+      sem_destroy(&s->eventQueued);
+    }
+  }
+  GopRing_Destroy(s->preEvent);
+  H264Ps_Destroy(s->preEventPs);
+  H264Ps_Destroy(s->eventPs);
+  H264Ps_Destroy(s->ps);
+
+  av_free(s->context);
+  av_free(s->picture);
+  av_free(s->ring);
+  /* last, every buffer above goes back to them */
+  NalPool_Destroy(s->framePool);
+  NalPool_Destroy(s->pool);
+  av_free(s);
+}
+
+void RtpH264Session_SetOnFrame(RtpH264Session *s, RtpH264_OnFrame onFrame, void *opaque)
+{
+  s->onFrame = onFrame;
+  s->onFrameOpaque = opaque;
+}
+
+int RtpH264Session_SetRtcp(RtpH264Session *s, int rtcpFd)
+{
+  /* holes are worth asking for only while the reorder buffer waits on them */
+  int deadline = s->config.nack && s->reorder ? s->config.reorderLatency : 0;
+
+  Rtcp_Destroy(s->rtcp);
+  s->rtcp = Rtcp_Create(rtcpFd, s->config.rtcpIntervalMs, deadline);
+  if(!s->rtcp)
+    return -1;
+  s->rtcpFd = rtcpFd;
+  return 0;
+}
+
+void RtpH264Session_Stop(RtpH264Session *s)
+{
+  s->bStop = 1;
+}
+
+void RtpH264Session_GetStats(RtpH264Session *s, RtpH264_Stats *stats)
+{
+  memset(stats, 0, sizeof(RtpH264_Stats));
+  STAT_LOAD(packets);
+  STAT_LOAD(bytes);
+  STAT_LOAD(recv_calls);
+  STAT_LOAD(truncated);
+  STAT_LOAD(rxq_drops);
+  STAT_LOAD(rcvbuf);
+  STAT_LOAD(jitter);
+  STAT_LOAD(bitrate);
+  STAT_LOAD(gated);
+  STAT_LOAD(width);
+  STAT_LOAD(height);
+  STAT_LOAD(queue_high_water);
+  STAT_LOAD(queued);
+  STAT_LOAD(queue_drops);
+  STAT_LOAD(shed_level);
+  STAT_LOAD(shed_nonref);
+  STAT_LOAD(shed_ref);
+  STAT_LOAD(decode_profile);
+  STAT_LOAD(decoded);
+  STAT_LOAD(decode_us);
+  STAT_LOAD(decode_max_us);
+  STAT_LOAD(profile_skipped);
+  STAT_LOAD(decode_errors);
+  STAT_LOAD(write_high_water);
+  STAT_LOAD(write_drops_nonref);
+  STAT_LOAD(write_drops_ref);
+  STAT_LOAD(events);
+  STAT_LOAD(event_drops);
+
+  if(s->queue)
+    stats->queue_depth = SpscQueue_Count(s->queue);
+  if(s->writeQueue)
+    stats->write_queue_depth = SpscQueue_Count(s->writeQueue);
+
+  if(s->reorder)  {
+    RtpReorderStats r;
+    RtpReorder_GetStats(s->reorder, &r);
+    stats->reordered = r.reordered;
+    stats->late = r.late;
+    stats->duplicate = r.duplicate;
+    stats->resyncs = r.resyncs;
+    stats->reorder_oversize = r.oversize;
+    stats->lost = r.lost;
+  }
+
+  RtpDepackStats p;
+  RtpDepack_GetStats(s->depack, &p);
+  stats->invalid = p.invalid;
+  stats->extensions = p.extensions;
+  stats->ts_mismatch = p.ts_mismatch;
+  memcpy(stats->nal_types, p.nal_types, sizeof(stats->nal_types));
+  stats->fu_dropped = p.fu_dropped;
+  stats->aggregated = p.aggregated;
+  stats->access_units = p.access_units;
+  stats->key_frames = p.key_frames;
+  stats->nal_nomem = p.nomem;
+
+  if(s->rtcp)  {
+    RtcpStats c;
+    Rtcp_GetStats(s->rtcp, &c);
+    stats->rr_sent = c.rr_sent;
+    stats->sr_received = c.sr_received;
+    stats->nack_sent = c.nack_sent;
+    stats->nack_seqs = c.nack_seqs;
+    stats->nack_recovered = c.nack_recovered;
+    stats->nack_expired = c.nack_expired;
+    stats->rtcp_lost = c.lost;
+    stats->fraction_lost = c.fraction_lost;
+  }
+
+  RtpDonStats d;
+  RtpDepack_GetDonStats(s->depack, &d);
+  stats->don_occupancy = d.occupancy;
+  stats->don_peak = d.peak;
+  stats->don_forced = d.forced;
+  stats->don_late = d.late;
+
+  Histogram h;
+  Histogram_Snapshot(&s->decodeHist, &h);
+  stats->decode_p50_us = Histogram_Percentile(&h, 50);
+  stats->decode_p90_us = Histogram_Percentile(&h, 90);
+  stats->decode_p99_us = Histogram_Percentile(&h, 99);
+  Histogram_Snapshot(&s->latencyHist, &h);
+  stats->latency_p50_ms = Histogram_Percentile(&h, 50);
+  stats->latency_p90_ms = Histogram_Percentile(&h, 90);
+  stats->latency_p99_ms = Histogram_Percentile(&h, 99);
+
+  NalPoolStats n;
+  NalPool_GetStats(s->pool, &n);
+  stats->pool_allocs = n.allocs;
+  stats->pool_grows = n.grows;
+  stats->pool_reuses = n.reuses;
+}
+
+void RtpH264Session_GetHistograms(RtpH264Session *s, Histogram *decode, Histogram *latency)
+{
+  if(decode)
+    Histogram_Snapshot(&s->decodeHist, decode);
+  if(latency)
+    Histogram_Snapshot(&s->latencyHist, latency);
+}
+
+void RtpH264_WriteStats(FILE *f, const RtpH264_Stats *stats)
+{
+  int i;
+
+#define STAT(name) fprintf(f, #name " %llu\n", (unsigned long long)stats->name)
+  STAT(packets);
+  STAT(bytes);
+  STAT(bitrate);
+  STAT(recv_calls);
+  STAT(truncated);
+  STAT(rxq_drops);
+  STAT(rcvbuf);
+  STAT(invalid);
+  STAT(extensions);
+  STAT(jitter);
+  STAT(reordered);
+  STAT(late);
+  STAT(duplicate);
+  STAT(resyncs);
+  STAT(reorder_oversize);
+  STAT(lost);
+  STAT(ts_mismatch);
+  STAT(fu_dropped);
+  STAT(aggregated);
+  STAT(access_units);
+  STAT(key_frames);
+  STAT(gated);
+  STAT(width);
+  STAT(height);
+  STAT(queue_depth);
+  STAT(queue_high_water);
+  STAT(queue_drops);
+  STAT(shed_level);
+  STAT(shed_nonref);
+  STAT(shed_ref);
+  STAT(decode_profile);
+  STAT(decoded);
+  STAT(decode_errors);
+  STAT(profile_skipped);
+  STAT(decode_p50_us);
+  STAT(decode_p90_us);
+  STAT(decode_p99_us);
+  STAT(decode_max_us);
+  STAT(latency_p50_ms);
+  STAT(latency_p90_ms);
+  STAT(latency_p99_ms);
+  STAT(write_queue_depth);
+  STAT(write_high_water);
+  STAT(write_drops_nonref);
+  STAT(write_drops_ref);
+  STAT(events);
+  STAT(event_drops);
+  STAT(don_occupancy);
+  STAT(don_peak);
+  STAT(don_forced);
+  STAT(don_late);
+  STAT(rr_sent);
+  STAT(sr_received);
+  STAT(nack_sent);
+  STAT(nack_seqs);
+  STAT(nack_recovered);
+  STAT(nack_expired);
+  STAT(rtcp_lost);
+  STAT(fraction_lost);
+  STAT(pool_allocs);
+  STAT(pool_grows);
+  STAT(pool_reuses);
+  STAT(nal_nomem);
+#undef STAT
+
+  for(i = 0; i < 32; i++)
+    if(stats->nal_types[i])
+      fprintf(f, "nal_type_%d %llu\n", i, stats->nal_types[i]);
+}
+
+/* Replace the stats file in one step, readers never see half of it */
+static void write_stats_file(RtpH264Session *s)
+{
+  char tmp[1024];
+  RtpH264_Stats stats;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", s->config.statsFile);
+  FILE *f = fopen(tmp, "w");
+  if(!f)
+    return;
+
+  RtpH264Session_GetStats(s, &stats);
+  RtpH264_WriteStats(f, &stats);
+  if(fclose(f) == 0)
+    rename(tmp, s->config.statsFile);
+}
+
+static void *stats_thread(void *arg)
+{
+  RtpH264Session *s = arg;
+  unsigned int next = now_ms() + s->config.statsIntervalMs;
+
+  while(!s->bStop)  {
+    struct timespec ts = { 0, 100 * 1000000 };
+    nanosleep(&ts, NULL);
+
+    if((int)(now_ms() - next) >= 0)  {
+      write_stats_file(s);
+      next += s->config.statsIntervalMs;
+    }
+  }
+  write_stats_file(s);
+
+  return NULL;
+}
+
+/* RFC 3550 interarrival jitter, in arrival order before any reordering */
+static void update_jitter(RtpH264Session *s, const uint8_t *pkt, int len, unsigned long long arrivalUs)
+{
+  if(len < 12)
+    return;
+
+  unsigned int ts = (pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+  int transit = (unsigned int)(arrivalUs * 9 / 100) - ts;  /* 90 kHz */
+
+  if(s->jitterInit)  {
+    int d = transit - s->transit;
+    if(d < 0)
+      d = -d;
+    s->jitter += d - ((s->jitter + 8) >> 4);
+  }
+  s->transit = transit;
+  s->jitterInit = 1;
+  STAT_SET(jitter, s->jitter >> 4);
+}
+
+static void threads_stop(RtpH264Session *s);
+
+static int threads_start(RtpH264Session *s)
+{
+  if(s->writeQueue)  {
+    if(pthread_create(&s->writer, NULL, write_thread, s) != 0)  {
+      fprintf(stderr, "could not start writer thread\n");
+      return -1;
+    }
+    s->writerRunning = 1;
+  }
+
+  if(s->preEvent)  {
+    if(pthread_create(&s->eventThread, NULL, event_thread, s) != 0)  {
+      fprintf(stderr, "could not start event thread\n");
+      threads_stop(s);
+      return -1;
+    }
+    s->eventThreadRunning = 1;
+  }
+
+  if(s->queue)  {
+    if(pthread_create(&s->decoder, NULL, decode_thread, s) != 0)  {
+      fprintf(stderr, "could not start decoder thread\n");
+      threads_stop(s);
+      return -1;
+    }
+    s->decoderRunning = 1;
+  }
+
+  if(s->config.statsFile && s->config.statsIntervalMs > 0)  {
+    if(pthread_create(&s->statsThread, NULL, stats_thread, s) != 0)
+      fprintf(stderr, "could not start stats thread\n");
+    else
+      s->statsRunning = 1;
+  }
+
+  s->rateStart = now_ms();
+  s->rateBytes = s->stats.bytes;
+  return 0;
+}
+
+static void threads_stop(RtpH264Session *s)
+{
+  if(s->statsRunning)  {
+    s->bStop = 1;
+    pthread_join(s->statsThread, NULL);
+    s->statsRunning = 0;
+  }
+
+  if(s->decoderRunning)  {
+    sem_post(&s->queued);
+    pthread_join(s->decoder, NULL);
+    s->decoderRunning = 0;
+  }
+
+  if(s->writerRunning)  {
+    sem_post(&s->written);
+    pthread_join(s->writer, NULL);
+    s->writerRunning = 0;
+  }
+
+  /* finish an event cut short by the stop */
+  if(s->eventActive)  {
+    s->eventActive = 0;
+    sem_post(&s->eventQueued);
+    __atomic_store_n(&s->eventRequested, 0, __ATOMIC_RELEASE);
+  }
+  if(s->eventThreadRunning)  {
+    sem_post(&s->eventQueued);
+    pthread_join(s->eventThread, NULL);
+    s->eventThreadRunning = 0;
+  }
+}
+
+/* One datagram in arrival order, s->now already set */
+static void receive_packet(RtpH264Session *s, const uint8_t *pkt, int len,
+                           unsigned long long arrivalUs, const struct sockaddr_in *from)
+{
+  update_jitter(s, pkt, len, arrivalUs);
+  if(s->rtcp)
+    Rtcp_OnRtp(s->rtcp, pkt, len, from, s->now);
+  if(s->reorder)
+    RtpReorder_Push(s->reorder, pkt, len, s->now);
+  else
+    on_packet(s, pkt, len);
+}
+
+static void receive_idle(RtpH264Session *s)
+{
+  s->now = now_ms();
+  if(s->reorder)
+    RtpReorder_Poll(s->reorder, s->now);
+  RtpDepack_Poll(s->depack, s->now);
+  if(s->rtcp)
+    Rtcp_Poll(s->rtcp, s->jitter >> 4, s->now);
+}
+
+static void update_bitrate(RtpH264Session *s)
+{
+  if(now_ms() - s->rateStart >= 1000)  {
+    unsigned int elapsed = now_ms() - s->rateStart;
+    STAT_SET(bitrate, (s->stats.bytes - s->rateBytes) * 8 * 1000 / elapsed);
+    s->rateStart += elapsed;
+    s->rateBytes = s->stats.bytes;
+  }
+}
+
+static void receive_flush(RtpH264Session *s)
+{
+  if(s->reorder)
+    RtpReorder_Flush(s->reorder);
+  RtpDepack_Flush(s->depack);
+  if(s->rtcp)
+    Rtcp_Bye(s->rtcp, s->jitter >> 4, now_ms());
+}
+
+void RtpH264Session_Run(RtpH264Session *s, int sfd, RtpH264_OnPicture onPicture)
+{
+  int i;
+
+  s->onPicture = onPicture;
+  pin_thread(s, s->config.receiveCpus, "receive");
+
+  RtpSocket_EnableMeta(sfd);
+  STAT_SET(rcvbuf, RtpSocket_GetRcvbuf(sfd));
+
+  if(threads_start(s) < 0)
+    return;
 
-  unsigned short sequence = 0;
-  unsigned int timestamp = 0;
-  
   while(1)  {
-    //int ready = 0;
     fd_set rfds;
     FD_ZERO(&rfds);
     FD_SET(sfd, &rfds);
+    int maxFd = sfd;
+    if(s->rtcp)  {
+      FD_SET(s->rtcpFd, &rfds);
+      if(s->rtcpFd > maxFd)
+        maxFd = s->rtcpFd;
+    }
 
     struct timeval timeout;  /*Timer for operation select*/
     timeout.tv_sec = 0;
     timeout.tv_usec = 10000; /*10 ms*/
 
-    if(select(sfd+1, &rfds, 0, 0, &timeout) <= 0) {
-      if(bStop)
+    if(select(maxFd+1, &rfds, 0, 0, &timeout) <= 0) {
+      receive_idle(s);
+      if(s->bStop)
         break;
       else
         continue;
     }
 
-    if(FD_ISSET(sfd, &rfds) <= 0)
-      continue;
-    
-    rtp_hdr_t rtp;
-    unsigned char buf[64];
-    memset(buf, 0, 64);
-    int r = recv(sfd, buf, sizeof(rtp_hdr_t) + 8, MSG_PEEK);  /*  Peek data from socket, so that we could determin how to read data from socket*/
-    if(r <= sizeof(rtp_hdr_t) || r == -1)  {
-      recv(sfd, buf, sizeof(rtp_hdr_t) + 8, 0); /*Read invalid packet*/
-      printf("Warning !!! Invalid packet\n");
-      continue; /*Invalid packet ???*/
-    }
+    /* Drain the socket a batch at a time until it runs dry */
+    int n;
+    do {
+      for(i = 0; i < RTP_BATCH; i++)  {
+        s->msgs[i].msg_hdr.msg_control = s->ctrl[i];
+        s->msgs[i].msg_hdr.msg_controllen = sizeof(s->ctrl[i]);
+        s->msgs[i].msg_hdr.msg_namelen = sizeof(s->names[i]);
+      }
 
-    int ready = 0;
-
-    /*  Handle H.264 RTP Header */
-    /* +---------------+
-    *  |0|1|2|3|4|5|6|7|
-    *  +-+-+-+-+-+-+-+-+
-    *  |F|NRI|  Type   |
-    *  +---------------+
-    *
-    * F must be 0.
-    */
-    unsigned char nal_ref_idc, nal_unit_type;
-    unsigned char *header = buf + sizeof(rtp_hdr_t);  /*  NAL Header  */
-    nal_ref_idc = (header[0] & 0x60) >> 5;  /*  NRI */
-//printf("nal_ref_idc = %d\n", nal_ref_idc);
-    nal_unit_type = header[0] & 0x1f;       /*  Type  */
-//printf("nal_unit_type = %d\n", nal_unit_type);
-
-    switch (nal_unit_type) {
-      case 0:
-      case 30:
-      case 31:
-        /* undefined */
-        break;
-      case 25:
-        /* STAP-B    Single-time aggregation packet     5.7.1 */
-        /* 2 byte extra header for DON */
-        /* fallthrough */
-      case 24:
-        /* STAP-A    Single-time aggregation packet     5.7.1 */
-        break;
-      case 26:
-        /* MTAP16    Multi-time aggregation packet      5.7.2 */
-        /* fallthrough, not implemented */
-      case 27:
-        /* MTAP24    Multi-time aggregation packet      5.7.2 */
-        break;
-      case 28:
-        /* FU-A      Fragmentation unit                 5.8 */
-      case 29:  {
-        /* FU-B      Fragmentation unit                 5.8 */
-        /* +---------------+
-        * |0|1|2|3|4|5|6|7|
-        * +-+-+-+-+-+-+-+-+
-        * |S|E|R|  Type   |
-        * +---------------+
-        *
-        * R is reserved and always 0
-        */
-
-        /*Really read packet*/
-        struct iovec data[3];
-
-        data[0].iov_base = &rtp;
-        data[0].iov_len = sizeof(rtp_hdr_t);
-
-        if(nal_unit_type == 28) {
-          /* strip off FU indicator and FU header bytes */
-          data[1].iov_base = buf;
-          data[1].iov_len = 2;
-        } else if(nal_unit_type == 29) {
-          /* strip off FU indicator and FU header and DON bytes */
-          data[1].iov_base = buf;
-          data[1].iov_len = 4;
-        }
-        
-        /* NAL unit starts here */
-        if((header[1] & 0x80) == 0x80)  {
-          data[2].iov_base = &inbuf[5];
-          data[2].iov_len = INBUF_SIZE - 5;
-          
-          r = readv(sfd, data, 3);
-          if(r <= (sizeof(rtp_hdr_t) + 2))  {
-            printf("Socket read fail !!!\n");
-            goto cleanup;
-          }
-
-          unsigned char fu_indicator = buf[0];
-          unsigned char fu_header = buf[1];
-          
-          timestamp = ntohl(rtp.ts);
-          sequence = ntohs(rtp.seq);            
-          
-          inbuf[0] = 0x00;
-          inbuf[1] = 0x00;
-          inbuf[2] = 0x00;
-          inbuf[3] = 0x01;
-          inbuf[4] = (fu_indicator & 0xe0) | (fu_header & 0x1f);
-          if(nal_unit_type == 28)
-            avpkt.size = (r - sizeof(rtp_hdr_t) - 2 + 5);
-          else if(nal_unit_type == 29)
-            avpkt.size = (r - sizeof(rtp_hdr_t) - 4 + 5);
-          avpkt.data = inbuf;
-//printf("nalu = %d\n", fu_header & 0x1f);
-          
-          if((fu_header & 0x1f) == 7)
-            avpkt.flags |= PKT_FLAG_KEY;
-//          avpkt.pts = frame_count++;
-//printf("avpkt.pts = %d\n", avpkt.pts);          
-          break;
-        } else  {
-          data[2].iov_base = inbuf + avpkt.size;
-          data[2].iov_len = INBUF_SIZE - avpkt.size;
-
-          r = readv(sfd, data, 3);
-
-          //unsigned char fu_indicator = buf[0];
-          unsigned char fu_header = buf[1];
-
-          if(r <= (sizeof(rtp_hdr_t) + 2) || r == -1)  {
-            printf("Socket read fail !!!\n");
-            goto cleanup;
-          }
-
-          if(ntohl(rtp.ts) != timestamp)  {
-            printf("Miss match timestamp %d ( expect %d )\n", ntohl(rtp.ts), timestamp);
-          }
-
-          if(ntohs(rtp.seq) != ++sequence)  {
-            printf("Wrong sequence number %u ( expect %u )\n", ntohs(rtp.seq), sequence);
-          }
-
-          if(nal_unit_type == 28)
-            avpkt.size += (r - sizeof(rtp_hdr_t) - 2);
-          else if(nal_unit_type == 29)
-            avpkt.size += (r - sizeof(rtp_hdr_t) - 4);
-//printf("frame size : %d\n", avpkt.size);
-        }
-        
-        /* NAL unit ends  */
-        if((header[1] & 0x40) == 0x40)  {
-          ready = 1;  /*We are done, go to decode*/
-          break;
+      n = recvmmsg(sfd, s->msgs, RTP_BATCH, MSG_DONTWAIT, NULL);
+      if(n <= 0) {
+        if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          perror("recvmmsg");
+          goto done;
         }
-
         break;
       }
-      default:  {
-        /* 1-23   NAL unit  Single NAL unit packet per H.264   5.6 */
-        /* the entire payload is the output buffer */
-        struct iovec data[2];
-
-        data[0].iov_base = &rtp;
-        data[0].iov_len = sizeof(rtp_hdr_t);
-
-        inbuf[0] = 0x00;
-        inbuf[1] = 0x00;
-        inbuf[2] = 0x00;
-        inbuf[3] = 0x01;
-
-        data[1].iov_base = &inbuf[4];
-        data[1].iov_len = INBUF_SIZE - 4;
-
-        r = readv(sfd, data, 2);
-        if(r <= sizeof(rtp_hdr_t) || r == -1)  {
-          printf("Socket read fail !!!\n");
-          goto cleanup;
-        }
 
-        avpkt.size = (r - sizeof(rtp_hdr_t) + 4);
-        avpkt.data = inbuf;
-        
-        ready = 1;  /*We are done, go to decode*/
+      STAT_INC(recv_calls);
+      STAT_ADD(packets, n);
+      s->now = now_ms();
 
-        break;
+      struct timespec rt;
+      clock_gettime(CLOCK_REALTIME, &rt);
+      unsigned long long batchUs = rt.tv_sec * 1000000ULL + rt.tv_nsec / 1000;
+
+      for(i = 0; i < n; i++) {
+        int len = s->msgs[i].msg_len;
+        STAT_ADD(bytes, len);
+        long long drops = RtpSocket_Drops(&s->msgs[i].msg_hdr);
+        if(drops >= 0)
+          STAT_SET(rxq_drops, drops);
+        if(s->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+          STAT_INC(truncated);
+          continue;
+        }
+        receive_packet(s, s->iovs[i].iov_base, len,
+                       RtpSocket_ArrivalUs(&s->msgs[i].msg_hdr, batchUs), &s->names[i]);
       }
+    } while(n == RTP_BATCH);
+
+    /* NACKs for the holes this batch opened go out right away */
+    if(s->rtcp)  {
+      if(FD_ISSET(s->rtcpFd, &rfds))
+        Rtcp_Receive(s->rtcp, s->now);
+      Rtcp_Poll(s->rtcp, s->jitter >> 4, s->now);
     }
 
-    int got_picture;
-    while(ready && avpkt.size > 0) {
-      avpkt.pts = ++frame_count;
-//printf("frame size : %d\n", avpkt.size);
-//printf("avpkt.dts = %d\n", avpkt.dts);
-//      int len = avcodec_decode_video(context, picture, &got_picture, avpkt.data, avpkt.size);
-      int len = avcodec_decode_video2(context, picture, &got_picture, &avpkt);
-//printf("context->coded_frame->pts = %d\n", context->coded_frame->pts);  /*  0 */
-//printf("picture->pts = %d\n", picture->pts);
-//printf("picture->pict_type = %d\n", picture->pict_type);
-//printf("picture->key_frame = %d\n", picture->key_frame);
-//printf("picture->interlaced_frame = %d\n", picture->interlaced_frame);
-//printf("avpkt.duration = %d\n", avpkt.duration);
-      
-      Mp4Mux_WriteVideo(&avpkt, timestamp);
-
-      if(len < 0) {
-        fprintf(stderr, "Error while decoding frame\n");
-        av_init_packet(&avpkt);
-        break;
-      }
-      
-      if(got_picture) {
-//        printf("Decode length : %d\n", len);
-//        fflush(stdout);
-        /* the picture is allocated by the decoder. no need to
-               free it */
-        if(onPicture)
-          onPicture(picture->data[0], picture->linesize[0], context->width, context->height);
-
-        av_init_packet(&avpkt);
-        break;
+    update_bitrate(s);
+  }
+
+  receive_flush(s);
+
+done:
+  threads_stop(s);
+}
+
+int RtpH264Session_Start(RtpH264Session *s, RtpH264_OnPicture onPicture)
+{
+  s->onPicture = onPicture;
+  return threads_start(s);
+}
+
+void RtpH264Session_Input(RtpH264Session *s, const uint8_t *pkt, int len,
+                          unsigned long long arrivalUs, const struct sockaddr_in *from)
+{
+  STAT_INC(packets);
+  STAT_ADD(bytes, len);
+  s->now = now_ms();
+  receive_packet(s, pkt, len, arrivalUs, from);
+}
+
+void RtpH264Session_Idle(RtpH264Session *s)
+{
+  receive_idle(s);
+  update_bitrate(s);
+}
+
+void RtpH264Session_Finish(RtpH264Session *s)
+{
+  receive_flush(s);
+  threads_stop(s);
+}
+
+/*
+ * Replay can outrun the decoder and writer by far, wait for them rather
+ * than letting shedding or the write queue limits drop frames
+ */
+static void wait_pipeline(RtpH264Session *s)
+{
+  for(;;)  {
+    int busy = 0;
+    if(s->queue)  {
+      int decodeMax = s->config.shedDepth > 0 ? s->config.shedDepth : SpscQueue_Capacity(s->queue);
+      if(SpscQueue_Count(s->queue) >= decodeMax / 2)
+        busy = 1;
+    }
+    if(s->writeQueue && (SpscQueue_Count(s->writeQueue) >= SpscQueue_Capacity(s->writeQueue) / 2 ||
+       __atomic_load_n(&s->writeBytes, __ATOMIC_RELAXED) >= s->config.writeQueueBytes / 2))
+      busy = 1;
+    if(!busy || s->bStop)
+      return;
+
+    struct timespec ts = { 0, 100 * 1000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+void RtpH264Session_RunSource(RtpH264Session *s, RtpSource *src, int realtime, RtpH264_OnPicture onPicture)
+{
+  uint8_t *pkt = s->ring;
+  unsigned long long first = 0;
+  unsigned long long start = 0;
+
+  s->onPicture = onPicture;
+  pin_thread(s, s->config.receiveCpus, "receive");
+
+  if(threads_start(s) < 0)
+    return;
+
+  while(!s->bStop)  {
+    unsigned long long t;
+    int len = RtpSource_Read(src, pkt, RTP_SLOT_SIZE, &t);
+    if(len < 0)
+      fprintf(stderr, "capture file damaged, replay stopped\n");
+    if(len <= 0)
+      break;
+
+    struct timespec mt;
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+    unsigned long long nowUs = mt.tv_sec * 1000000ULL + mt.tv_nsec / 1000;
+    if(!first)  {
+      first = t;
+      start = nowUs;
+    }
+
+    if(realtime)  {
+      /* keep the captured spacing, idle work runs while waiting as it would live */
+      while(!s->bStop && t - first > nowUs - start)  {
+        unsigned long long wait = (t - first) - (nowUs - start);
+        struct timespec ts = { 0, (wait > 10000 ? 10000 : wait) * 1000 };
+        nanosleep(&ts, NULL);
+        receive_idle(s);
+        clock_gettime(CLOCK_MONOTONIC, &mt);
+        nowUs = mt.tv_sec * 1000000ULL + mt.tv_nsec / 1000;
       }
-      avpkt.size -= len;
-      avpkt.data += len;
+    } else  {
+      wait_pipeline(s);
+    }
+
+    STAT_INC(packets);
+    STAT_ADD(bytes, len);
+    if(len > RTP_SLOT_SIZE)  {
+      STAT_INC(truncated);
+      continue;
     }
+
+    s->now = now_ms();
+    /* capture times give the jitter the stream had on the wire */
+    receive_packet(s, pkt, len, t, NULL);
+    if(s->rtcp)
+      Rtcp_Poll(s->rtcp, s->jitter >> 4, s->now);
+    update_bitrate(s);
   }
 
-cleanup:
-  av_free(picture);
-  
-  return;
+  receive_flush(s);
+  threads_stop(s);
+}
+
+/*
+ * Single session wrappers kept for existing callers
+ */
+
+static RtpH264Session *session = NULL;
+static int legacyRtcpFd = -1;
+static RtpH264Config legacyConfig;
+static int legacyConfigSet = 0;
+
+/* session defaults, recording to the old fixed path */
+static RtpH264Config *legacy_config(void)
+{
+  if(!legacyConfigSet)  {
+    RtpH264_DefaultConfig(&legacyConfig);
+    legacyConfig.filename = "/tmp/scv.mp4";
+    legacyConfigSet = 1;
+  }
+  return &legacyConfig;
+}
+
+void RtpH264_SetReorder(int depth, int latencyMs)
+{
+  RtpH264Config *cfg = legacy_config();
+  cfg->reorderDepth = depth;
+  cfg->reorderLatency = latencyMs;
+}
+
+void RtpH264_SetInterleaved(int enable, int depth, int donDiff)
+{
+  RtpH264Config *cfg = legacy_config();
+  cfg->interleaved = enable;
+  cfg->interleavingDepth = depth;
+  cfg->maxDonDiff = donDiff;
+}
+
+void RtpH264_SetStatsFile(const char *filename, int intervalMs)
+{
+  RtpH264Config *cfg = legacy_config();
+  cfg->statsFile = filename;
+  cfg->statsIntervalMs = intervalMs;
+}
+
+void RtpH264_SetRtcp(int rtcpFd, int nack)
+{
+  RtpH264Config *cfg = legacy_config();
+  legacyRtcpFd = rtcpFd;
+  cfg->nack = nack;
+}
+
+void RtpH264_SetDecodeProfile(int profile)
+{
+  legacy_config()->decodeProfile = profile;
+}
+
+void RtpH264_SetDecodeThreads(int threads)
+{
+  legacy_config()->decodeThreads = threads;
+}
+
+void RtpH264_Init()
+{
+  session = RtpH264Session_Create(legacy_config());
+  if(!session)  {
+    fprintf(stderr, "could not create session\n");
+    exit(EXIT_FAILURE);
+  }
+  if(legacyRtcpFd >= 0 && RtpH264Session_SetRtcp(session, legacyRtcpFd) < 0)
+    fprintf(stderr, "could not allocate RTCP state\n");
+}
+
+void RtpH264_Deinit()
+{
+  RtpH264Session_Destroy(session);
+  session = NULL;
+}
+
+void RtpH264_Stop()
+{
+  if(session)
+    RtpH264Session_Stop(session);
+}
+
+void RtpH264_GetStats(RtpH264_Stats *stats)
+{
+  RtpH264Session_GetStats(session, stats);
+}
+
+void RtpH264_Run(int sfd, RtpH264_OnPicture onPicture)
+{
+  RtpH264Session_Run(session, sfd, onPicture);
 }
@@ -18,6 +18,8 @@
  * MA 02111-1307 USA
  *
 */
+#ifndef RTPH264_H
+#define RTPH264_H
 
 #ifdef HAVE_AV_CONFIG_H
 #undef HAVE_AV_CONFIG_H
@@ -27,9 +29,231 @@
 #include "libavutil/mathematics.h"
 #include "libavformat/avformat.h"
 
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "mp4mux.h"
+#include "histogram.h"
+#include "rtpsource.h"
+
+typedef struct RtpH264_Stats {
+  unsigned long long packets;     /* datagrams received */
+  unsigned long long bytes;       /* datagram bytes received */
+  unsigned long long recv_calls;  /* recvmmsg() calls that returned data */
+  unsigned long long truncated;   /* datagrams larger than a ring slot */
+  unsigned long long rxq_drops;   /* dropped by the kernel, socket buffer full (SO_RXQ_OVFL) */
+  int rcvbuf;                     /* socket receive buffer as the kernel reports it, twice the usable size */
+  unsigned int jitter;            /* RFC 3550 interarrival jitter, 90 kHz units */
+  unsigned long long bitrate;     /* bits/s over the last second */
+  unsigned long long invalid;     /* malformed packets */
+  unsigned long long extensions;  /* packets carrying an RTP header extension (e.g. ONVIF) */
+  unsigned long long ts_mismatch; /* FU fragments with another timestamp than their start */
+  unsigned long long nal_types[32]; /* complete NAL units by type */
+  unsigned long long reordered;   /* put back in order by the reorder buffer */
+  unsigned long long late;        /* dropped, arrived after their hole was skipped */
+  unsigned long long duplicate;   /* dropped, sequence number already seen */
+  unsigned long long resyncs;     /* reorder buffer restarted on a new sequence, e.g. sender restart */
+  unsigned long long reorder_oversize; /* dropped, larger than a reorder slot */
+  unsigned long long lost;        /* sequence numbers never received */
+  unsigned long long fu_dropped;  /* FU NAL units discarded for a missing fragment */
+  unsigned long long aggregated;  /* NAL units split out of STAP/MTAP packets */
+  unsigned long long access_units; /* frames emitted to decoder and muxer */
+  unsigned long long key_frames;   /* access units containing an IDR */
+  unsigned long long gated;        /* access units skipped before the first IDR */
+  int width;                      /* picture size from the latest SPS */
+  int height;
+  unsigned long long nal_nomem;    /* NAL units lost, access unit could not grow */
+  unsigned long long pool_allocs;  /* access unit buffers allocated */
+  unsigned long long pool_grows;   /* access unit buffers grown to fit a frame */
+  unsigned long long pool_reuses;  /* access unit buffers recycled from the pool */
+  int queue_depth;                /* units waiting for the decoder thread */
+  int queue_high_water;
+  unsigned long long queued;      /* units handed to the decoder thread */
+  unsigned long long queue_drops; /* units dropped, decode queue full */
+  int shed_level;                 /* RTPH264_SHED_* */
+  unsigned long long shed_nonref; /* non-reference frames recorded but not decoded */
+  unsigned long long shed_ref;    /* reference frames recorded but not decoded, decoding IDRs only */
+  int decode_profile;             /* RTPH264_DECODE_* */
+  unsigned long long decoded;     /* access units run through the decoder */
+  unsigned long long decode_us;   /* decoder CPU time, sum over decoded units */
+  unsigned long long decode_max_us; /* most expensive unit */
+  unsigned long long profile_skipped; /* not decoded, keyframe only profile */
+  unsigned long long decode_errors;
+  unsigned int decode_p50_us;     /* decode time percentiles */
+  unsigned int decode_p90_us;
+  unsigned int decode_p99_us;
+  unsigned int latency_p50_ms;    /* last packet received to picture out */
+  unsigned int latency_p90_ms;
+  unsigned int latency_p99_ms;
+  int write_queue_depth;          /* access units waiting for the writer thread */
+  int write_high_water;
+  unsigned long long write_drops_nonref; /* non-reference frames shed, write queue filling */
+  unsigned long long write_drops_ref;    /* frames dropped until the next IDR, write queue full */
+  unsigned long long events;       /* pre-event dumps started */
+  unsigned long long event_drops;  /* access units missing from a dump, event queue full */
+  int don_occupancy;              /* NAL units held in the decoding order buffer */
+  int don_peak;
+  unsigned long long don_forced;  /* released early to stay within budget */
+  unsigned long long don_late;    /* dropped, DON already passed */
+  unsigned long long rr_sent;     /* RTCP receiver reports sent */
+  unsigned long long sr_received; /* RTCP sender reports received */
+  unsigned long long nack_sent;   /* generic NACK packets sent */
+  unsigned long long nack_seqs;   /* sequence numbers asked for again */
+  unsigned long long nack_recovered; /* asked for and received in time to be used */
+  unsigned long long nack_expired;   /* asked for, never came before the reorder buffer moved on */
+  unsigned long long rtcp_lost;   /* cumulative packets lost as last reported */
+  unsigned int fraction_lost;     /* of the last report, 1/256 units */
+} RtpH264_Stats;
+
+/* Decode fidelity, cheaper profiles for analytics and thumbnails */
+#define RTPH264_DECODE_FULL      0
+#define RTPH264_DECODE_FAST      1  /* no loop filter or IDCT on non-reference frames, fast flags */
+#define RTPH264_DECODE_KEYFRAMES 2  /* IDRs only */
+
+/* Decoder threading inside libavcodec */
+#define RTPH264_THREAD_FRAME 1  /* one frame per thread, a frame of delay per extra thread */
+#define RTPH264_THREAD_SLICE 2  /* slices of a frame in parallel, needs multi-slice streams */
+
+/* Decode load shedding, recording always gets every frame */
+#define RTPH264_SHED_NONE   0
+#define RTPH264_SHED_NONREF 1  /* non-reference frames skipped */
+#define RTPH264_SHED_REF    2  /* only IDRs decoded */
+#define RTPH264_SHED_RESYNC 3  /* pressure gone, full decoding from the next IDR */
+
 typedef void (*RtpH264_OnPicture)(unsigned char *data, int lineSize, int width, int height);
 
+/*
+ * Decoded picture with all its planes, shared with the decoder rather
+ * than copied. It stays valid, on any thread, until the last reference
+ * is dropped; drop them all before destroying the session.
+ */
+typedef struct RtpH264Frame {
+  uint8_t *data[4];
+  int linesize[4];
+  int width;
+  int height;
+  int format;              /* enum PixelFormat */
+  unsigned int timestamp;  /* RTP timestamp of the access unit */
+  unsigned int receiveMs;  /* when its last packet arrived, CLOCK_MONOTONIC */
+  int64_t pts;
+  int pictType;            /* FF_I_TYPE, FF_P_TYPE, ... */
+  int keyFrame;
+  void *priv;
+} RtpH264Frame;
+
+/* the frame is lent for the call, RtpH264Frame_Ref() it to keep it */
+typedef void (*RtpH264_OnFrame)(void *opaque, RtpH264Frame *frame);
+
+void RtpH264Frame_Ref(RtpH264Frame *frame);
+void RtpH264Frame_Unref(RtpH264Frame *frame);
+
+typedef struct RtpH264Config {
+  const char *filename;   /* MP4 output, NULL records nothing; a printf
+                             pattern with one %d when segmenting */
+  int reorderDepth;       /* packets, 0 disables the reorder buffer */
+  int reorderLatency;     /* ms */
+  int interleaved;        /* packetization-mode=2 */
+  int interleavingDepth;  /* sprop-interleaving-depth */
+  int maxDonDiff;         /* sprop-max-don-diff */
+  int rtcpIntervalMs;     /* receiver reports, with RtpH264Session_SetRtcp() */
+  int nack;               /* ask for missing packets, answers are used while
+                             the reorder buffer still waits, reorderLatency */
+  int decodeThread;       /* decode on a separate thread, onPicture runs there */
+  int queueDepth;         /* units between receive and decoder thread */
+  int shedDepth;          /* decode queue depth where non-reference frames
+                             stop being decoded, 0 never sheds */
+  int shedIdrDepth;       /* decode queue depth where only IDRs are decoded */
+  int recordOnly;         /* mux without decoding, no decoder is allocated */
+  int decodeProfile;      /* RTPH264_DECODE_* */
+  int decodeThreads;      /* libavcodec decoder threads, 0 or 1 decodes on one */
+  int decodeThreadType;   /* RTPH264_THREAD_* mask; libavcodec before frame
+                             threading only ever splits slices */
+  const char *receiveCpus; /* CPU lists like "0-3,8" to pin the receive, */
+  const char *decodeCpus;  /* decoder (libavcodec's workers included) */
+  const char *writeCpus;   /* and writer threads to, NULL floats */
+  int numaNode;           /* threads without a CPU list run on this node and all
+                             take memory from it, -1 for none */
+  int outputFormat;       /* of frames given to RtpH264_OnFrame: PIX_FMT_YUV420P as
+                             decoded, PIX_FMT_NV12, PIX_FMT_RGB24 or PIX_FMT_BGRA */
+  int outputScale;        /* 2 or 4 box filters frames down before conversion */
+  int fragment;           /* MP4MUX_CLASSIC, MP4MUX_FRAGMENT_GOP or fragment length in ms */
+  int segmentMs;          /* rotate files on an IDR after this long, 0 for no limit */
+  long long segmentBytes; /* rotate files on an IDR after this many bytes */
+  int keepSegments;       /* finished segments kept on disk, 0 keeps all */
+  long long keepBytes;    /* bytes of finished segments kept, 0 for no limit */
+  int writeThread;        /* write to disk on a separate thread */
+  int writeQueueDepth;    /* access units between decoder and writer thread */
+  int writeQueueBytes;    /* bytes between decoder and writer thread */
+  int preEventMs;         /* keep at least this much from an IDR for events, 0 disables */
+  int preEventBytes;      /* fixed memory budget of the pre-event ring */
+  const char *statsFile;  /* rewritten with the stats while running, NULL for none */
+  int statsIntervalMs;
+} RtpH264Config;
+
+/*
+ * A session owns the decoder, the reassembly state and the muxer of one
+ * stream. Any number of sessions may run in one process, each from its
+ * own thread.
+ *
+ * A session created with recordOnly, or run without a picture or frame
+ * callback, hands NAL units straight to the muxer without decoding them.
+ */
+typedef struct RtpH264Session RtpH264Session;
+
+void RtpH264_DefaultConfig(RtpH264Config *cfg);
+RtpH264Session *RtpH264Session_Create(const RtpH264Config *cfg);
+void RtpH264Session_Destroy(RtpH264Session *s);
+void RtpH264Session_Run(RtpH264Session *s, int sfd, RtpH264_OnPicture onPicture);
+/*
+ * For callers with their own receive loop, e.g. several sessions per
+ * socket: Start once, Input every datagram in arrival order, Idle at
+ * least every 10 ms and Finish at the end, all from one thread
+ */
+int RtpH264Session_Start(RtpH264Session *s, RtpH264_OnPicture onPicture);
+void RtpH264Session_Input(RtpH264Session *s, const uint8_t *pkt, int len,
+                          unsigned long long arrivalUs, const struct sockaddr_in *from);
+void RtpH264Session_Idle(RtpH264Session *s);
+void RtpH264Session_Finish(RtpH264Session *s);
+/*
+ * Same pipeline fed from a capture file until its end or a stop. realtime
+ * keeps the captured packet spacing; otherwise packets go in as fast as
+ * the decoder and writer take them, nothing is shed or dropped for load.
+ */
+void RtpH264Session_RunSource(RtpH264Session *s, RtpSource *src, int realtime, RtpH264_OnPicture onPicture);
+/* call before RtpH264Session_Run(), frames go to both callbacks when set */
+void RtpH264Session_SetOnFrame(RtpH264Session *s, RtpH264_OnFrame onFrame, void *opaque);
+/*
+ * Call before RtpH264Session_Run(): send receiver reports, and NACKs when
+ * configured, from rtcpFd, usually bound to the RTP port + 1
+ */
+int RtpH264Session_SetRtcp(RtpH264Session *s, int rtcpFd);
+void RtpH264Session_Stop(RtpH264Session *s);
+/* lock free snapshot, callable from any thread while the session runs */
+void RtpH264Session_GetStats(RtpH264Session *s, RtpH264_Stats *stats);
+/* full decode time (us) and latency (ms) distributions, either may be NULL */
+void RtpH264Session_GetHistograms(RtpH264Session *s, Histogram *decode, Histogram *latency);
+/*
+ * Write the pre-event ring and the next postMs of the live stream to a
+ * new MP4, without interrupting reception or recording. Returns -1 when
+ * pre-event buffering is off or an event is already being written.
+ */
+int RtpH264Session_Trigger(RtpH264Session *s, const char *filename, int postMs);
+
+/* Single session API, records to /tmp/scv.mp4 */
 void RtpH264_Init();
 void RtpH264_Deinit();
 void RtpH264_Run(int sfd, RtpH264_OnPicture onPicture);
 void RtpH264_Stop();
+void RtpH264_GetStats(RtpH264_Stats *stats);
+/* call before RtpH264_Init() */
+void RtpH264_SetReorder(int depth, int latencyMs);
+void RtpH264_SetInterleaved(int enable, int interleavingDepth, int maxDonDiff);
+void RtpH264_SetDecodeProfile(int profile);
+void RtpH264_SetDecodeThreads(int threads);
+void RtpH264_SetStatsFile(const char *filename, int intervalMs);
+void RtpH264_SetRtcp(int rtcpFd, int nack);
+
+/* one "name value" line per counter */
+void RtpH264_WriteStats(FILE *f, const RtpH264_Stats *stats);
+
+#endif
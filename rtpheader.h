@@ -0,0 +1,132 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPHEADER_H
+#define RTPHEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * RFC 3550 fixed header read byte by byte, so it does not depend on
+ * bitfield layout or host byte order. CSRCs, the header extension and
+ * padding are stepped over in one pass; everything points into the
+ * packet, nothing is copied. Inline, as it runs once per packet and
+ * callers mostly read a few fields.
+ */
+
+typedef struct RtpHeader {
+  int marker;
+  int payloadType;
+  unsigned short seq;
+  uint32_t timestamp;
+  uint32_t ssrc;
+
+  int csrcCount;
+  const uint8_t *csrc;        /* csrcCount big endian 32 bit ids */
+
+  int extProfile;             /* "defined by profile" field, -1 without extension */
+  const uint8_t *ext;         /* extension data past its 4 byte header */
+  int extLen;                 /* bytes, a multiple of 4 */
+
+  const uint8_t *payload;
+  int payloadLen;             /* padding removed */
+  int padding;                /* bytes of padding at the end of the packet */
+} RtpHeader;
+
+#define RTPHEADER_RB16(p) (((p)[0] << 8) | (p)[1])
+#define RTPHEADER_RB32(p) (((uint32_t)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+
+/* 0 when pkt holds a well formed version 2 packet, -1 otherwise */
+static inline __attribute__((always_inline)) int RtpHeader_Parse(const uint8_t *pkt, int len, RtpHeader *h)
+{
+  /*  0                   1                   2                   3
+   *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+   * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   * |V=2|P|X|  CC   |M|     PT      |       sequence number         |
+   * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   * |                           timestamp                           |
+   * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   * |           synchronization source (SSRC) identifier            |
+   * +=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+   * |            contributing source (CSRC) identifiers             |
+   * |                             ....                              |
+   * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   */
+  if(len < 12)
+    return -1;
+
+  /* the first word in one load, then shifts */
+  uint32_t w = RTPHEADER_RB32(pkt);
+
+  int off = 12 + ((w >> 22) & 0x3c);
+  int end = len;
+
+  h->marker = (w >> 23) & 1;
+  h->payloadType = (w >> 16) & 0x7f;
+  h->seq = w & 0xffff;
+  h->timestamp = RTPHEADER_RB32(pkt + 4);
+  h->ssrc = RTPHEADER_RB32(pkt + 8);
+  h->csrcCount = (w >> 24) & 0x0f;
+  h->csrc = pkt + 12;
+
+  h->extProfile = -1;
+  h->ext = NULL;
+  h->extLen = 0;
+  h->padding = 0;
+  /* one test for the usual case: version 2, no padding, no extension */
+  if((w & 0xf0000000) != 0x80000000)  {
+    if((w >> 30) != 2)
+      return -1;
+
+    if(w & 0x10000000)  {
+      /* profile specific id and length in 32 bit words, then the data */
+      if(off + 4 > len)
+        return -1;
+      h->extProfile = RTPHEADER_RB16(pkt + off);
+      h->extLen = RTPHEADER_RB16(pkt + off + 2) * 4;
+      h->ext = pkt + off + 4;
+      off += 4 + h->extLen;
+    }
+
+    /* last octet counts the padding, itself included */
+    if(w & 0x20000000)  {
+      h->padding = pkt[len - 1];
+      if(h->padding == 0)
+        return -1;
+      end -= h->padding;
+    }
+  }
+
+  if(off > end)
+    return -1;
+
+  h->payload = pkt + off;
+  h->payloadLen = end - off;
+  return 0;
+}
+
+/* i-th contributing source */
+static inline uint32_t RtpHeader_Csrc(const RtpHeader *h, int i)
+{
+  return RTPHEADER_RB32(h->csrc + i * 4);
+}
+
+#endif
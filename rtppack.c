@@ -0,0 +1,232 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rtpdataheader.h"
+#include "rtppack.h"
+
+#define STAP_A 24
+#define FU_A   28
+
+#define STAP_MAX 64   /* NAL units per aggregation packet */
+
+struct RtpPack {
+  int mtu;
+  int payloadType;
+  uint32_t ssrc;
+  unsigned short seq;
+  unsigned int timestamp;
+
+  /* small NAL units waiting to share a packet */
+  const uint8_t *stap[STAP_MAX];
+  int stapSize[STAP_MAX];
+  int stapCount;
+  int stapBytes;          /* STAP-A payload they would take */
+
+  RtpPack_Send send;
+  void *opaque;
+
+  uint8_t pkt[RTPPACK_MAX_MTU];
+  RtpPackStats stats;
+};
+
+RtpPack *RtpPack_Create(int mtu, int payloadType, uint32_t ssrc, unsigned short seq,
+                        RtpPack_Send send, void *opaque)
+{
+  /* room for the RTP header, FU indicator and header and some payload */
+  if(mtu < (int)sizeof(rtp_hdr_t) + 3 || mtu > RTPPACK_MAX_MTU)
+    return NULL;
+
+  RtpPack *p = calloc(1, sizeof(RtpPack));
+  if(!p)
+    return NULL;
+
+  p->mtu = mtu;
+  p->payloadType = payloadType;
+  p->ssrc = ssrc;
+  p->seq = seq;
+  p->send = send;
+  p->opaque = opaque;
+  return p;
+}
+
+void RtpPack_Destroy(RtpPack *p)
+{
+  free(p);
+}
+
+static uint8_t *pkt_begin(RtpPack *p, int marker)
+{
+  rtp_hdr_t rtp;
+
+  memset(&rtp, 0, sizeof(rtp));
+  rtp.version = 2;
+  rtp.m = marker;
+  rtp.pt = p->payloadType;
+  rtp.seq = htons(p->seq);
+  rtp.ts = htonl(p->timestamp);
+  rtp.ssrc = htonl(p->ssrc);
+  memcpy(p->pkt, &rtp, sizeof(rtp));
+
+  return p->pkt + sizeof(rtp_hdr_t);
+}
+
+static void pkt_send(RtpPack *p, int len)
+{
+  len += sizeof(rtp_hdr_t);
+  p->seq++;
+  p->stats.packets++;
+  p->stats.bytes += len;
+  p->send(p->opaque, p->pkt, len);
+}
+
+static void stap_flush(RtpPack *p, int marker)
+{
+  int i;
+
+  if(p->stapCount == 0)
+    return;
+
+  uint8_t *payload = pkt_begin(p, marker);
+
+  if(p->stapCount == 1)  {
+    memcpy(payload, p->stap[0], p->stapSize[0]);
+    p->stats.single++;
+    pkt_send(p, p->stapSize[0]);
+  } else  {
+    /* F is the OR and NRI the highest of the aggregated units */
+    uint8_t f = 0, nri = 0;
+    uint8_t *q = payload + 1;
+    for(i = 0; i < p->stapCount; i++)  {
+      f |= p->stap[i][0] & 0x80;
+      if((p->stap[i][0] & 0x60) > nri)
+        nri = p->stap[i][0] & 0x60;
+      q[0] = p->stapSize[i] >> 8;
+      q[1] = p->stapSize[i];
+      memcpy(q + 2, p->stap[i], p->stapSize[i]);
+      q += 2 + p->stapSize[i];
+    }
+    payload[0] = f | nri | STAP_A;
+    p->stats.stap++;
+    pkt_send(p, q - payload);
+  }
+
+  p->stapCount = 0;
+  p->stapBytes = 0;
+}
+
+static void send_fu(RtpPack *p, const uint8_t *nal, int size, int last)
+{
+  int max = p->mtu - sizeof(rtp_hdr_t) - 2;
+  uint8_t indicator = (nal[0] & 0xe0) | FU_A;
+  uint8_t type = nal[0] & 0x1f;
+  int pos = 1;  /* the NAL header travels in the FU header */
+
+  while(pos < size)  {
+    int chunk = size - pos;
+    if(chunk > max)
+      chunk = max;
+    int end = pos + chunk == size;
+
+    uint8_t *payload = pkt_begin(p, last && end);
+    payload[0] = indicator;
+    payload[1] = (pos == 1 ? 0x80 : 0) | (end ? 0x40 : 0) | type;
+    memcpy(payload + 2, nal + pos, chunk);
+    p->stats.fu++;
+    pkt_send(p, chunk + 2);
+    pos += chunk;
+  }
+}
+
+int RtpPack_NextNal(const uint8_t *data, int size, int *pos, const uint8_t **nal)
+{
+  int i = *pos;
+
+  /* skip to the byte after the next 00 00 01 */
+  while(i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1))
+    i++;
+  if(i + 3 > size)  {
+    *pos = size;
+    return 0;
+  }
+  i += 3;
+
+  int start = i;
+  while(i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && (data[i + 2] == 1 || data[i + 2] == 0)))
+    i++;
+  if(i + 3 > size)
+    i = size;
+
+  /* trailing zero bytes belong to the next start code */
+  int end = i;
+  while(end > start && data[end - 1] == 0)
+    end--;
+
+  *pos = i;
+  *nal = data + start;
+  return end - start;
+}
+
+int RtpPack_AccessUnit(RtpPack *p, const uint8_t *data, int size, unsigned int timestamp)
+{
+  int room = p->mtu - sizeof(rtp_hdr_t);
+  int count = 0;
+  int pos = 0;
+
+  p->timestamp = timestamp;
+
+  /* one unit of lookahead tells which one is last, for the marker */
+  const uint8_t *nal, *next;
+  int len = RtpPack_NextNal(data, size, &pos, &nal);
+  while(len > 0)  {
+    int nextLen = RtpPack_NextNal(data, size, &pos, &next);
+    int last = nextLen <= 0;
+    count++;
+
+    if(len > room)  {
+      stap_flush(p, 0);
+      send_fu(p, nal, len, last);
+    } else  {
+      /* a STAP-A costs one byte of header and two of length per unit */
+      int need = (p->stapCount ? p->stapBytes : 1) + 2 + len;
+      if(p->stapCount && (need > room || p->stapCount == STAP_MAX))
+        stap_flush(p, 0);
+
+      p->stap[p->stapCount] = nal;
+      p->stapSize[p->stapCount] = len;
+      p->stapBytes = (p->stapCount ? p->stapBytes : 1) + 2 + len;
+      p->stapCount++;
+    }
+
+    nal = next;
+    len = nextLen;
+  }
+  stap_flush(p, 1);
+
+  return count;
+}
+
+void RtpPack_GetStats(RtpPack *p, RtpPackStats *stats)
+{
+  *stats = p->stats;
+}
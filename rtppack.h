@@ -0,0 +1,62 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPPACK_H
+#define RTPPACK_H
+
+#include <stdint.h>
+
+/*
+ * RFC 6184 packetizer, the sending side of rtpdepack. Access units in
+ * Annex B form go out as single NAL unit packets, STAP-A when several
+ * small NAL units fit in one packet, and FU-A when one does not fit.
+ * The marker bit is set on the last packet of each access unit.
+ */
+
+#define RTPPACK_MAX_MTU 1500
+
+/* pkt is only valid during the call */
+typedef void (*RtpPack_Send)(void *opaque, const uint8_t *pkt, int len);
+
+typedef struct RtpPackStats {
+  unsigned long long packets;
+  unsigned long long bytes;
+  unsigned long long single;      /* single NAL unit packets */
+  unsigned long long stap;        /* STAP-A packets */
+  unsigned long long fu;          /* FU-A packets */
+} RtpPackStats;
+
+typedef struct RtpPack RtpPack;
+
+/* mtu is the largest RTP packet, header included */
+RtpPack *RtpPack_Create(int mtu, int payloadType, uint32_t ssrc, unsigned short seq,
+                        RtpPack_Send send, void *opaque);
+void RtpPack_Destroy(RtpPack *p);
+/* returns the number of NAL units sent */
+int RtpPack_AccessUnit(RtpPack *p, const uint8_t *data, int size, unsigned int timestamp);
+void RtpPack_GetStats(RtpPack *p, RtpPackStats *stats);
+
+/*
+ * Next start code prefixed NAL unit at or after *pos in an Annex B buffer,
+ * returned without the start code; 0 when there is none left
+ */
+int RtpPack_NextNal(const uint8_t *data, int size, int *pos, const uint8_t **nal);
+
+#endif
@@ -0,0 +1,429 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "rtprecv.h"
+#include "affinity.h"
+
+#define RECV_BATCH 64
+#define RECV_SLOT_SIZE 2048
+#define IDLE_MS 10
+
+#define SOURCE_PENDING 0  /* waiting for the create thread, packets dropped */
+#define SOURCE_READY   1
+#define SOURCE_FAILED  2
+
+typedef struct RtpRecvSource {
+  struct sockaddr_in addr;
+  int number;
+  int state;                /* SOURCE_*, published with release */
+  RtpH264Session *session;  /* set before state turns SOURCE_READY */
+  int finished;
+  char filename[1024];      /* the session keeps pointing at it */
+} RtpRecvSource;
+
+typedef struct RtpRecvSocket {
+  RtpRecv *recv;
+  int fd;
+  pthread_t thread;
+  int running;
+
+  RtpRecvSource *sources;
+  int sourceCount;          /* published with release, read by others */
+
+  uint8_t *ring;
+  struct mmsghdr msgs[RECV_BATCH];
+  struct iovec iovs[RECV_BATCH];
+  struct sockaddr_in names[RECV_BATCH];
+  char ctrl[RECV_BATCH][RTPSOCKET_CMSG_SPACE];
+
+  RtpRecvSocketStats stats; /* written by the socket thread only */
+} RtpRecvSocket;
+
+/* single writer, relaxed atomic stores and loads so readers never see a torn value */
+#define STAT_SET(field, value) __atomic_store_n(&sk->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, sk->stats.field + (n))
+#define STAT_LOAD(field) (stats->field = __atomic_load_n(&sk->stats.field, __ATOMIC_RELAXED))
+
+struct RtpRecv {
+  RtpRecvConfig config;
+  RtpRecvSocket *sockets;
+  int sourceNumber;         /* next source number, shared by all sockets */
+  volatile int bStop;
+
+  /* sessions are created here, never on a socket thread */
+  pthread_t creator;
+  sem_t createQueued;
+  int creatorStop;
+};
+
+static unsigned int now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+RtpRecv *RtpRecv_Create(const RtpRecvConfig *cfg)
+{
+  int i, j;
+
+  if(cfg->sockets < 1 || cfg->maxSources < 1)
+    return NULL;
+
+  RtpRecv *r = calloc(1, sizeof(RtpRecv));
+  if(!r)
+    return NULL;
+
+  r->config = *cfg;
+  r->config.socket.reusePort = !cfg->portRange;
+  sem_init(&r->createQueued, 0, 0);
+  r->sockets = calloc(cfg->sockets, sizeof(RtpRecvSocket));
+  if(!r->sockets)
+    goto fail;
+  for(i = 0; i < cfg->sockets; i++)
+    r->sockets[i].fd = -1;
+
+  for(i = 0; i < cfg->sockets; i++)  {
+    RtpRecvSocket *sk = &r->sockets[i];
+    int port = cfg->portRange ? cfg->port + 2 * i : cfg->port;
+
+    sk->recv = r;
+    sk->stats.port = port;
+    sk->fd = RtpSocket_Open(cfg->ip, port, &r->config.socket);
+    sk->sources = calloc(cfg->maxSources, sizeof(RtpRecvSource));
+    sk->ring = malloc(RECV_BATCH * RECV_SLOT_SIZE);
+    if(sk->fd < 0 || !sk->sources || !sk->ring)  {
+      fprintf(stderr, "could not set up receive socket %d on port %d\n", i, port);
+      goto fail;
+    }
+    sk->stats.rcvbuf = RtpSocket_GetRcvbuf(sk->fd);
+
+    for(j = 0; j < RECV_BATCH; j++)  {
+      sk->iovs[j].iov_base = sk->ring + j * RECV_SLOT_SIZE;
+      sk->iovs[j].iov_len = RECV_SLOT_SIZE;
+      sk->msgs[j].msg_hdr.msg_iov = &sk->iovs[j];
+      sk->msgs[j].msg_hdr.msg_iovlen = 1;
+      sk->msgs[j].msg_hdr.msg_name = &sk->names[j];
+    }
+  }
+
+  return r;
+
+fail:
+  RtpRecv_Destroy(r);
+  return NULL;
+}
+
+void RtpRecv_Destroy(RtpRecv *r)
+{
+  int i, j;
+
+  if(!r)
+    return;
+
+  for(i = 0; r->sockets && i < r->config.sockets; i++)  {
+    RtpRecvSocket *sk = &r->sockets[i];
+    for(j = 0; j < sk->sourceCount; j++)
+      RtpH264Session_Destroy(sk->sources[j].session);
+    if(sk->fd >= 0)
+      close(sk->fd);
+    free(sk->sources);
+    free(sk->ring);
+  }
+  free(r->sockets);
+  sem_destroy(&r->createQueued);
+  free(r);
+}
+
+/*
+ * Session of the sender. An address not seen before gets a slot and
+ * its session is left to the create thread, as opening a decoder and
+ * a file would hold up every other sender on the socket.
+ */
+static RtpH264Session *source_session(RtpRecvSocket *sk, const struct sockaddr_in *addr)
+{
+  RtpRecv *r = sk->recv;
+  int i;
+
+  for(i = 0; i < sk->sourceCount; i++)  {
+    RtpRecvSource *src = &sk->sources[i];
+    if(src->addr.sin_addr.s_addr == addr->sin_addr.s_addr && src->addr.sin_port == addr->sin_port)  {
+      int state = __atomic_load_n(&src->state, __ATOMIC_ACQUIRE);
+      if(state == SOURCE_READY)
+        return src->session;
+      if(state == SOURCE_PENDING)
+        STAT_ADD(pending, 1);
+      else
+        STAT_ADD(refused, 1);
+      return NULL;
+    }
+  }
+
+  if(sk->sourceCount == r->config.maxSources)  {
+    STAT_ADD(refused, 1);
+    return NULL;
+  }
+
+  RtpRecvSource *src = &sk->sources[sk->sourceCount];
+  src->addr = *addr;
+  src->number = __atomic_fetch_add(&r->sourceNumber, 1, __ATOMIC_RELAXED);
+  src->state = SOURCE_PENDING;
+
+  /* a failed one stays in the table, so its packets are not retried */
+  __atomic_store_n(&sk->sourceCount, sk->sourceCount + 1, __ATOMIC_RELEASE);
+  STAT_SET(sources, sk->sourceCount);
+  STAT_ADD(pending, 1);
+  sem_post(&r->createQueued);
+  return NULL;
+}
+
+static void source_create(RtpRecv *r, RtpRecvSocket *sk, RtpRecvSource *src)
+{
+  RtpH264Config cfg = r->config.session;
+
+  if(cfg.filename)  {
+    snprintf(src->filename, sizeof(src->filename), cfg.filename, src->number);
+    cfg.filename = src->filename;
+  }
+
+  src->session = RtpH264Session_Create(&cfg);
+  if(src->session && RtpH264Session_Start(src->session, r->config.onPicture) < 0)  {
+    RtpH264Session_Destroy(src->session);
+    src->session = NULL;
+  }
+  if(!src->session)
+    fprintf(stderr, "could not create a session for %s:%d\n",
+      inet_ntoa(src->addr.sin_addr), ntohs(src->addr.sin_port));
+  else
+    printf("source %d: %s:%d on port %d\n", src->number,
+      inet_ntoa(src->addr.sin_addr), ntohs(src->addr.sin_port), sk->stats.port);
+
+  __atomic_store_n(&src->state, src->session ? SOURCE_READY : SOURCE_FAILED, __ATOMIC_RELEASE);
+}
+
+static void *create_thread(void *arg)
+{
+  RtpRecv *r = arg;
+  int i, j;
+
+  for(;;)  {
+    while(sem_wait(&r->createQueued) != 0 && errno == EINTR)
+      ;
+    if(__atomic_load_n(&r->creatorStop, __ATOMIC_ACQUIRE))
+      break;
+
+    for(i = 0; i < r->config.sockets; i++)  {
+      RtpRecvSocket *sk = &r->sockets[i];
+      int count = __atomic_load_n(&sk->sourceCount, __ATOMIC_ACQUIRE);
+      for(j = 0; j < count; j++)
+        if(__atomic_load_n(&sk->sources[j].state, __ATOMIC_ACQUIRE) == SOURCE_PENDING)
+          source_create(r, sk, &sk->sources[j]);
+    }
+  }
+
+  return NULL;
+}
+
+/* the session of a slot the socket thread may use, NULL while pending */
+static RtpH264Session *ready_session(RtpRecvSource *src)
+{
+  if(__atomic_load_n(&src->state, __ATOMIC_ACQUIRE) != SOURCE_READY)
+    return NULL;
+  return src->session;
+}
+
+static void finish_all(RtpRecvSocket *sk)
+{
+  int i;
+  for(i = 0; i < sk->sourceCount; i++)  {
+    RtpRecvSource *src = &sk->sources[i];
+    if(ready_session(src) && !src->finished)  {
+      RtpH264Session_Finish(src->session);
+      src->finished = 1;
+    }
+  }
+}
+
+static void idle_all(RtpRecvSocket *sk)
+{
+  int i;
+  for(i = 0; i < sk->sourceCount; i++)
+    if(ready_session(&sk->sources[i]))
+      RtpH264Session_Idle(sk->sources[i].session);
+}
+
+static void *socket_thread(void *arg)
+{
+  RtpRecvSocket *sk = arg;
+  RtpRecv *r = sk->recv;
+  unsigned int lastIdle = now_ms();
+  int i;
+
+  if(Affinity_PinCpus(r->config.session.receiveCpus, r->config.session.numaNode) < 0)
+    fprintf(stderr, "could not pin the receive thread of port %d\n", sk->stats.port);
+  Affinity_PreferNode(r->config.session.numaNode);
+
+  while(!r->bStop)  {
+    struct pollfd pfd = { sk->fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, IDLE_MS);
+
+    /* Drain the socket a batch at a time until it runs dry */
+    int n = ready > 0 ? RECV_BATCH : 0;
+    while(n == RECV_BATCH)  {
+      for(i = 0; i < RECV_BATCH; i++)  {
+        sk->msgs[i].msg_hdr.msg_control = sk->ctrl[i];
+        sk->msgs[i].msg_hdr.msg_controllen = sizeof(sk->ctrl[i]);
+        sk->msgs[i].msg_hdr.msg_namelen = sizeof(sk->names[i]);
+      }
+
+      n = recvmmsg(sk->fd, sk->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+      if(n <= 0)  {
+        if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          perror("recvmmsg");
+        break;
+      }
+
+      struct timespec rt;
+      clock_gettime(CLOCK_REALTIME, &rt);
+      unsigned long long batchUs = rt.tv_sec * 1000000ULL + rt.tv_nsec / 1000;
+
+      for(i = 0; i < n; i++)  {
+        struct msghdr *msg = &sk->msgs[i].msg_hdr;
+        int len = sk->msgs[i].msg_len;
+
+        STAT_ADD(packets, 1);
+        STAT_ADD(bytes, len);
+        long long drops = RtpSocket_Drops(msg);
+        if(drops >= 0)
+          STAT_SET(rxq_drops, drops);
+        if(msg->msg_flags & MSG_TRUNC)  {
+          STAT_ADD(truncated, 1);
+          continue;
+        }
+
+        RtpH264Session *s = source_session(sk, &sk->names[i]);
+        if(!s)
+          continue;
+        RtpH264Session_Input(s, sk->iovs[i].iov_base, len,
+                             RtpSocket_ArrivalUs(msg, batchUs), &sk->names[i]);
+      }
+    }
+
+    /* reorder and DON timeouts of quiet senders */
+    unsigned int now = now_ms();
+    if(ready <= 0 || now - lastIdle >= IDLE_MS)  {
+      idle_all(sk);
+      lastIdle = now;
+    }
+  }
+
+  finish_all(sk);
+  return NULL;
+}
+
+int RtpRecv_Run(RtpRecv *r)
+{
+  int i;
+  int ret = 0;
+
+  if(pthread_create(&r->creator, NULL, create_thread, r) != 0)  {
+    fprintf(stderr, "could not start the session create thread\n");
+    return -1;
+  }
+
+  for(i = 0; i < r->config.sockets; i++)  {
+    RtpRecvSocket *sk = &r->sockets[i];
+    if(pthread_create(&sk->thread, NULL, socket_thread, sk) != 0)  {
+      fprintf(stderr, "could not start the receive thread of port %d\n", sk->stats.port);
+      r->bStop = 1;
+      ret = -1;
+      break;
+    }
+    sk->running = 1;
+  }
+
+  for(i = 0; i < r->config.sockets; i++)  {
+    RtpRecvSocket *sk = &r->sockets[i];
+    if(sk->running)  {
+      pthread_join(sk->thread, NULL);
+      sk->running = 0;
+    }
+  }
+
+  __atomic_store_n(&r->creatorStop, 1, __ATOMIC_RELEASE);
+  sem_post(&r->createQueued);
+  pthread_join(r->creator, NULL);
+
+  /* sessions the create thread published after their socket thread ended */
+  for(i = 0; i < r->config.sockets; i++)
+    finish_all(&r->sockets[i]);
+
+  return ret;
+}
+
+void RtpRecv_Stop(RtpRecv *r)
+{
+  r->bStop = 1;
+}
+
+int RtpRecv_GetSocketCount(RtpRecv *r)
+{
+  return r->config.sockets;
+}
+
+void RtpRecv_GetSocketStats(RtpRecv *r, int index, RtpRecvSocketStats *stats)
+{
+  RtpRecvSocket *sk = &r->sockets[index];
+
+  STAT_LOAD(port);
+  STAT_LOAD(rcvbuf);
+  STAT_LOAD(packets);
+  STAT_LOAD(bytes);
+  STAT_LOAD(truncated);
+  STAT_LOAD(rxq_drops);
+  STAT_LOAD(refused);
+  STAT_LOAD(pending);
+  STAT_LOAD(sources);
+}
+
+int RtpRecv_GetSessions(RtpRecv *r, int index, RtpH264Session **sessions, int max)
+{
+  RtpRecvSocket *sk = &r->sockets[index];
+  int count = __atomic_load_n(&sk->sourceCount, __ATOMIC_ACQUIRE);
+  int i, n = 0;
+
+  for(i = 0; i < count && n < max; i++)
+    if(ready_session(&sk->sources[i]))
+      sessions[n++] = sk->sources[i].session;
+  return n;
+}
@@ -0,0 +1,76 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPRECV_H
+#define RTPRECV_H
+
+#include "rtph264.h"
+#include "rtpsocket.h"
+
+/*
+ * Many cameras, several receive threads. Each thread drains its own
+ * socket and gives every sender address a session of its own. A create
+ * thread makes it after the first packet so the socket keeps draining,
+ * and the sender's packets are dropped until it is there. The sockets
+ * either share one port through SO_REUSEPORT, where the kernel keeps
+ * each sender on one socket, or take a port each from a range: port,
+ * port + 2, ...
+ */
+
+typedef struct RtpRecvConfig {
+  in_addr_t ip;
+  int port;
+  int sockets;            /* receive threads, one socket each */
+  int portRange;          /* one port per socket instead of SO_REUSEPORT */
+  int maxSources;         /* sessions per socket, later senders are refused */
+  RtpSocketConfig socket;
+  RtpH264Config session;  /* for every session; filename, if set, is a printf
+                             pattern taking the source number as an int */
+  RtpH264_OnPicture onPicture;
+} RtpRecvConfig;
+
+typedef struct RtpRecvSocketStats {
+  int port;
+  int rcvbuf;             /* bytes as the kernel reports them, twice the usable size */
+  unsigned long long packets;
+  unsigned long long bytes;
+  unsigned long long truncated;
+  unsigned long long rxq_drops;  /* dropped by the kernel, buffer full */
+  unsigned long long refused;    /* packets from senders past maxSources or without a session */
+  unsigned long long pending;    /* packets dropped while their session was being created */
+  int sources;
+} RtpRecvSocketStats;
+
+typedef struct RtpRecv RtpRecv;
+
+RtpRecv *RtpRecv_Create(const RtpRecvConfig *cfg);
+/* frees every session, call after RtpRecv_Run() returned */
+void RtpRecv_Destroy(RtpRecv *r);
+/* blocks until RtpRecv_Stop(), then finishes every session */
+int RtpRecv_Run(RtpRecv *r);
+void RtpRecv_Stop(RtpRecv *r);
+int RtpRecv_GetSocketCount(RtpRecv *r);
+/* lock free, callable from any thread; each field is read atomically, not
+   the set of them, so counters may be a few packets apart */
+void RtpRecv_GetSocketStats(RtpRecv *r, int index, RtpRecvSocketStats *stats);
+/* sessions of a socket so far, stats may be read from them at any time */
+int RtpRecv_GetSessions(RtpRecv *r, int index, RtpH264Session **sessions, int max);
+
+#endif
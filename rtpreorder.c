@@ -0,0 +1,275 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtpreorder.h"
+
+#define SLOT_EMPTY    0
+#define SLOT_HELD     1
+#define SLOT_RELEASED 2
+
+/* in order packets behind the window that make a new sequence, RFC 3550 MIN_SEQUENTIAL */
+#define RESYNC_PACKETS 2
+
+typedef struct RtpReorderSlot {
+  unsigned short seq;
+  unsigned char state;
+  int len;
+  unsigned int arrival;   /* ms */
+  uint8_t *data;
+} RtpReorderSlot;
+
+struct RtpReorder {
+  int depth;              /* power of two */
+  int mask;
+  int latency;            /* ms */
+  int slotSize;
+  RtpReorderSlot *slots;
+  uint8_t *storage;
+
+  int started;
+  unsigned short next;    /* next sequence number to release */
+  unsigned short highest; /* highest sequence number accepted */
+  int held;
+
+  unsigned short badSeq;  /* next sequence number of a suspected restart */
+  int badRun;             /* packets seen of it */
+
+  RtpReorder_Release release;
+  void *opaque;
+
+  RtpReorderStats stats;
+};
+
+/* single writer, relaxed atomic stores so GetStats from another thread never sees a torn value */
+#define STAT_SET(field, value) __atomic_store_n(&r->stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, r->stats.field + (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_LOAD(field) (stats->field = __atomic_load_n(&r->stats.field, __ATOMIC_RELAXED))
+
+/* signed distance a - b on the 16-bit sequence circle */
+static inline int seq_diff(unsigned short a, unsigned short b)
+{
+  return (short)(unsigned short)(a - b);
+}
+
+RtpReorder *RtpReorder_Create(int depth, int latencyMs, int slotSize,
+                              RtpReorder_Release release, void *opaque)
+{
+  RtpReorder *r = calloc(1, sizeof(RtpReorder));
+  if(!r)
+    return NULL;
+
+  /* round depth up to a power of two, at most half the sequence space */
+  int d = 1;
+  while(d < depth && d < 0x4000)
+    d <<= 1;
+
+  r->depth = d;
+  r->mask = d - 1;
+  r->latency = latencyMs;
+  r->slotSize = slotSize;
+  r->release = release;
+  r->opaque = opaque;
+
+  r->slots = calloc(d, sizeof(RtpReorderSlot));
+  r->storage = malloc((size_t)d * slotSize);
+  if(!r->slots || !r->storage) {
+    RtpReorder_Destroy(r);
+    return NULL;
+  }
+
+  int i;
+  for(i = 0; i < d; i++)
+    r->slots[i].data = r->storage + (size_t)i * slotSize;
+
+  return r;
+}
+
+void RtpReorder_Destroy(RtpReorder *r)
+{
+  if(!r)
+    return;
+  free(r->storage);
+  free(r->slots);
+  free(r);
+}
+
+/* Release slot at r->next (if held) and advance the window by one */
+static void release_next(RtpReorder *r)
+{
+  RtpReorderSlot *s = &r->slots[r->next & r->mask];
+
+  if(s->state == SLOT_HELD && s->seq == r->next) {
+    s->state = SLOT_RELEASED;
+    r->held--;
+    r->release(r->opaque, s->data, s->len);
+  } else {
+    /* give up on this hole; remember it so a late arrival is recognised */
+    s->seq = r->next;
+    s->state = SLOT_EMPTY;
+    STAT_INC(lost);
+  }
+  r->next++;
+}
+
+/* Release the contiguous run starting at r->next */
+static void release_run(RtpReorder *r)
+{
+  for(;;) {
+    RtpReorderSlot *s = &r->slots[r->next & r->mask];
+    if(s->state != SLOT_HELD || s->seq != r->next)
+      break;
+    release_next(r);
+  }
+}
+
+/* Hand over what is held and start again at seq */
+static void resync(RtpReorder *r, unsigned short seq)
+{
+  RtpReorder_Flush(r);
+
+  int i;
+  for(i = 0; i < r->depth; i++)
+    r->slots[i].state = SLOT_EMPTY;
+
+  r->next = seq;
+  r->highest = seq;
+  r->badRun = 0;
+  STAT_INC(resyncs);
+}
+
+void RtpReorder_Push(RtpReorder *r, const uint8_t *pkt, int len, unsigned int nowMs)
+{
+  if(len < 4)
+    return;
+
+  unsigned short seq = (pkt[2] << 8) | pkt[3];
+
+  if(!r->started) {
+    r->started = 1;
+    r->next = seq;
+    r->highest = seq;
+  }
+
+  int d = seq_diff(seq, r->next);
+  RtpReorderSlot *s = &r->slots[seq & r->mask];
+
+  if(d < 0 && -d > r->depth) {
+    /* too old to be reordering: a sender restart once it runs in order */
+    if(r->badRun > 0 && seq == r->badSeq)
+      r->badRun++;
+    else
+      r->badRun = 1;
+    r->badSeq = seq + 1;
+
+    if(r->badRun < RESYNC_PACKETS) {
+      STAT_INC(late);
+      return;
+    }
+    resync(r, seq);
+    d = 0;
+  } else if(d < 0) {
+    if(s->seq == seq && s->state == SLOT_RELEASED)
+      STAT_INC(duplicate);
+    else
+      STAT_INC(late);
+    return;
+  } else {
+    r->badRun = 0;
+  }
+
+  if(len > r->slotSize) {
+    STAT_INC(oversize);
+    return;
+  }
+
+  /* far ahead of the window: release what is held, then jump */
+  while(d >= r->depth && r->held > 0) {
+    release_next(r);
+    d--;
+  }
+  if(d >= r->depth) {
+    STAT_ADD(lost, d - r->depth + 1);
+    r->next = seq - r->depth + 1;
+  }
+
+  if(s->state == SLOT_HELD && s->seq == seq) {
+    STAT_INC(duplicate);
+    return;
+  }
+
+  if(seq_diff(seq, r->highest) < 0)
+    STAT_INC(reordered);
+  else
+    r->highest = seq;
+
+  memcpy(s->data, pkt, len);
+  s->len = len;
+  s->seq = seq;
+  s->state = SLOT_HELD;
+  s->arrival = nowMs;
+  r->held++;
+
+  release_run(r);
+  RtpReorder_Poll(r, nowMs);
+}
+
+void RtpReorder_Poll(RtpReorder *r, unsigned int nowMs)
+{
+  /* skip holes while the oldest held packet is over its latency budget */
+  while(r->held > 0) {
+    int i;
+    RtpReorderSlot *oldest = NULL;
+    for(i = 0; i < r->depth; i++) {
+      RtpReorderSlot *s = &r->slots[(r->next + i) & r->mask];
+      if(s->state == SLOT_HELD && s->seq == (unsigned short)(r->next + i)) {
+        if(!oldest || (int)(s->arrival - oldest->arrival) < 0)
+          oldest = s;
+      }
+    }
+
+    if(!oldest || (int)(nowMs - oldest->arrival) < r->latency)
+      break;
+
+    /* give up on everything up to and including the oldest packet */
+    while(seq_diff(oldest->seq, r->next) >= 0)
+      release_next(r);
+    release_run(r);
+  }
+}
+
+void RtpReorder_Flush(RtpReorder *r)
+{
+  while(r->held > 0)
+    release_next(r);
+}
+
+void RtpReorder_GetStats(RtpReorder *r, RtpReorderStats *stats)
+{
+  STAT_LOAD(reordered);
+  STAT_LOAD(late);
+  STAT_LOAD(duplicate);
+  STAT_LOAD(lost);
+  STAT_LOAD(resyncs);
+  STAT_LOAD(oversize);
+}
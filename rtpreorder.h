@@ -0,0 +1,57 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPREORDER_H
+#define RTPREORDER_H
+
+#include <stdint.h>
+
+/*
+ * Bounded reorder buffer keyed on the 16-bit RTP sequence number.
+ * Packets are released through the callback strictly in sequence order.
+ * A hole is given up on once the buffer is full or the oldest held packet
+ * has waited longer than the latency budget. Consecutive packets far
+ * behind the window mean the sender restarted its sequence (RFC 3550
+ * A.1), the window is flushed and starts over at them.
+ */
+
+typedef void (*RtpReorder_Release)(void *opaque, const uint8_t *pkt, int len);
+
+typedef struct RtpReorderStats {
+  unsigned long long reordered;   /* accepted after a higher sequence number */
+  unsigned long long late;        /* arrived after its hole was given up */
+  unsigned long long duplicate;   /* already held or already released */
+  unsigned long long lost;        /* holes skipped over */
+  unsigned long long resyncs;     /* restarts on a new sequence number run */
+  unsigned long long oversize;    /* dropped, larger than a slot */
+} RtpReorderStats;
+
+typedef struct RtpReorder RtpReorder;
+
+RtpReorder *RtpReorder_Create(int depth, int latencyMs, int slotSize,
+                              RtpReorder_Release release, void *opaque);
+void RtpReorder_Destroy(RtpReorder *r);
+void RtpReorder_Push(RtpReorder *r, const uint8_t *pkt, int len, unsigned int nowMs);
+void RtpReorder_Poll(RtpReorder *r, unsigned int nowMs);
+void RtpReorder_Flush(RtpReorder *r);
+/* from any thread, each field is loaded atomically on its own */
+void RtpReorder_GetStats(RtpReorder *r, RtpReorderStats *stats);
+
+#endif
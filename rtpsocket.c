@@ -0,0 +1,142 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "rtpsocket.h"
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+int RtpSocket_Open(in_addr_t ip, int port, const RtpSocketConfig *cfg)
+{
+  struct sockaddr_in addr;
+  int on = 1;
+
+  int fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if(fd < 0)  {
+    perror("socket");
+    return -1;
+  }
+
+  if(cfg->reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)  {
+    perror("SO_REUSEPORT");
+    goto fail;
+  }
+
+  if(cfg->rcvbuf > 0)  {
+    /* FORCE ignores rmem_max but needs privileges, fall back to the capped one */
+    if(!cfg->rcvbufForce ||
+       setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &cfg->rcvbuf, sizeof(cfg->rcvbuf)) != 0)  {
+      if(cfg->rcvbufForce)
+        perror("SO_RCVBUFFORCE");
+      if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cfg->rcvbuf, sizeof(cfg->rcvbuf)) != 0)
+        perror("SO_RCVBUF");
+    }
+    /* the kernel doubles the request for its bookkeeping */
+    if(RtpSocket_GetRcvbuf(fd) / 2 < cfg->rcvbuf)
+      fprintf(stderr, "port %d: receive buffer capped at %d bytes, raise net.core.rmem_max\n",
+        port, RtpSocket_GetRcvbuf(fd) / 2);
+  }
+
+  if(cfg->busyPollUs > 0 &&
+     setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &cfg->busyPollUs, sizeof(cfg->busyPollUs)) != 0)
+    perror("SO_BUSY_POLL");
+
+  RtpSocket_EnableMeta(fd);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = ip;
+  addr.sin_port = htons(port);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)  {
+    perror("bind");
+    goto fail;
+  }
+
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+int RtpSocket_GetRcvbuf(int fd)
+{
+  int size = 0;
+  socklen_t len = sizeof(size);
+  if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) != 0)
+    return -1;
+  return size;
+}
+
+int RtpSocket_EnableMeta(int fd)
+{
+  int on = 1;
+  int ret = 0;
+
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)  {
+    perror("SO_TIMESTAMPNS");
+    ret = -1;
+  }
+  if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) != 0)  {
+    perror("SO_RXQ_OVFL");
+    ret = -1;
+  }
+  return ret;
+}
+
+unsigned long long RtpSocket_ArrivalUs(struct msghdr *msg, unsigned long long fallback)
+{
+  struct cmsghdr *cmsg;
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))  {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)  {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+  }
+  return fallback;
+}
+
+long long RtpSocket_Drops(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))  {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)  {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      return drops;
+    }
+  }
+  return -1;
+}
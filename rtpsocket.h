@@ -0,0 +1,59 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPSOCKET_H
+#define RTPSOCKET_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * UDP receive sockets sized for IDR bursts. Every socket reports kernel
+ * drops (SO_RXQ_OVFL), so whether the buffer is big enough can be read
+ * off the stats rather than guessed, and kernel receive times.
+ */
+
+/* control buffer per message for what RtpSocket_EnableMeta() turns on */
+#define RTPSOCKET_CMSG_SPACE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+typedef struct RtpSocketConfig {
+  int rcvbuf;             /* SO_RCVBUF bytes, 0 keeps the system default */
+  int rcvbufForce;        /* SO_RCVBUFFORCE past net.core.rmem_max, needs CAP_NET_ADMIN */
+  int busyPollUs;         /* SO_BUSY_POLL, 0 off */
+  int reusePort;          /* SO_REUSEPORT, several sockets share the port */
+} RtpSocketConfig;
+
+/* bound to ip:port, -1 on failure */
+int RtpSocket_Open(in_addr_t ip, int port, const RtpSocketConfig *cfg);
+/* receive buffer the kernel actually gave, in bytes */
+int RtpSocket_GetRcvbuf(int fd);
+/* SO_TIMESTAMPNS and SO_RXQ_OVFL, for a socket opened elsewhere */
+int RtpSocket_EnableMeta(int fd);
+/* kernel receive time of a message in us, fallback when there is none */
+unsigned long long RtpSocket_ArrivalUs(struct msghdr *msg, unsigned long long fallback);
+/*
+ * The socket's total of datagrams dropped for a full buffer, as carried
+ * by a received message's SO_RXQ_OVFL control data; -1 when absent
+ */
+long long RtpSocket_Drops(struct msghdr *msg);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rtpsource.h"
+
+#define FORMAT_PCAP    0
+#define FORMAT_RTPDUMP 1
+
+#define RECORD_MAX 65536
+
+/* pcap link types */
+#define LINK_NULL     0
+#define LINK_ETHERNET 1
+#define LINK_RAW      101
+#define LINK_SLL      113
+#define LINK_SLL2     276
+
+struct RtpSource {
+  FILE *f;
+  int format;
+  int port;
+
+  /* pcap */
+  int swapped;            /* written on a host of the other byte order */
+  int nanosecond;
+  int link;
+
+  /* rtpdump */
+  unsigned long long startUs;
+
+  uint8_t record[RECORD_MAX];
+  RtpSourceStats stats;
+};
+
+static inline unsigned int get16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint32_t pcap32(RtpSource *src, const uint8_t *p)
+{
+  if(src->swapped)
+    return get32(p);
+  return ((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/* RFC 5761: payload types 72-76 are RTCP on a shared port */
+static int is_rtp(const uint8_t *p, int len)
+{
+  if(len < 12 || (p[0] >> 6) != 2)
+    return 0;
+  int pt = p[1] & 0x7f;
+  return pt < 72 || pt > 76;
+}
+
+static int open_pcap(RtpSource *src, const uint8_t *h)
+{
+  uint32_t magic = ((uint32_t)h[3] << 24) | (h[2] << 16) | (h[1] << 8) | h[0];
+
+  switch(magic)  {
+    case 0xa1b2c3d4: break;
+    case 0xa1b23c4d: src->nanosecond = 1; break;
+    case 0xd4c3b2a1: src->swapped = 1; break;
+    case 0x4d3cb2a1: src->swapped = 1; src->nanosecond = 1; break;
+    default:
+      return -1;
+  }
+
+  src->link = pcap32(src, h + 20) & 0xffff;
+  if(src->link != LINK_NULL && src->link != LINK_ETHERNET && src->link != LINK_RAW &&
+     src->link != LINK_SLL && src->link != LINK_SLL2)  {
+    fprintf(stderr, "unsupported pcap link type %d\n", src->link);
+    return -1;
+  }
+  src->format = FORMAT_PCAP;
+  return 0;
+}
+
+static int open_rtpdump(RtpSource *src)
+{
+  /* "#!rtpplay1.0 address/port\n" then the binary file header */
+  char line[256];
+  uint8_t h[16];
+
+  rewind(src->f);
+  if(!fgets(line, sizeof(line), src->f) || strncmp(line, "#!rtpplay1.0 ", 13) != 0)
+    return -1;
+  if(fread(h, 1, sizeof(h), src->f) != sizeof(h))
+    return -1;
+
+  src->startUs = get32(h) * 1000000ULL + get32(h + 4);
+  src->format = FORMAT_RTPDUMP;
+  return 0;
+}
+
+RtpSource *RtpSource_Open(const char *filename, int port)
+{
+  RtpSource *src = calloc(1, sizeof(RtpSource));
+  if(!src)
+    return NULL;
+
+  src->port = port;
+  src->f = fopen(filename, "rb");
+  if(!src->f)  {
+    perror(filename);
+    free(src);
+    return NULL;
+  }
+
+  uint8_t h[24];
+  if(fread(h, 1, sizeof(h), src->f) != sizeof(h))
+    goto fail;
+
+  if(memcmp(h, "#!rtpplay", 9) == 0)  {
+    if(open_rtpdump(src) < 0)
+      goto fail;
+  } else if(open_pcap(src, h) < 0)
+    goto fail;
+
+  return src;
+
+fail:
+  fprintf(stderr, "%s is not a pcap or rtpdump file\n", filename);
+  fclose(src->f);
+  free(src);
+  return NULL;
+}
+
+void RtpSource_Close(RtpSource *src)
+{
+  if(!src)
+    return;
+  fclose(src->f);
+  free(src);
+}
+
+/* UDP payload of a captured frame, NULL when it is anything else */
+static const uint8_t *pcap_udp(RtpSource *src, const uint8_t *p, int len, int *payloadLen)
+{
+  int proto;
+
+  switch(src->link)  {
+    case LINK_NULL:
+      if(len < 4)
+        return NULL;
+      /* AF_INET, AF_INET6 differs between systems, go by the IP version */
+      p += 4;
+      len -= 4;
+      proto = len > 0 && (p[0] >> 4) == 6 ? 0x86dd : 0x0800;
+      break;
+    case LINK_ETHERNET:
+      if(len < 14)
+        return NULL;
+      proto = get16(p + 12);
+      p += 14;
+      len -= 14;
+      while((proto == 0x8100 || proto == 0x88a8) && len >= 4)  {
+        proto = get16(p + 2);
+        p += 4;
+        len -= 4;
+      }
+      break;
+    case LINK_SLL:
+      if(len < 16)
+        return NULL;
+      proto = get16(p + 14);
+      p += 16;
+      len -= 16;
+      break;
+    case LINK_SLL2:
+      if(len < 20)
+        return NULL;
+      proto = get16(p);
+      p += 20;
+      len -= 20;
+      break;
+    default:
+      proto = len > 0 && (p[0] >> 4) == 6 ? 0x86dd : 0x0800;
+      break;
+  }
+
+  if(proto == 0x0800)  {
+    if(len < 20 || (p[0] >> 4) != 4 || p[9] != 17)
+      return NULL;
+    /* fragments are not put back together */
+    if(get16(p + 6) & 0x3fff)
+      return NULL;
+    int ihl = (p[0] & 0x0f) * 4;
+    int total = get16(p + 2);
+    if(ihl < 20 || total < ihl || total > len)
+      return NULL;
+    p += ihl;
+    len = total - ihl;
+  } else if(proto == 0x86dd)  {
+    /* UDP right after the fixed header, no extension headers */
+    if(len < 40 || (p[0] >> 4) != 6 || p[6] != 17)
+      return NULL;
+    int payload = get16(p + 4);
+    if(40 + payload > len)
+      return NULL;
+    p += 40;
+    len = payload;
+  } else
+    return NULL;
+
+  if(len < 8)
+    return NULL;
+  int udpLen = get16(p + 4);
+  if(udpLen < 8 || udpLen > len)
+    return NULL;
+  if(src->port && get16(p + 2) != src->port)
+    return NULL;
+
+  *payloadLen = udpLen - 8;
+  return p + 8;
+}
+
+static int read_pcap(RtpSource *src, const uint8_t **pkt, unsigned long long *timeUs)
+{
+  uint8_t h[16];
+
+  for(;;)  {
+    if(fread(h, 1, sizeof(h), src->f) != sizeof(h))
+      return 0;
+
+    uint32_t caplen = pcap32(src, h + 8);
+    if(caplen > RECORD_MAX)
+      return -1;
+    if(fread(src->record, 1, caplen, src->f) != caplen)
+      return 0;
+    src->stats.records++;
+
+    int len;
+    const uint8_t *p = pcap_udp(src, src->record, caplen, &len);
+    if(!p || !is_rtp(p, len))  {
+      src->stats.skipped++;
+      continue;
+    }
+
+    uint32_t frac = pcap32(src, h + 4);
+    *timeUs = pcap32(src, h) * 1000000ULL + (src->nanosecond ? frac / 1000 : frac);
+    *pkt = p;
+    return len;
+  }
+}
+
+static int read_rtpdump(RtpSource *src, const uint8_t **pkt, unsigned long long *timeUs)
+{
+  uint8_t h[8];
+
+  for(;;)  {
+    if(fread(h, 1, sizeof(h), src->f) != sizeof(h))
+      return 0;
+
+    /* entry length includes this header, plen 0 marks RTCP */
+    int len = get16(h);
+    int plen = get16(h + 2);
+    if(len < 8)
+      return -1;
+    len -= 8;
+    if(fread(src->record, 1, len, src->f) != (size_t)len)
+      return 0;
+    src->stats.records++;
+
+    if(plen == 0 || !is_rtp(src->record, len))  {
+      src->stats.skipped++;
+      continue;
+    }
+
+    *timeUs = src->startUs + get32(h + 4) * 1000ULL;
+    *pkt = src->record;
+    return len;
+  }
+}
+
+int RtpSource_Read(RtpSource *src, uint8_t *buf, int size, unsigned long long *timeUs)
+{
+  const uint8_t *p;
+  int len;
+
+  if(src->format == FORMAT_PCAP)
+    len = read_pcap(src, &p, timeUs);
+  else
+    len = read_rtpdump(src, &p, timeUs);
+  if(len <= 0)
+    return len;
+
+  memcpy(buf, p, len < size ? len : size);
+  src->stats.packets++;
+  return len;
+}
+
+void RtpSource_GetStats(RtpSource *src, RtpSourceStats *stats)
+{
+  *stats = src->stats;
+}
@@ -0,0 +1,52 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef RTPSOURCE_H
+#define RTPSOURCE_H
+
+#include <stdint.h>
+
+/*
+ * RTP packets read back from a capture file instead of a socket, for
+ * replaying a stream through a session. pcap (Ethernet, Linux cooked,
+ * raw IP or loopback, IPv4 and IPv6 UDP) and rtpdump files are both
+ * read, told apart by their first bytes. RTCP packets are skipped.
+ */
+
+typedef struct RtpSourceStats {
+  unsigned long long records;     /* captured frames or rtpdump entries read */
+  unsigned long long packets;     /* RTP packets returned */
+  unsigned long long skipped;     /* not UDP, other port, fragments, RTCP */
+} RtpSourceStats;
+
+typedef struct RtpSource RtpSource;
+
+/* port selects the UDP destination port in a pcap, 0 takes every UDP datagram */
+RtpSource *RtpSource_Open(const char *filename, int port);
+void RtpSource_Close(RtpSource *src);
+/*
+ * Next packet into buf with its capture time in us. Returns the packet
+ * length, which is larger than size when it did not fit and was cut,
+ * 0 at the end of the file and -1 on a damaged file.
+ */
+int RtpSource_Read(RtpSource *src, uint8_t *buf, int size, unsigned long long *timeUs);
+void RtpSource_GetStats(RtpSource *src, RtpSourceStats *stats);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+
+#include "spscqueue.h"
+
+#define CACHE_LINE 64
+
+struct SpscQueue {
+  /* written by the producer only */
+  unsigned int head __attribute__ ((aligned (CACHE_LINE)));
+  /* written by the consumer only */
+  unsigned int tail __attribute__ ((aligned (CACHE_LINE)));
+
+  unsigned int mask __attribute__ ((aligned (CACHE_LINE)));
+  void **items;
+};
+
+SpscQueue *SpscQueue_Create(int capacity)
+{
+  SpscQueue *q;
+  if(posix_memalign((void **)&q, CACHE_LINE, sizeof(SpscQueue)) != 0)
+    return NULL;
+
+  /* power of two so the indexes can wrap freely */
+  unsigned int n = 2;
+  while(n < capacity)
+    n <<= 1;
+
+  q->head = 0;
+  q->tail = 0;
+  q->mask = n - 1;
+  q->items = calloc(n, sizeof(void *));
+  if(!q->items) {
+    free(q);
+    return NULL;
+  }
+
+  return q;
+}
+
+void SpscQueue_Destroy(SpscQueue *q)
+{
+  if(!q)
+    return;
+  free(q->items);
+  free(q);
+}
+
+int SpscQueue_Push(SpscQueue *q, void *item)
+{
+  unsigned int head = q->head;
+  unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+  if(head - tail > q->mask)
+    return 0;
+
+  q->items[head & q->mask] = item;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void *SpscQueue_Pop(SpscQueue *q)
+{
+  unsigned int tail = q->tail;
+  unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+  if(head == tail)
+    return NULL;
+
+  void *item = q->items[tail & q->mask];
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+int SpscQueue_Count(SpscQueue *q)
+{
+  return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+int SpscQueue_Capacity(SpscQueue *q)
+{
+  return q->mask + 1;
+}
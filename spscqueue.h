@@ -0,0 +1,38 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+/*
+ * Lock-free single producer / single consumer ring of pointers.
+ * Exactly one thread may push and exactly one thread may pop.
+ */
+
+typedef struct SpscQueue SpscQueue;
+
+SpscQueue *SpscQueue_Create(int capacity);
+void SpscQueue_Destroy(SpscQueue *q);
+int SpscQueue_Push(SpscQueue *q, void *item);  /* 0 when full */
+void *SpscQueue_Pop(SpscQueue *q);             /* NULL when empty */
+int SpscQueue_Count(SpscQueue *q);
+int SpscQueue_Capacity(SpscQueue *q);
+
+#endif
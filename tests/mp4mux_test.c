@@ -0,0 +1,308 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+
+/*
+ * Records a small generated H.264 stream through Mp4mux, then reads the
+ * file back with libavformat and decodes every frame. Samples have to
+ * be length prefixed as the avcC says, a start code where a length is
+ * expected breaks decoding.
+ *
+ * The stream is 16x16 baseline: an IDR of one I_PCM macroblock, so no
+ * encoder is needed, followed by P frames of one skipped macroblock.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_AV_CONFIG_H
+#undef HAVE_AV_CONFIG_H
+#endif
+
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+
+#include "../mp4mux.h"
+
+#define FRAMES 10
+#define GOP 5
+#define LUMA 0x70
+#define CHROMA 0x90
+
+typedef struct BitWriter {
+  uint8_t buf[1024];
+  int bits;
+} BitWriter;
+
+static void put_bits(BitWriter *bw, int n, unsigned int value)
+{
+  while(n-- > 0) {
+    if(value & (1u << n))
+      bw->buf[bw->bits >> 3] |= 0x80 >> (bw->bits & 7);
+    bw->bits++;
+  }
+}
+
+static void put_ue(BitWriter *bw, unsigned int value)
+{
+  int n = 0;
+  while((value + 1) >> (n + 1))
+    n++;
+  put_bits(bw, n, 0);
+  put_bits(bw, n + 1, value + 1);
+}
+
+static void put_align(BitWriter *bw)
+{
+  while(bw->bits & 7)
+    put_bits(bw, 1, 0);
+}
+
+static void put_trailing(BitWriter *bw)
+{
+  put_bits(bw, 1, 1);
+  put_align(bw);
+}
+
+/* append start code and NAL unit, with emulation prevention */
+static int put_nal(uint8_t *out, int startCode, int header, const BitWriter *bw)
+{
+  int n = 0, zeros = 0, i;
+
+  if(startCode == 4)
+    out[n++] = 0;
+  out[n++] = 0;
+  out[n++] = 0;
+  out[n++] = 1;
+  out[n++] = header;
+
+  for(i = 0; i < bw->bits / 8; i++) {
+    if(zeros >= 2 && bw->buf[i] <= 3) {
+      out[n++] = 3;
+      zeros = 0;
+    }
+    out[n++] = bw->buf[i];
+    zeros = bw->buf[i] ? 0 : zeros + 1;
+  }
+  return n;
+}
+
+static int put_sps(uint8_t *out)
+{
+  BitWriter bw;
+  memset(&bw, 0, sizeof(bw));
+  put_bits(&bw, 8, 66);     /* profile_idc, baseline */
+  put_bits(&bw, 8, 0);      /* constraint flags */
+  put_bits(&bw, 8, 10);     /* level_idc */
+  put_ue(&bw, 0);           /* seq_parameter_set_id */
+  put_ue(&bw, 0);           /* log2_max_frame_num_minus4 */
+  put_ue(&bw, 2);           /* pic_order_cnt_type */
+  put_ue(&bw, 1);           /* max_num_ref_frames */
+  put_bits(&bw, 1, 0);      /* gaps_in_frame_num_value_allowed_flag */
+  put_ue(&bw, 0);           /* pic_width_in_mbs_minus1 */
+  put_ue(&bw, 0);           /* pic_height_in_map_units_minus1 */
+  put_bits(&bw, 1, 1);      /* frame_mbs_only_flag */
+  put_bits(&bw, 1, 1);      /* direct_8x8_inference_flag */
+  put_bits(&bw, 1, 0);      /* frame_cropping_flag */
+  put_bits(&bw, 1, 0);      /* vui_parameters_present_flag */
+  put_trailing(&bw);
+  return put_nal(out, 4, 0x67, &bw);
+}
+
+static int put_pps(uint8_t *out)
+{
+  BitWriter bw;
+  memset(&bw, 0, sizeof(bw));
+  put_ue(&bw, 0);           /* pic_parameter_set_id */
+  put_ue(&bw, 0);           /* seq_parameter_set_id */
+  put_bits(&bw, 1, 0);      /* entropy_coding_mode_flag, CAVLC */
+  put_bits(&bw, 1, 0);      /* bottom_field_pic_order_in_frame_present_flag */
+  put_ue(&bw, 0);           /* num_slice_groups_minus1 */
+  put_ue(&bw, 0);           /* num_ref_idx_l0_default_active_minus1 */
+  put_ue(&bw, 0);           /* num_ref_idx_l1_default_active_minus1 */
+  put_bits(&bw, 1, 0);      /* weighted_pred_flag */
+  put_bits(&bw, 2, 0);      /* weighted_bipred_idc */
+  put_ue(&bw, 0);           /* pic_init_qp_minus26, se(0) */
+  put_ue(&bw, 0);           /* pic_init_qs_minus26 */
+  put_ue(&bw, 0);           /* chroma_qp_index_offset */
+  put_bits(&bw, 1, 1);      /* deblocking_filter_control_present_flag */
+  put_bits(&bw, 1, 0);      /* constrained_intra_pred_flag */
+  put_bits(&bw, 1, 0);      /* redundant_pic_cnt_present_flag */
+  put_trailing(&bw);
+  return put_nal(out, 3, 0x68, &bw);
+}
+
+static int put_idr(uint8_t *out)
+{
+  BitWriter bw;
+  int i;
+
+  memset(&bw, 0, sizeof(bw));
+  put_ue(&bw, 0);           /* first_mb_in_slice */
+  put_ue(&bw, 7);           /* slice_type, I */
+  put_ue(&bw, 0);           /* pic_parameter_set_id */
+  put_bits(&bw, 4, 0);      /* frame_num */
+  put_ue(&bw, 0);           /* idr_pic_id */
+  put_bits(&bw, 1, 0);      /* no_output_of_prior_pics_flag */
+  put_bits(&bw, 1, 0);      /* long_term_reference_flag */
+  put_ue(&bw, 0);           /* slice_qp_delta, se(0) */
+  put_ue(&bw, 1);           /* disable_deblocking_filter_idc */
+  put_ue(&bw, 25);          /* mb_type, I_PCM */
+  put_align(&bw);
+  for(i = 0; i < 256; i++)
+    put_bits(&bw, 8, LUMA);
+  for(i = 0; i < 128; i++)
+    put_bits(&bw, 8, CHROMA);
+  put_trailing(&bw);
+  return put_nal(out, 4, 0x65, &bw);
+}
+
+static int put_p(uint8_t *out, int frameNum)
+{
+  BitWriter bw;
+  memset(&bw, 0, sizeof(bw));
+  put_ue(&bw, 0);           /* first_mb_in_slice */
+  put_ue(&bw, 5);           /* slice_type, P */
+  put_ue(&bw, 0);           /* pic_parameter_set_id */
+  put_bits(&bw, 4, frameNum & 15);
+  put_bits(&bw, 1, 0);      /* num_ref_idx_active_override_flag */
+  put_bits(&bw, 1, 0);      /* ref_pic_list_modification_flag_l0 */
+  put_bits(&bw, 1, 0);      /* adaptive_ref_pic_marking_mode_flag */
+  put_ue(&bw, 0);           /* slice_qp_delta */
+  put_ue(&bw, 1);           /* disable_deblocking_filter_idc */
+  put_ue(&bw, 1);           /* mb_skip_run, the whole picture */
+  put_trailing(&bw);
+  return put_nal(out, 3, 0x41, &bw);
+}
+
+static int record(const char *filename)
+{
+  Mp4mux *mux = Mp4mux_Open(filename, MP4MUX_CLASSIC);
+  uint8_t au[4096];
+  int i;
+
+  if(!mux)
+    return -1;
+
+  for(i = 0; i < FRAMES; i++) {
+    AVPacket pkt;
+    int size = 0;
+
+    av_init_packet(&pkt);
+    if(i % GOP == 0) {
+      size += put_sps(au + size);
+      size += put_pps(au + size);
+      size += put_idr(au + size);
+      pkt.flags = PKT_FLAG_KEY;
+    } else {
+      size += put_p(au + size, i % GOP);
+    }
+    pkt.data = au;
+    pkt.size = size;
+    Mp4Mux_WriteVideo(mux, &pkt, 1000 + i * 3600);
+  }
+
+  Mp4mux_Close(mux);
+  return 0;
+}
+
+/* every NAL unit in a sample has a 4 byte length that fits */
+static int check_sample(const AVPacket *pkt)
+{
+  int off = 0;
+  while(off + 4 <= pkt->size) {
+    int len = (pkt->data[off] << 24) | (pkt->data[off + 1] << 16) |
+              (pkt->data[off + 2] << 8) | pkt->data[off + 3];
+    if(len <= 0 || off + 4 + len > pkt->size)
+      return -1;
+    off += 4 + len;
+  }
+  return off == pkt->size ? 0 : -1;
+}
+
+static int decode(const char *filename)
+{
+  AVFormatContext *ic = NULL;
+  AVFrame *picture = avcodec_alloc_frame();
+  int decoded = 0, samples = 0, bad = 0, wrong = 0;
+  int gotPicture;
+  AVPacket pkt;
+
+  if(av_open_input_file(&ic, filename, NULL, 0, NULL) < 0 || av_find_stream_info(ic) < 0) {
+    fprintf(stderr, "could not read %s\n", filename);
+    return -1;
+  }
+
+  AVCodecContext *c = ic->streams[0]->codec;
+  AVCodec *codec = avcodec_find_decoder(c->codec_id);
+  if(!codec || avcodec_open(c, codec) < 0) {
+    fprintf(stderr, "could not open the decoder\n");
+    av_close_input_file(ic);
+    return -1;
+  }
+
+  while(av_read_frame(ic, &pkt) >= 0) {
+    samples++;
+    if(check_sample(&pkt) < 0)
+      bad++;
+    if(avcodec_decode_video2(c, picture, &gotPicture, &pkt) >= 0 && gotPicture) {
+      decoded++;
+      if(picture->data[0][0] != LUMA || picture->data[1][0] != CHROMA)
+        wrong++;
+    }
+    av_free_packet(&pkt);
+  }
+
+  /* pictures the decoder still holds */
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+  while(avcodec_decode_video2(c, picture, &gotPicture, &pkt) >= 0 && gotPicture)
+    decoded++;
+
+  avcodec_close(c);
+  av_close_input_file(ic);
+  av_free(picture);
+
+  printf("%d samples, %d not length prefixed, %d decoded, %d with wrong pixels\n",
+    samples, bad, decoded, wrong);
+  return (samples == FRAMES && bad == 0 && decoded == FRAMES && wrong == 0) ? 0 : -1;
+}
+
+int main(void)
+{
+  char filename[] = "/tmp/mp4mux_test-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd < 0) {
+    perror(filename);
+    return 1;
+  }
+  close(fd);
+
+  av_register_all();
+
+  int ret = record(filename);
+  if(ret == 0)
+    ret = decode(filename);
+  unlink(filename);
+
+  printf("%s mp4mux decodes\n", ret == 0 ? "ok" : "FAIL");
+  return ret == 0 ? 0 : 1;
+}
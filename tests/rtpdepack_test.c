@@ -0,0 +1,126 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+
+/*
+ * Interleaved aggregation packets through the depacketizer: NAL units
+ * must come out in DON order, MTAP with DON = DONB + DOND per unit and
+ * STAP-B with consecutive DONs.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "../nalpool.h"
+#include "../rtpdepack.h"
+
+static uint8_t order[16];
+static int count;
+
+/* each test NAL unit is a header byte followed by its id */
+static void on_au(void *opaque, NalBuf *au)
+{
+  int i;
+  for(i = 0; i + 5 < au->size && count < 16; i++)  {
+    if(au->data[i] == 0 && au->data[i + 1] == 0 && au->data[i + 2] == 0 && au->data[i + 3] == 1)
+      order[count++] = au->data[i + 5];
+  }
+  NalBuf_Unref(au);
+}
+
+static int rtp_header(uint8_t *pkt, unsigned short seq)
+{
+  memset(pkt, 0, 12);
+  pkt[0] = 0x80;
+  pkt[1] = 0x80 | 96;
+  pkt[2] = seq >> 8;
+  pkt[3] = seq & 0xff;
+  pkt[7] = 90;
+  return 12;
+}
+
+static int check(const char *name, const uint8_t *expected, int n)
+{
+  if(count != n || memcmp(order, expected, n) != 0)  {
+    int i;
+    printf("FAIL %s :", name);
+    for(i = 0; i < count; i++)
+      printf(" %d", order[i]);
+    printf("\n");
+    return 1;
+  }
+  printf("ok %s\n", name);
+  return 0;
+}
+
+static int run(const char *name, const uint8_t *pkt, int len, const uint8_t *expected, int n)
+{
+  NalPool *pool = NalPool_Create(1024, 4);
+  RtpDepack *d = RtpDepack_Create(pool, on_au, NULL);
+  RtpDepack_SetDon(d, 8, 100, 1 << 20, 1000);
+
+  count = 0;
+  RtpDepack_Packet(d, pkt, len, 0);
+  RtpDepack_Flush(d);
+
+  RtpDepack_Destroy(d);
+  NalPool_Destroy(pool);
+  return check(name, expected, n);
+}
+
+int main(void)
+{
+  uint8_t pkt[64];
+  int failed = 0;
+  int n, i;
+
+  /* MTAP16, DONB 100, DONDs 4, 0, 3: DONs 104, 100, 103 */
+  const uint8_t donds[3] = { 4, 0, 3 };
+  n = rtp_header(pkt, 1);
+  pkt[n++] = 26;
+  pkt[n++] = 0;
+  pkt[n++] = 100;
+  for(i = 0; i < 3; i++)  {
+    pkt[n++] = 0;           /* size */
+    pkt[n++] = 2;
+    pkt[n++] = donds[i];
+    pkt[n++] = 0;           /* TS offset */
+    pkt[n++] = 0;
+    pkt[n++] = 0x61;        /* non-IDR slice */
+    pkt[n++] = i + 1;
+  }
+  const uint8_t mtapOrder[3] = { 2, 3, 1 };
+  failed |= run("mtap16 dond", pkt, n, mtapOrder, 3);
+
+  /* STAP-B, DON 7: units take 7, 8, 9 and keep their order */
+  n = rtp_header(pkt, 2);
+  pkt[n++] = 25;
+  pkt[n++] = 0;
+  pkt[n++] = 7;
+  for(i = 0; i < 3; i++)  {
+    pkt[n++] = 0;
+    pkt[n++] = 2;
+    pkt[n++] = 0x61;
+    pkt[n++] = i + 1;
+  }
+  const uint8_t stapOrder[3] = { 1, 2, 3 };
+  failed |= run("stap-b don", pkt, n, stapOrder, 3);
+
+  return failed;
+}
@@ -0,0 +1,180 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+
+/*
+ * The SSE2 and AVX2 kernels against the C reference, byte for byte.
+ * Sizes are odd and run over the vector widths, planes start off
+ * alignment and have odd strides. Whole destination buffers are
+ * compared, so a write past the end of a row shows up as well.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../yuvconv.h"
+
+#define SENTINEL 0xa5
+
+static const int sizes[][2] = {
+  { 1, 1 }, { 3, 5 }, { 15, 7 }, { 17, 9 }, { 31, 3 }, { 33, 11 },
+  { 63, 13 }, { 65, 15 }, { 127, 5 }, { 129, 17 }, { 255, 3 }, { 321, 9 },
+};
+
+static const char *level_names[] = { "C", "SSE2", "AVX2" };
+
+/* buffer with its data one to three bytes past an aligned address */
+typedef struct Plane {
+  uint8_t *alloc;
+  uint8_t *data;
+  int stride;
+  int size;
+} Plane;
+
+static void plane_alloc(Plane *p, int width, int height, int misalign)
+{
+  p->stride = width + 7 + 2 * misalign;   /* odd */
+  p->size = p->stride * height;
+  p->alloc = malloc(p->size + 64);
+  p->data = p->alloc + 32 + misalign;
+}
+
+static void plane_random(Plane *p)
+{
+  int i;
+  for(i = 0; i < p->size; i++)
+    p->data[i] = rand() & 0xff;
+}
+
+static void plane_fill(Plane *p)
+{
+  memset(p->data, SENTINEL, p->size);
+}
+
+typedef struct Case {
+  int width, height;
+  Plane y, u, v;          /* source */
+  Plane luma;             /* downscale source, 4x the destination */
+  Plane nv12[2];
+  Plane rgb24, bgra, down2, down4;
+} Case;
+
+static void case_alloc(Case *c, int width, int height)
+{
+  int cw = (width + 1) / 2, ch = (height + 1) / 2;
+
+  c->width = width;
+  c->height = height;
+  plane_alloc(&c->y, width, height, 1);
+  plane_alloc(&c->u, cw, ch, 2);
+  plane_alloc(&c->v, cw, ch, 3);
+  plane_alloc(&c->luma, width * 4, height * 4, 1);
+  plane_random(&c->y);
+  plane_random(&c->u);
+  plane_random(&c->v);
+  plane_random(&c->luma);
+
+  plane_alloc(&c->nv12[0], width, height, 3);
+  plane_alloc(&c->nv12[1], cw * 2, ch, 1);
+  plane_alloc(&c->rgb24, width * 3, height, 2);
+  plane_alloc(&c->bgra, width * 4, height, 1);
+  plane_alloc(&c->down2, width, height, 3);
+  plane_alloc(&c->down4, width, height, 2);
+}
+
+static void case_run(Case *c)
+{
+  uint8_t *src[3] = { c->y.data, c->u.data, c->v.data };
+  int srcStride[3] = { c->y.stride, c->u.stride, c->v.stride };
+  uint8_t *nv12[2] = { c->nv12[0].data, c->nv12[1].data };
+  int nv12Stride[2] = { c->nv12[0].stride, c->nv12[1].stride };
+
+  plane_fill(&c->nv12[0]);
+  plane_fill(&c->nv12[1]);
+  plane_fill(&c->rgb24);
+  plane_fill(&c->bgra);
+  plane_fill(&c->down2);
+  plane_fill(&c->down4);
+
+  YuvConv_ToNV12(src, srcStride, nv12, nv12Stride, c->width, c->height);
+  YuvConv_ToRGB24(src, srcStride, c->rgb24.data, c->rgb24.stride, c->width, c->height);
+  YuvConv_ToBGRA(src, srcStride, c->bgra.data, c->bgra.stride, c->width, c->height);
+  YuvConv_Downscale(c->luma.data, c->luma.stride, c->down2.data, c->down2.stride, c->width, c->height, 2);
+  YuvConv_Downscale(c->luma.data, c->luma.stride, c->down4.data, c->down4.stride, c->width, c->height, 4);
+}
+
+static uint8_t *copy(const Plane *p)
+{
+  uint8_t *d = malloc(p->size);
+  memcpy(d, p->data, p->size);
+  return d;
+}
+
+static int compare(const char *what, const Plane *p, const uint8_t *ref, int level, const Case *c)
+{
+  if(memcmp(p->data, ref, p->size) == 0)
+    return 0;
+  printf("FAIL %s %s %dx%d\n", level_names[level], what, c->width, c->height);
+  return 1;
+}
+
+int main(void)
+{
+  int top = YuvConv_GetLevel();
+  int failed = 0;
+  int i, level;
+
+  srand(1);
+  printf("CPU runs up to %s\n", level_names[top]);
+
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    Case c;
+    case_alloc(&c, sizes[i][0], sizes[i][1]);
+
+    YuvConv_SetLevel(YUVCONV_C);
+    case_run(&c);
+    uint8_t *ref[6] = { copy(&c.nv12[0]), copy(&c.nv12[1]), copy(&c.rgb24),
+                        copy(&c.bgra), copy(&c.down2), copy(&c.down4) };
+
+    for(level = YUVCONV_SSE2; level <= top; level++) {
+      YuvConv_SetLevel(level);
+      case_run(&c);
+      failed |= compare("nv12 y", &c.nv12[0], ref[0], level, &c);
+      failed |= compare("nv12 uv", &c.nv12[1], ref[1], level, &c);
+      failed |= compare("rgb24", &c.rgb24, ref[2], level, &c);
+      failed |= compare("bgra", &c.bgra, ref[3], level, &c);
+      failed |= compare("downscale 2", &c.down2, ref[4], level, &c);
+      failed |= compare("downscale 4", &c.down4, ref[5], level, &c);
+    }
+
+    int k;
+    for(k = 0; k < 6; k++)
+      free(ref[k]);
+    Plane *planes[] = { &c.y, &c.u, &c.v, &c.luma, &c.nv12[0], &c.nv12[1],
+                        &c.rgb24, &c.bgra, &c.down2, &c.down4 };
+    for(k = 0; k < sizeof(planes) / sizeof(planes[0]); k++)
+      free(planes[k]->alloc);
+  }
+
+  YuvConv_SetLevel(YUVCONV_AVX2);
+  printf("%s yuvconv %s matches C on %d sizes\n", failed ? "FAIL" : "ok",
+    top == YUVCONV_C ? "(no SIMD on this CPU)" : level_names[top], (int)(sizeof(sizes) / sizeof(sizes[0])));
+  return failed;
+}
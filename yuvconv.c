@@ -0,0 +1,420 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "yuvconv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct Kernels {
+  void (*nv12)(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n);
+  void (*rgb)(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int n, int bgra);
+  void (*down2)(const uint8_t *s0, const uint8_t *s1, uint8_t *dst, int n);
+  void (*down4)(const uint8_t *s0, const uint8_t *s1, const uint8_t *s2, const uint8_t *s3,
+                uint8_t *dst, int n);
+} Kernels;
+
+/*
+ * C reference
+ */
+
+static inline uint8_t clip(int v)
+{
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void nv12_c(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n)
+{
+  int i;
+  for(i = 0; i < n; i++) {
+    uv[2 * i] = u[i];
+    uv[2 * i + 1] = v[i];
+  }
+}
+
+/* n pixels, y starts on an even pixel */
+static void rgb_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int n, int bgra)
+{
+  int i;
+  for(i = 0; i < n; i++) {
+    int yy = (y[i] - 16) * 74;
+    int d = u[i >> 1] - 128;
+    int e = v[i >> 1] - 128;
+    uint8_t r = clip((yy + 102 * e + 32) >> 6);
+    uint8_t g = clip((yy - 25 * d - 52 * e + 32) >> 6);
+    uint8_t b = clip((yy + 129 * d + 32) >> 6);
+    if(bgra) {
+      dst[0] = b;
+      dst[1] = g;
+      dst[2] = r;
+      dst[3] = 0xff;
+      dst += 4;
+    } else {
+      dst[0] = r;
+      dst[1] = g;
+      dst[2] = b;
+      dst += 3;
+    }
+  }
+}
+
+static void down2_c(const uint8_t *s0, const uint8_t *s1, uint8_t *dst, int n)
+{
+  int i;
+  for(i = 0; i < n; i++)
+    dst[i] = (s0[2 * i] + s0[2 * i + 1] + s1[2 * i] + s1[2 * i + 1] + 2) >> 2;
+}
+
+static void down4_c(const uint8_t *s0, const uint8_t *s1, const uint8_t *s2, const uint8_t *s3,
+                    uint8_t *dst, int n)
+{
+  int i, j;
+  for(i = 0; i < n; i++) {
+    int sum = 8;
+    for(j = 4 * i; j < 4 * i + 4; j++)
+      sum += s0[j] + s1[j] + s2[j] + s3[j];
+    dst[i] = sum >> 4;
+  }
+}
+
+static const Kernels kernels_c = { nv12_c, rgb_c, down2_c, down4_c };
+
+#ifdef HAVE_X86
+
+/*
+ * SSE2
+ */
+
+__attribute__((target("sse2")))
+static void nv12_sse2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n)
+{
+  int i;
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(u + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+    _mm_storeu_si128((__m128i *)(uv + 2 * i), _mm_unpacklo_epi8(a, b));
+    _mm_storeu_si128((__m128i *)(uv + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+  }
+  nv12_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+/*
+ * 8 pixels of Y and their (duplicated) U and V, as 16 bit lanes, to R, G
+ * and B in 16 bit lanes. Intermediates only saturate above 255 << 6, so
+ * the result matches the C reference.
+ */
+__attribute__((target("sse2")))
+static inline void yuv_to_rgb8(__m128i y, __m128i d, __m128i e, __m128i *r, __m128i *g, __m128i *b)
+{
+  const __m128i round = _mm_set1_epi16(32);
+  __m128i yy = _mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(74));
+
+  *r = _mm_adds_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(e, _mm_set1_epi16(102))), round);
+  *g = _mm_subs_epi16(yy, _mm_mullo_epi16(d, _mm_set1_epi16(25)));
+  *g = _mm_adds_epi16(_mm_subs_epi16(*g, _mm_mullo_epi16(e, _mm_set1_epi16(52))), round);
+  *b = _mm_adds_epi16(_mm_adds_epi16(yy, _mm_mullo_epi16(d, _mm_set1_epi16(129))), round);
+
+  *r = _mm_srai_epi16(*r, 6);
+  *g = _mm_srai_epi16(*g, 6);
+  *b = _mm_srai_epi16(*b, 6);
+}
+
+/* Interleave 16 pixels of R, G and B bytes */
+__attribute__((target("sse2")))
+static inline void store_rgb16(uint8_t *dst, __m128i r, __m128i g, __m128i b, int bgra)
+{
+  if(bgra) {
+    __m128i bg0 = _mm_unpacklo_epi8(b, g);
+    __m128i bg1 = _mm_unpackhi_epi8(b, g);
+    __m128i ra0 = _mm_unpacklo_epi8(r, _mm_set1_epi8(-1));
+    __m128i ra1 = _mm_unpackhi_epi8(r, _mm_set1_epi8(-1));
+    _mm_storeu_si128((__m128i *)(dst), _mm_unpacklo_epi16(bg0, ra0));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg0, ra0));
+    _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(bg1, ra1));
+    _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(bg1, ra1));
+  } else {
+    /* no 3 byte shuffle in SSE2 */
+    uint8_t rr[16] __attribute__((aligned(16)));
+    uint8_t gg[16] __attribute__((aligned(16)));
+    uint8_t bb[16] __attribute__((aligned(16)));
+    int i;
+    _mm_store_si128((__m128i *)rr, r);
+    _mm_store_si128((__m128i *)gg, g);
+    _mm_store_si128((__m128i *)bb, b);
+    for(i = 0; i < 16; i++) {
+      dst[3 * i] = rr[i];
+      dst[3 * i + 1] = gg[i];
+      dst[3 * i + 2] = bb[i];
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void rgb_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int n, int bgra)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bias = _mm_set1_epi16(128);
+  int bpp = bgra ? 4 : 3;
+  int i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m128i y8 = _mm_loadu_si128((const __m128i *)(y + i));
+    __m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u + i / 2)), zero), bias);
+    __m128i e = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(v + i / 2)), zero), bias);
+    __m128i r0, g0, b0, r1, g1, b1;
+
+    yuv_to_rgb8(_mm_unpacklo_epi8(y8, zero), _mm_unpacklo_epi16(d, d), _mm_unpacklo_epi16(e, e), &r0, &g0, &b0);
+    yuv_to_rgb8(_mm_unpackhi_epi8(y8, zero), _mm_unpackhi_epi16(d, d), _mm_unpackhi_epi16(e, e), &r1, &g1, &b1);
+
+    store_rgb16(dst + i * bpp, _mm_packus_epi16(r0, r1), _mm_packus_epi16(g0, g1),
+                _mm_packus_epi16(b0, b1), bgra);
+  }
+  rgb_c(y + i, u + i / 2, v + i / 2, dst + i * bpp, n - i, bgra);
+}
+
+/* 16 bytes to 8 sums of horizontal pairs */
+__attribute__((target("sse2")))
+static inline __m128i pair_sums(const uint8_t *p)
+{
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  return _mm_add_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static void down2_sse2(const uint8_t *s0, const uint8_t *s1, uint8_t *dst, int n)
+{
+  const __m128i round = _mm_set1_epi16(2);
+  int i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m128i a = _mm_add_epi16(pair_sums(s0 + 2 * i), pair_sums(s1 + 2 * i));
+    __m128i b = _mm_add_epi16(pair_sums(s0 + 2 * i + 16), pair_sums(s1 + 2 * i + 16));
+    a = _mm_srli_epi16(_mm_add_epi16(a, round), 2);
+    b = _mm_srli_epi16(_mm_add_epi16(b, round), 2);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+  }
+  down2_c(s0 + 2 * i, s1 + 2 * i, dst + i, n - i);
+}
+
+/* 4 output pixels of a 4x4 box, as 32 bit sums */
+__attribute__((target("sse2")))
+static inline __m128i box4(const uint8_t *s0, const uint8_t *s1, const uint8_t *s2, const uint8_t *s3)
+{
+  __m128i v = _mm_add_epi16(_mm_add_epi16(pair_sums(s0), pair_sums(s1)),
+                            _mm_add_epi16(pair_sums(s2), pair_sums(s3)));
+  v = _mm_madd_epi16(v, _mm_set1_epi16(1));
+  return _mm_srli_epi32(_mm_add_epi32(v, _mm_set1_epi32(8)), 4);
+}
+
+__attribute__((target("sse2")))
+static void down4_sse2(const uint8_t *s0, const uint8_t *s1, const uint8_t *s2, const uint8_t *s3,
+                       uint8_t *dst, int n)
+{
+  int i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    int o = 4 * i;
+    __m128i a = box4(s0 + o, s1 + o, s2 + o, s3 + o);
+    __m128i b = box4(s0 + o + 16, s1 + o + 16, s2 + o + 16, s3 + o + 16);
+    __m128i c = box4(s0 + o + 32, s1 + o + 32, s2 + o + 32, s3 + o + 32);
+    __m128i d = box4(s0 + o + 48, s1 + o + 48, s2 + o + 48, s3 + o + 48);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+  }
+  down4_c(s0 + 4 * i, s1 + 4 * i, s2 + 4 * i, s3 + 4 * i, dst + i, n - i);
+}
+
+static const Kernels kernels_sse2 = { nv12_sse2, rgb_sse2, down2_sse2, down4_sse2 };
+
+/*
+ * AVX2
+ */
+
+__attribute__((target("avx2")))
+static void nv12_avx2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n)
+{
+  int i;
+  for(i = 0; i + 32 <= n; i += 32) {
+    /* unpack works per 128 bit lane, put the quadwords in lane order first */
+    __m256i a = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)(u + i)), 0xd8);
+    __m256i b = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)(v + i)), 0xd8);
+    _mm256_storeu_si256((__m256i *)(uv + 2 * i), _mm256_unpacklo_epi8(a, b));
+    _mm256_storeu_si256((__m256i *)(uv + 2 * i + 32), _mm256_unpackhi_epi8(a, b));
+  }
+  nv12_sse2(u + i, v + i, uv + 2 * i, n - i);
+}
+
+/* 16 bit lanes back to 16 bytes, in order */
+__attribute__((target("avx2")))
+static inline __m128i pack16(__m256i v)
+{
+  return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static void rgb_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int n, int bgra)
+{
+  const __m256i round = _mm256_set1_epi16(32);
+  const __m256i bias = _mm256_set1_epi16(128);
+  int bpp = bgra ? 4 : 3;
+  int i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m128i u8 = _mm_loadl_epi64((const __m128i *)(u + i / 2));
+    __m128i v8 = _mm_loadl_epi64((const __m128i *)(v + i / 2));
+    __m256i yy = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + i)));
+    __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u8, u8)), bias);
+    __m256i e = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v8, v8)), bias);
+
+    yy = _mm256_mullo_epi16(_mm256_sub_epi16(yy, _mm256_set1_epi16(16)), _mm256_set1_epi16(74));
+    __m256i r = _mm256_adds_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(e, _mm256_set1_epi16(102))), round);
+    __m256i g = _mm256_subs_epi16(yy, _mm256_mullo_epi16(d, _mm256_set1_epi16(25)));
+    g = _mm256_adds_epi16(_mm256_subs_epi16(g, _mm256_mullo_epi16(e, _mm256_set1_epi16(52))), round);
+    __m256i b = _mm256_adds_epi16(_mm256_adds_epi16(yy, _mm256_mullo_epi16(d, _mm256_set1_epi16(129))), round);
+
+    store_rgb16(dst + i * bpp, pack16(_mm256_srai_epi16(r, 6)), pack16(_mm256_srai_epi16(g, 6)),
+                pack16(_mm256_srai_epi16(b, 6)), bgra);
+  }
+  rgb_c(y + i, u + i / 2, v + i / 2, dst + i * bpp, n - i, bgra);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pair_sums32(const uint8_t *p)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i *)p);
+  return _mm256_add_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xff)), _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2")))
+static void down2_avx2(const uint8_t *s0, const uint8_t *s1, uint8_t *dst, int n)
+{
+  const __m256i round = _mm256_set1_epi16(2);
+  int i;
+
+  for(i = 0; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_add_epi16(pair_sums32(s0 + 2 * i), pair_sums32(s1 + 2 * i));
+    __m256i b = _mm256_add_epi16(pair_sums32(s0 + 2 * i + 32), pair_sums32(s1 + 2 * i + 32));
+    a = _mm256_srli_epi16(_mm256_add_epi16(a, round), 2);
+    b = _mm256_srli_epi16(_mm256_add_epi16(b, round), 2);
+    /* packus interleaves the lanes of a and b, undo it */
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+  }
+  down2_sse2(s0 + 2 * i, s1 + 2 * i, dst + i, n - i);
+}
+
+/* 4x is bound by loads, the SSE2 version is as fast */
+static const Kernels kernels_avx2 = { nv12_avx2, rgb_avx2, down2_avx2, down4_sse2 };
+
+#endif
+
+static int cpuLevel = -1;
+static int maxLevel = YUVCONV_AVX2;
+
+int YuvConv_GetLevel()
+{
+  if(cpuLevel < 0) {
+    int level = YUVCONV_C;
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+      level = YUVCONV_AVX2;
+    else if(__builtin_cpu_supports("sse2"))
+      level = YUVCONV_SSE2;
+#endif
+    cpuLevel = level;
+  }
+  return cpuLevel;
+}
+
+void YuvConv_SetLevel(int level)
+{
+  maxLevel = level;
+}
+
+static const Kernels *kernels()
+{
+  int level = YuvConv_GetLevel();
+  if(level > maxLevel)
+    level = maxLevel;
+
+#ifdef HAVE_X86
+  if(level == YUVCONV_AVX2)
+    return &kernels_avx2;
+  if(level == YUVCONV_SSE2)
+    return &kernels_sse2;
+#endif
+  return &kernels_c;
+}
+
+void YuvConv_ToNV12(uint8_t *const src[3], const int srcStride[3],
+                    uint8_t *const dst[2], const int dstStride[2], int width, int height)
+{
+  const Kernels *k = kernels();
+  int cw = (width + 1) / 2, ch = (height + 1) / 2;
+  int j;
+
+  for(j = 0; j < height; j++)
+    memcpy(dst[0] + j * dstStride[0], src[0] + j * srcStride[0], width);
+  for(j = 0; j < ch; j++)
+    k->nv12(src[1] + j * srcStride[1], src[2] + j * srcStride[2], dst[1] + j * dstStride[1], cw);
+}
+
+static void to_rgb(uint8_t *const src[3], const int srcStride[3],
+                   uint8_t *dst, int dstStride, int width, int height, int bgra)
+{
+  const Kernels *k = kernels();
+  int j;
+
+  for(j = 0; j < height; j++)
+    k->rgb(src[0] + j * srcStride[0], src[1] + (j / 2) * srcStride[1], src[2] + (j / 2) * srcStride[2],
+           dst + j * dstStride, width, bgra);
+}
+
+void YuvConv_ToRGB24(uint8_t *const src[3], const int srcStride[3],
+                     uint8_t *dst, int dstStride, int width, int height)
+{
+  to_rgb(src, srcStride, dst, dstStride, width, height, 0);
+}
+
+void YuvConv_ToBGRA(uint8_t *const src[3], const int srcStride[3],
+                    uint8_t *dst, int dstStride, int width, int height)
+{
+  to_rgb(src, srcStride, dst, dstStride, width, height, 1);
+}
+
+void YuvConv_Downscale(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+                       int width, int height, int factor)
+{
+  const Kernels *k = kernels();
+  int j;
+
+  for(j = 0; j < height; j++) {
+    const uint8_t *s = src + j * factor * srcStride;
+    if(factor == 4)
+      k->down4(s, s + srcStride, s + 2 * srcStride, s + 3 * srcStride, dst + j * dstStride, width);
+    else
+      k->down2(s, s + srcStride, dst + j * dstStride, width);
+  }
+}
@@ -0,0 +1,58 @@
+/*
+ * (C) Copyright 2010
+ * Steve Chang
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ *
+*/
+#ifndef YUVCONV_H
+#define YUVCONV_H
+
+#include <stdint.h>
+
+/*
+ * YUV420P conversion and box filter downscale. Every kernel has a plain
+ * C reference and SSE2/AVX2 versions that give bit identical output;
+ * the fastest one the CPU supports is picked at run time.
+ *
+ * RGB output is BT.601 limited range in 6 bit fixed point:
+ *   R = (74 (Y - 16) + 102 (V - 128) + 32) >> 6
+ *   G = (74 (Y - 16) - 25 (U - 128) - 52 (V - 128) + 32) >> 6
+ *   B = (74 (Y - 16) + 129 (U - 128) + 32) >> 6
+ * clipped to 0..255. Downscaling averages each 2x2 or 4x4 block,
+ * rounding to nearest.
+ */
+
+#define YUVCONV_C    0
+#define YUVCONV_SSE2 1
+#define YUVCONV_AVX2 2
+
+/* best level this CPU runs */
+int YuvConv_GetLevel();
+/* use at most this level, for comparing against the C reference */
+void YuvConv_SetLevel(int level);
+
+void YuvConv_ToNV12(uint8_t *const src[3], const int srcStride[3],
+                    uint8_t *const dst[2], const int dstStride[2], int width, int height);
+void YuvConv_ToRGB24(uint8_t *const src[3], const int srcStride[3],
+                     uint8_t *dst, int dstStride, int width, int height);
+void YuvConv_ToBGRA(uint8_t *const src[3], const int srcStride[3],
+                    uint8_t *dst, int dstStride, int width, int height);
+/* width and height are of the destination, factor is 2 or 4 */
+void YuvConv_Downscale(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+                       int width, int height, int factor);
+
+#endif